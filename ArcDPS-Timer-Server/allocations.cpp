@@ -0,0 +1,38 @@
+// Replaces the global operator new to count the heap allocations each shard makes, exported as
+// arcdps_timer_allocations_total so a load test can tell what a message costs. Allocations of
+// other threads are not counted. Only linked into measuring builds, see CMakeLists.txt.
+
+#include <new>
+#include <cstdlib>
+
+#include "shard.h"
+
+void* operator new(std::size_t size) {
+	if (Shard* shard = Shard::current()) {
+		shard->stats.allocations.increment();
+	}
+	if (void* pointer = std::malloc(size == 0 ? 1 : size)) {
+		return pointer;
+	}
+	throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size) {
+	return ::operator new(size);
+}
+
+void operator delete(void* pointer) noexcept {
+	std::free(pointer);
+}
+
+void operator delete[](void* pointer) noexcept {
+	std::free(pointer);
+}
+
+void operator delete(void* pointer, std::size_t) noexcept {
+	std::free(pointer);
+}
+
+void operator delete[](void* pointer, std::size_t) noexcept {
+	std::free(pointer);
+}
@@ -0,0 +1,82 @@
+#include "capture.h"
+
+#include <stdexcept>
+
+// records are buffered up to this many bytes before they are written out
+constexpr std::size_t capture_buffer_size = 256 * 1024;
+
+static void append_little_endian(std::string& out, std::uint64_t value, std::size_t bytes) {
+	for (std::size_t i = 0; i < bytes; ++i) {
+		out.push_back(static_cast<char>((value >> (8 * i)) & 0xFF));
+	}
+}
+
+static std::uint64_t read_little_endian(std::string_view in, std::size_t bytes) {
+	std::uint64_t value = 0;
+	for (std::size_t i = 0; i < bytes; ++i) {
+		value |= static_cast<std::uint64_t>(static_cast<std::uint8_t>(in[i])) << (8 * i);
+	}
+	return value;
+}
+
+static void append_record(std::string& out, const CaptureRecord& record) {
+	append_little_endian(out, record.time, 8);
+	append_little_endian(out, record.session, 4);
+	out.push_back(static_cast<char>(record.kind));
+	append_little_endian(out, record.data.size(), 2);
+	out.append(record.data);
+}
+
+bool read_capture(std::string_view contents, const std::function<void(const CaptureRecord&)>& on_record) {
+	if (!contents.starts_with(capture_magic)) {
+		return false;
+	}
+
+	std::size_t offset = capture_magic.size();
+	while (contents.size() - offset >= capture_header_size) {
+		const std::string_view header = contents.substr(offset, capture_header_size);
+		const std::size_t length = read_little_endian(header.substr(13), 2);
+		if (contents.size() - offset - capture_header_size < length) {
+			break;
+		}
+
+		on_record(CaptureRecord{
+			.time = read_little_endian(header, 8),
+			.session = static_cast<std::uint32_t>(read_little_endian(header.substr(8), 4)),
+			.kind = static_cast<CaptureKind>(header[12]),
+			.data = contents.substr(offset + capture_header_size, length)
+		});
+		offset += capture_header_size + length;
+	}
+	return true;
+}
+
+CaptureFile::CaptureFile(const std::string& path)
+:	file(std::fopen(path.c_str(), "wb")) {
+	if (file == nullptr) {
+		throw std::runtime_error("Could not open capture file " + path);
+	}
+	buffer.reserve(capture_buffer_size);
+	buffer.append(capture_magic);
+}
+
+CaptureFile::~CaptureFile() {
+	flush();
+	std::fclose(file);
+}
+
+void CaptureFile::append(const CaptureRecord& record) {
+	append_record(buffer, record);
+	if (buffer.size() >= capture_buffer_size) {
+		flush();
+	}
+}
+
+void CaptureFile::flush() {
+	if (buffer.empty()) {
+		return;
+	}
+	std::fwrite(buffer.data(), 1, buffer.size(), file);
+	std::fflush(file);
+	buffer.clear();
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstdio>
+#include <string>
+#include <cstdint>
+#include <functional>
+#include <string_view>
+
+// Traffic capture for replaying. A capture file starts with a magic header followed by records:
+// uint64 little endian nanoseconds since the capture started, uint32 little endian session id,
+// uint8 kind, uint16 little endian length, data. Session ids are unique within one file, the
+// server writes one file per shard. Reading stops at a truncated record.
+enum class CaptureKind : std::uint8_t {
+	open = 0,  // the session connected, no data
+	line = 1,  // a JSON command line without its newline
+	frame = 2, // a binary frame without its length: uint8 kind and body
+	close = 3  // the session stopped reading, no data
+};
+
+constexpr std::string_view capture_magic = "ATCAP001";
+constexpr std::size_t capture_header_size = 8 + 4 + 1 + 2;
+constexpr std::size_t capture_max_data = 0xFFFF;
+
+struct CaptureRecord {
+	std::uint64_t time; // nanoseconds
+	std::uint32_t session;
+	CaptureKind kind;
+	std::string_view data;
+};
+
+// Calls on_record for each record, returns false if the contents are no capture.
+bool read_capture(std::string_view contents, const std::function<void(const CaptureRecord&)>& on_record);
+
+// Buffered append-only capture file, records reach the disk in large writes.
+class CaptureFile {
+public:
+	explicit CaptureFile(const std::string& path);
+	~CaptureFile();
+	CaptureFile(const CaptureFile&) = delete;
+	CaptureFile& operator=(const CaptureFile&) = delete;
+
+	void append(const CaptureRecord& record);
+	void flush();
+private:
+	std::FILE* file;
+	std::string buffer;
+};
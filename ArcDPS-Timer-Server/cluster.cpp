@@ -0,0 +1,498 @@
+#include "cluster.h"
+
+#include <string>
+#include <stdexcept>
+
+#include "group.h"
+#include "logger.h"
+
+static std::pair<std::string, std::string> split_address(const std::string& address) {
+	const std::size_t colon = address.rfind(':');
+	if (colon == std::string::npos) {
+		throw std::invalid_argument("Invalid node address " + address + ", expected host:port");
+	}
+	return {address.substr(0, colon), address.substr(colon + 1)};
+}
+
+static std::string make_message(ClusterKind kind, const std::string& group, std::string_view rest = {}) {
+	const std::size_t length = 3 + group.size() + rest.size();
+	std::string message;
+	message.reserve(4 + length);
+	for (std::size_t i = 0; i < 4; ++i) {
+		message.push_back(static_cast<char>((length >> (8 * i)) & 0xFF));
+	}
+	message.push_back(static_cast<char>(kind));
+	message.push_back(static_cast<char>(group.size() & 0xFF));
+	message.push_back(static_cast<char>((group.size() >> 8) & 0xFF));
+	message.append(group);
+	message.append(rest);
+	return message;
+}
+
+static std::string make_event(const std::string& group, std::uint8_t hops, std::string_view packed) {
+	std::string rest(1, static_cast<char>(hops));
+	rest.append(packed);
+	return make_message(ClusterKind::event, group, rest);
+}
+
+// Splits a message after its length prefix into kind, group and rest.
+static bool parse_message(std::string_view message, ClusterKind& kind, std::string& group, std::string_view& rest) {
+	if (message.size() < 3) {
+		return false;
+	}
+	const std::size_t name_length = static_cast<std::uint8_t>(message[1]) | (static_cast<std::uint8_t>(message[2]) << 8);
+	if (message.size() < 3 + name_length) {
+		return false;
+	}
+
+	kind = static_cast<ClusterKind>(message[0]);
+	group = std::string(message.substr(3, name_length));
+	rest = message.substr(3 + name_length);
+	return true;
+}
+
+void HashRing::add(const std::string& node) {
+	for (std::size_t i = 0; i < virtual_nodes; ++i) {
+		points[hash(node + "#" + std::to_string(i))] = node;
+	}
+}
+
+void HashRing::remove(const std::string& node) {
+	std::erase_if(points, [&](const auto& point) {
+		return point.second == node;
+	});
+}
+
+const std::string& HashRing::owner_of(std::string_view key) const {
+	auto point = points.lower_bound(hash(key));
+	if (point == points.end()) {
+		point = points.begin();
+	}
+	return point->second;
+}
+
+std::uint64_t HashRing::hash(std::string_view key) {
+	std::uint64_t hash = 14695981039346656037ull;
+	for (const char c : key) {
+		hash ^= static_cast<std::uint8_t>(c);
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+ClusterLink::ClusterLink(Cluster& cluster, boost::asio::io_context& io_context, std::string node)
+:	cluster(cluster),
+	node(std::move(node)),
+	socket(io_context),
+	reconnect_timer(io_context) {
+}
+
+void ClusterLink::connect() {
+	auto self(shared_from_this());
+	auto resolver = std::make_shared<boost::asio::ip::tcp::resolver>(socket.get_executor());
+	const auto [host, port] = split_address(node);
+	resolver->async_resolve(host, port, [this, self, resolver](boost::system::error_code ec, boost::asio::ip::tcp::resolver::results_type endpoints) {
+		if (ec) {
+			fail();
+			return;
+		}
+
+		boost::asio::async_connect(socket, endpoints, [this, self](boost::system::error_code ec, const boost::asio::ip::tcp::endpoint&) {
+			if (ec) {
+				fail();
+				return;
+			}
+
+			log_info("Cluster link to " + node + " is up");
+			socket.set_option(boost::asio::ip::tcp::no_delay(true));
+			up = true;
+			queue.push_front(make_message(ClusterKind::hello, cluster.self));
+			write();
+			watch();
+			cluster.link_up(node);
+		});
+	});
+}
+
+// Messages for a node that is down wait for it, up to the backlog limit.
+void ClusterLink::send(std::string message) {
+	if (queue.size() >= max_cluster_backlog) {
+		cluster.shard.stats.cluster_dropped.increment();
+		return;
+	}
+
+	queue.push_back(std::move(message));
+	if (up && !writing) {
+		write();
+	}
+}
+
+bool ClusterLink::is_up() const {
+	return up;
+}
+
+// Nothing is read from an outgoing link, but reading notices a lost node without waiting for the next write.
+void ClusterLink::watch() {
+	auto self(shared_from_this());
+	socket.async_read_some(boost::asio::buffer(watch_buffer), [this, self](boost::system::error_code ec, std::size_t) {
+		if (ec) {
+			fail();
+			return;
+		}
+		watch();
+	});
+}
+
+void ClusterLink::write() {
+	writing = true;
+	auto self(shared_from_this());
+	boost::asio::async_write(socket, boost::asio::buffer(queue.front()), [this, self](boost::system::error_code ec, std::size_t) {
+		if (ec) {
+			fail();
+			return;
+		}
+
+		cluster.shard.stats.cluster_sent.increment();
+		queue.pop_front();
+		if (up && !queue.empty()) {
+			write();
+		}
+		else {
+			writing = false;
+		}
+	});
+}
+
+void ClusterLink::fail() {
+	if (reconnecting) {
+		return;
+	}
+	reconnecting = true;
+	writing = false;
+
+	boost::system::error_code ec;
+	socket.close(ec);
+
+	if (up) {
+		log_warning("Cluster link to " + node + " is down");
+		up = false;
+		// the message being written may or may not have arrived, sending it again is harmless
+		cluster.link_down(node, std::exchange(queue, {}));
+	}
+
+	auto self(shared_from_this());
+	reconnect_timer.expires_after(std::chrono::seconds(1));
+	reconnect_timer.async_wait([this, self](const boost::system::error_code& ec) {
+		reconnecting = false;
+		if (!ec) {
+			connect();
+		}
+	});
+}
+
+ClusterConnection::ClusterConnection(Cluster& cluster, boost::asio::ip::tcp::socket socket)
+:	cluster(cluster),
+	socket(std::move(socket)) {
+}
+
+void ClusterConnection::start() {
+	receive();
+}
+
+void ClusterConnection::receive() {
+	while (true) {
+		const auto data = buffer.data();
+		const std::string_view available(static_cast<const char*>(data.data()), data.size());
+		if (available.size() < 4) {
+			break;
+		}
+
+		std::size_t length = 0;
+		for (std::size_t i = 0; i < 4; ++i) {
+			length |= static_cast<std::size_t>(static_cast<std::uint8_t>(available[i])) << (8 * i);
+		}
+		if (length > max_cluster_message_size) {
+			log_error("Closing cluster connection, message too large");
+			boost::system::error_code ec;
+			socket.close(ec);
+			break;
+		}
+		if (available.size() < 4 + length) {
+			break;
+		}
+
+		const std::string_view message = available.substr(4, length);
+		cluster.shard.stats.cluster_received.increment();
+		if (node.empty()) {
+			ClusterKind kind;
+			std::string name;
+			std::string_view rest;
+			if (!parse_message(message, kind, name, rest) || kind != ClusterKind::hello) {
+				boost::system::error_code ec;
+				socket.close(ec);
+				return;
+			}
+			node = name;
+		}
+		else {
+			cluster.handle_message(node, message);
+		}
+		buffer.consume(4 + length);
+	}
+
+	auto self(shared_from_this());
+	boost::asio::async_read(socket, buffer, boost::asio::transfer_at_least(1), [this, self](boost::system::error_code ec, std::size_t) {
+		if (ec) {
+			if (!node.empty()) {
+				cluster.connection_closed(node);
+			}
+			return;
+		}
+		receive();
+	});
+}
+
+Cluster::Cluster(ShardPool& shards, const Config& config)
+:	shard(shards.at(0)),
+	shards(shards),
+	config(config),
+	self(config.cluster_address),
+	acceptor(shard.context()) {
+	const auto port = static_cast<unsigned short>(std::stoul(split_address(self).second));
+	const boost::asio::ip::tcp::endpoint endpoint(boost::asio::ip::tcp::v4(), port);
+	acceptor.open(endpoint.protocol());
+	acceptor.set_option(boost::asio::socket_base::reuse_address(true));
+	acceptor.bind(endpoint);
+	acceptor.listen();
+	log_info("Cluster node " + self + " with " + std::to_string(config.cluster_peers.size()) + " peer(s)");
+
+	ring.add(self);
+	for (const auto& peer : config.cluster_peers) {
+		if (peer != self && !links.contains(peer)) {
+			auto link = std::make_shared<ClusterLink>(*this, shard.context(), peer);
+			links[peer] = link;
+			link->connect();
+		}
+	}
+
+	accept_connection();
+}
+
+void Cluster::join(const std::string& group) {
+	shard.dispatch([this, group]() {
+		local_groups.insert(group);
+		const std::string& owner = ring.owner_of(group);
+		subscribed_to[group] = owner;
+		if (owner != self) {
+			send(owner, make_message(ClusterKind::subscribe, group));
+			// a lingering local group may know events the owner missed
+			hand_over_history(group, owner);
+		}
+	});
+}
+
+void Cluster::leave(const std::string& group) {
+	shard.dispatch([this, group]() {
+		local_groups.erase(group);
+		auto owner = subscribed_to.find(group);
+		if (owner != subscribed_to.end()) {
+			if (owner->second != self) {
+				send(owner->second, make_message(ClusterKind::unsubscribe, group));
+			}
+			subscribed_to.erase(owner);
+		}
+	});
+}
+
+void Cluster::publish(const std::string& group, const EventMessage& message) {
+	shard.dispatch([this, group, packed = message.pack()]() {
+		route(group, packed, 0, self);
+	});
+}
+
+void Cluster::accept_connection() {
+	acceptor.async_accept(shard.context(), [this](boost::system::error_code ec, boost::asio::ip::tcp::socket socket) {
+		if (!ec) {
+			socket.set_option(boost::asio::ip::tcp::no_delay(true));
+			std::make_shared<ClusterConnection>(*this, std::move(socket))->start();
+		}
+		accept_connection();
+	});
+}
+
+void Cluster::link_up(const std::string& node) {
+	ring.add(node);
+	rebalance();
+}
+
+void Cluster::link_down(const std::string& node, std::deque<std::string> unsent) {
+	ring.remove(node);
+	rebalance();
+
+	// events on their way to the lost node go to whoever owns their group now
+	for (const auto& message : unsent) {
+		ClusterKind kind;
+		std::string group;
+		std::string_view rest;
+		if (parse_message(std::string_view(message).substr(4), kind, group, rest) && kind == ClusterKind::event && !rest.empty()) {
+			route(group, std::string(rest.substr(1)), static_cast<std::uint8_t>(rest[0]), self);
+		}
+	}
+}
+
+void Cluster::connection_closed(const std::string& node) {
+	for (auto members = subscribers.begin(); members != subscribers.end();) {
+		if (members->second.erase(node) > 0) {
+			const std::string group_name = members->first;
+			shards.owner_of(group_name).dispatch([group_name]() {
+				auto group = Group::find_group(group_name);
+				if (group) {
+					group->add_remote_members(-1);
+				}
+			});
+		}
+		members = members->second.empty() ? subscribers.erase(members) : std::next(members);
+	}
+}
+
+// Moves the subscriptions of local groups whose owner changed.
+void Cluster::rebalance() {
+	for (const auto& group : local_groups) {
+		const std::string& owner = ring.owner_of(group);
+		auto previous = subscribed_to.find(group);
+		if (previous != subscribed_to.end() && previous->second == owner) {
+			continue;
+		}
+
+		if (previous != subscribed_to.end() && previous->second != self) {
+			auto link = links.find(previous->second);
+			if (link != links.end() && link->second->is_up()) {
+				send(previous->second, make_message(ClusterKind::unsubscribe, group));
+			}
+		}
+		subscribed_to[group] = owner;
+
+		if (owner != self) {
+			send(owner, make_message(ClusterKind::subscribe, group));
+			hand_over_history(group, owner);
+		}
+	}
+}
+
+void Cluster::handle_message(const std::string& node, std::string_view message) {
+	ClusterKind kind;
+	std::string group_name;
+	std::string_view rest;
+	if (!parse_message(message, kind, group_name, rest)) {
+		return;
+	}
+
+	switch (kind) {
+	case ClusterKind::hello:
+		break;
+	case ClusterKind::subscribe:
+		if (subscribers[group_name].insert(node).second) {
+			// the owner keeps the group and its history even without local members
+			const Config& group_config = config;
+			shards.owner_of(group_name).dispatch([group_name, &group_config]() {
+				Group::get_group(group_name, group_config)->add_remote_members(1);
+			});
+		}
+		hand_over_history(group_name, node);
+		break;
+	case ClusterKind::unsubscribe: {
+		auto members = subscribers.find(group_name);
+		if (members != subscribers.end() && members->second.erase(node) > 0) {
+			if (members->second.empty()) {
+				subscribers.erase(members);
+			}
+			shards.owner_of(group_name).dispatch([group_name]() {
+				auto group = Group::find_group(group_name);
+				if (group) {
+					group->add_remote_members(-1);
+				}
+			});
+		}
+		break;
+	}
+	case ClusterKind::event:
+		if (!rest.empty()) {
+			deliver(group_name, std::string(rest.substr(1)), static_cast<std::uint8_t>(rest[0]), node);
+		}
+		break;
+	}
+}
+
+// Owners pass events on to their subscribers, everybody else to the owner. Nodes with a different
+// view of the ring may pass an event back and forth, the groups drop known uuids and the hop count
+// ends it where no group exists.
+void Cluster::route(const std::string& group, const std::string& packed, std::uint8_t hops, const std::string& from) {
+	if (hops >= max_cluster_hops) {
+		return;
+	}
+
+	const std::string& owner = ring.owner_of(group);
+	if (owner == self) {
+		auto members = subscribers.find(group);
+		if (members == subscribers.end()) {
+			return;
+		}
+		const std::string message = make_event(group, hops + 1, packed);
+		for (const auto& node : members->second) {
+			if (node != from) {
+				send(node, message);
+			}
+		}
+	}
+	else if (owner != from) {
+		send(owner, make_event(group, hops + 1, packed));
+	}
+}
+
+void Cluster::deliver(const std::string& group_name, const std::string& packed, std::uint8_t hops, const std::string& from) {
+	shards.owner_of(group_name).dispatch([this, group_name, packed, hops, from]() {
+		auto message = EventMessage::unpack(packed);
+		if (!message) {
+			return;
+		}
+
+		// no origin, the group fans out locally and only events new to it travel on
+		auto group = Group::find_group(group_name);
+		if (group && !group->send_message(std::move(message.value()), nullptr, std::chrono::steady_clock::time_point())) {
+			return;
+		}
+		shard.dispatch([this, group_name, packed, hops, from]() {
+			route(group_name, packed, hops, from);
+		});
+	});
+}
+
+// Sends the local history of a group to a node, which drops what it already knows.
+void Cluster::hand_over_history(const std::string& group_name, const std::string& node) {
+	shards.owner_of(group_name).dispatch([this, group_name, node]() {
+		auto group = Group::find_group(group_name);
+		if (!group || group->get_history().empty()) {
+			return;
+		}
+
+		std::vector<std::string> messages;
+		for (const auto& message : group->get_history()) {
+			messages.push_back(make_event(group_name, 0, message.pack()));
+		}
+		shard.dispatch([this, node, messages]() {
+			for (const auto& message : messages) {
+				send(node, message);
+			}
+		});
+	});
+}
+
+void Cluster::send(const std::string& node, std::string message) {
+	auto link = links.find(node);
+	if (link == links.end()) {
+		// only configured peers are linked to
+		shard.stats.cluster_dropped.increment();
+		return;
+	}
+	link->second->send(std::move(message));
+}
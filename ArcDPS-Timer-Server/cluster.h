@@ -0,0 +1,129 @@
+#pragma once
+
+#include <map>
+#include <array>
+#include <set>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <string_view>
+#include <boost/asio.hpp>
+
+#include "protocol.h"
+#include "config.h"
+#include "shard.h"
+
+// Consistent hash ring over node names. Every node is placed at a number of virtual points,
+// a group belongs to the first point at or after the hash of its name.
+class HashRing {
+public:
+	static constexpr std::size_t virtual_nodes = 64;
+
+	void add(const std::string& node);
+	void remove(const std::string& node);
+	const std::string& owner_of(std::string_view key) const;
+
+	// FNV-1a, stable across processes and builds unlike std::hash
+	static std::uint64_t hash(std::string_view key);
+private:
+	std::map<std::uint64_t, std::string> points;
+};
+
+// Messages on the links between nodes: uint32 little endian length of the rest, uint8 kind,
+// uint16 little endian group name length, group name, kind specific rest.
+enum class ClusterKind : std::uint8_t {
+	hello = 0,       // first message of a link, the name is the sending node
+	subscribe = 1,   // the sender has members in the group, answered with the group's history
+	unsubscribe = 2, // the sender's last member left the group
+	event = 3        // rest is uint8 hop count and a packed EventMessage
+};
+
+constexpr std::size_t max_cluster_message_size = 1024 * 1024;
+constexpr std::size_t max_cluster_backlog = 64 * 1024;
+constexpr std::uint8_t max_cluster_hops = 8;
+
+class Cluster;
+
+// Outgoing link to one node, reconnected until it is up. Nodes send only over their own
+// outgoing links, so a node is part of the ring exactly while its link is connected.
+class ClusterLink : public std::enable_shared_from_this<ClusterLink> {
+public:
+	ClusterLink(Cluster& cluster, boost::asio::io_context& io_context, std::string node);
+
+	void connect();
+	void send(std::string message);
+	bool is_up() const;
+private:
+	Cluster& cluster;
+	std::string node;
+	boost::asio::ip::tcp::socket socket;
+	boost::asio::steady_timer reconnect_timer;
+	std::deque<std::string> queue;
+	std::array<char, 64> watch_buffer;
+	bool up = false;
+	bool writing = false;
+	bool reconnecting = false;
+
+	void write();
+	void watch();
+	void fail();
+};
+
+// Incoming link from one node, its first message names the node.
+class ClusterConnection : public std::enable_shared_from_this<ClusterConnection> {
+public:
+	ClusterConnection(Cluster& cluster, boost::asio::ip::tcp::socket socket);
+
+	void start();
+private:
+	Cluster& cluster;
+	boost::asio::ip::tcp::socket socket;
+	boost::asio::streambuf buffer;
+	std::string node;
+
+	void receive();
+};
+
+// Places groups on nodes. A node with local members of a group subscribes to the group's owner,
+// sends events of local members to it and gets the events of other nodes' members from it.
+// When the ring changes every node subscribes to the new owners and hands them its history, and
+// events still queued for a lost node are routed again, so rebalancing loses nothing.
+// Lives on shard 0 like the relay, groups reach it through dispatch.
+class Cluster {
+public:
+	Cluster(ShardPool& shards, const Config& config);
+
+	// may be called from any shard
+	void join(const std::string& group);
+	void leave(const std::string& group);
+	void publish(const std::string& group, const EventMessage& message);
+private:
+	friend class ClusterLink;
+	friend class ClusterConnection;
+
+	Shard& shard;
+	ShardPool& shards;
+	const Config& config;
+	std::string self;
+	boost::asio::ip::tcp::acceptor acceptor;
+
+	// only touched on shard 0
+	HashRing ring;
+	std::map<std::string, std::shared_ptr<ClusterLink>> links;
+	std::set<std::string> local_groups;
+	std::map<std::string, std::string> subscribed_to; // local group -> owner node
+	std::map<std::string, std::set<std::string>> subscribers; // owned group -> nodes
+
+	void accept_connection();
+	void link_up(const std::string& node);
+	void link_down(const std::string& node, std::deque<std::string> unsent);
+	void connection_closed(const std::string& node);
+	void rebalance();
+	void handle_message(const std::string& node, std::string_view message);
+	void route(const std::string& group, const std::string& packed, std::uint8_t hops, const std::string& from);
+	void deliver(const std::string& group, const std::string& packed, std::uint8_t hops, const std::string& from);
+	void hand_over_history(const std::string& group, const std::string& node);
+	void send(const std::string& node, std::string message);
+};
@@ -0,0 +1,143 @@
+// Encoding benchmark for the wire protocols. Encodes events of the client's EventEntry shape into
+// the state command a client sends, in each encoding, then times the server scanning them back
+// into events. Prints one JSON object per encoding.
+
+#include <map>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <stdexcept>
+#include <functional>
+#include <nlohmann/json.hpp>
+
+#include "protocol.h"
+#include "options.h"
+
+using json = nlohmann::json;
+using Clock = std::chrono::steady_clock;
+
+struct BenchConfig {
+	std::size_t events = 100000;
+};
+
+static BenchConfig parse_bench_config(int argc, char* argv[]) {
+	BenchConfig config;
+
+	const std::map<std::string, std::function<void(const std::string&, const std::string&)>> options = {
+		{"--events", [&](const std::string& name, const std::string& value) {
+			config.events = std::max<std::size_t>(1, parse_number<std::size_t>(name, value));
+		}}
+	};
+
+	for (int i = 1; i < argc; i += 2) {
+		const std::string name = argv[i];
+		auto option = options.find(name);
+		if (option == options.end()) {
+			throw std::invalid_argument("Unknown option " + name);
+		}
+		if (i + 1 >= argc) {
+			throw std::invalid_argument("Missing value for " + name);
+		}
+		option->second(name, argv[i + 1]);
+	}
+
+	return config;
+}
+
+static Event make_event(std::uint64_t sequence) {
+	Event event{};
+	for (std::size_t i = 0; i < 8; ++i) {
+		event.uuid[i] = static_cast<std::uint8_t>(sequence >> (8 * i));
+	}
+	event.uuid[6] = 0x40 | (event.uuid[6] & 0x0F); // version 4 like the client's
+	event.time = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+	event.type = static_cast<std::uint8_t>(sequence % event_types.size());
+	event.source = static_cast<std::uint8_t>(sequence % event_sources.size());
+	return event;
+}
+
+// the state command as the client writes it
+static std::string encode(const Event& event, Encoding encoding) {
+	if (encoding == Encoding::binary) {
+		return encode_frame(FrameKind::event, encode_event(event));
+	}
+	json request = {
+		{"command", "state"},
+		{"data", event_to_json(event)}
+	};
+	return request.dump() + "\n";
+}
+
+// what a session does with it before relaying
+static std::optional<Event> decode(std::string_view message, Encoding encoding) {
+	if (encoding == Encoding::binary) {
+		const std::size_t length = static_cast<std::uint8_t>(message[0]) | (static_cast<std::size_t>(static_cast<std::uint8_t>(message[1])) << 8);
+		if (length + 2 != message.size() || static_cast<FrameKind>(message[2]) != FrameKind::event) {
+			return std::nullopt;
+		}
+		return decode_event(message.substr(frame_header_size));
+	}
+	message.remove_suffix(1);
+	auto fields = scan_command(message);
+	if (!fields || !fields->data) {
+		return std::nullopt;
+	}
+	return event_from_fields(*fields->data);
+}
+
+static json run_encoding(Encoding encoding, const std::vector<Event>& events) {
+	std::vector<std::string> messages;
+	messages.reserve(events.size());
+
+	const auto start = Clock::now();
+	for (const auto& event : events) {
+		messages.push_back(encode(event, encoding));
+	}
+	const auto encoded = Clock::now();
+
+	std::size_t decoded = 0;
+	for (const auto& message : messages) {
+		auto event = decode(message, encoding);
+		decoded += event ? 1 : 0;
+	}
+	const auto done = Clock::now();
+
+	std::size_t bytes = 0;
+	for (const auto& message : messages) {
+		bytes += message.size();
+	}
+
+	const auto nanoseconds = [&](Clock::duration duration) {
+		return std::chrono::duration<double, std::nano>(duration).count() / events.size();
+	};
+	return {
+		{"protocol", encoding == Encoding::binary ? "binary" : "json"},
+		{"events", events.size()},
+		{"decoded", decoded},
+		{"bytes_per_event", static_cast<double>(bytes) / events.size()},
+		{"encode_ns_per_event", nanoseconds(encoded - start)},
+		{"decode_ns_per_event", nanoseconds(done - encoded)}
+	};
+}
+
+int main(int argc, char* argv[]) {
+	try {
+		const BenchConfig config = parse_bench_config(argc, argv);
+
+		std::vector<Event> events;
+		events.reserve(config.events);
+		for (std::size_t i = 0; i < config.events; ++i) {
+			events.push_back(make_event(i));
+		}
+
+		for (const Encoding encoding : {Encoding::json, Encoding::binary}) {
+			std::cout << run_encoding(encoding, events).dump() << std::endl;
+		}
+	}
+	catch (std::exception& e) {
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
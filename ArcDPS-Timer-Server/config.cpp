@@ -0,0 +1,191 @@
+#include "config.h"
+#include "options.h"
+
+#include <map>
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <stdexcept>
+#include <functional>
+
+Config parse_config(int argc, char* argv[]) {
+	Config config;
+
+	const std::map<std::string, std::function<void(const std::string&, const std::string&)>> options = {
+		{"--port", [&](const std::string& name, const std::string& value) {
+			config.port = parse_number<unsigned short>(name, value);
+		}},
+		{"--reuse-port", [&](const std::string& name, const std::string& value) {
+			config.reuse_port = parse_number<unsigned int>(name, value) != 0;
+		}},
+		{"--relay-dir", [&](const std::string&, const std::string& value) {
+			config.relay_directory = value;
+		}},
+		{"--cluster-address", [&](const std::string& name, const std::string& value) {
+			if (value.rfind(':') == std::string::npos) {
+				throw std::invalid_argument("Invalid value for " + name + ": " + value);
+			}
+			config.cluster_address = value;
+		}},
+		{"--cluster-peers", [&](const std::string& name, const std::string& value) {
+			config.cluster_peers.clear();
+			std::size_t start = 0;
+			while (start <= value.size()) {
+				const std::size_t end = std::min(value.find(',', start), value.size());
+				const std::string peer = value.substr(start, end - start);
+				if (peer.rfind(':') == std::string::npos) {
+					throw std::invalid_argument("Invalid value for " + name + ": " + value);
+				}
+				config.cluster_peers.push_back(peer);
+				start = end + 1;
+			}
+		}},
+		{"--state-dir", [&](const std::string&, const std::string& value) {
+			config.state_directory = value;
+		}},
+		{"--wal-size", [&](const std::string& name, const std::string& value) {
+			config.wal_size = parse_number<std::size_t>(name, value);
+		}},
+		{"--snapshot-interval", [&](const std::string& name, const std::string& value) {
+			config.snapshot_interval = parse_number<unsigned int>(name, value);
+		}},
+		{"--capture-dir", [&](const std::string&, const std::string& value) {
+			config.capture_directory = value;
+		}},
+		{"--handoff-path", [&](const std::string&, const std::string& value) {
+			config.handoff_path = value;
+		}},
+		{"--handoff-sessions", [&](const std::string& name, const std::string& value) {
+			config.handoff_sessions = parse_number<unsigned int>(name, value) != 0;
+		}},
+		{"--drain-timeout", [&](const std::string& name, const std::string& value) {
+			config.drain_timeout = parse_number<unsigned int>(name, value);
+		}},
+		{"--udp-port", [&](const std::string& name, const std::string& value) {
+			config.udp_port = parse_number<unsigned short>(name, value);
+		}},
+		{"--threads", [&](const std::string& name, const std::string& value) {
+			config.threads = parse_number<std::size_t>(name, value);
+		}},
+		{"--max-write-bytes", [&](const std::string& name, const std::string& value) {
+			config.max_write_bytes = parse_number<std::size_t>(name, value);
+		}},
+		{"--group-history", [&](const std::string& name, const std::string& value) {
+			config.group_history = parse_number<std::size_t>(name, value);
+		}},
+		{"--dedupe-window", [&](const std::string& name, const std::string& value) {
+			config.dedupe_window = parse_number<std::size_t>(name, value);
+		}},
+		{"--max-queue-bytes", [&](const std::string& name, const std::string& value) {
+			config.max_queue_bytes = parse_number<std::size_t>(name, value);
+		}},
+		{"--max-queue-messages", [&](const std::string& name, const std::string& value) {
+			config.max_queue_messages = parse_number<std::size_t>(name, value);
+		}},
+		{"--slow-consumer-policy", [&](const std::string& name, const std::string& value) {
+			if (value == "disconnect") {
+				config.slow_consumer_policy = SlowConsumerPolicy::disconnect;
+			}
+			else if (value == "drop-oldest") {
+				config.slow_consumer_policy = SlowConsumerPolicy::drop_oldest;
+			}
+			else if (value == "conflate") {
+				config.slow_consumer_policy = SlowConsumerPolicy::conflate;
+			}
+			else {
+				throw std::invalid_argument("Invalid value for " + name + ": " + value);
+			}
+		}},
+		{"--session-rate", [&](const std::string& name, const std::string& value) {
+			config.session_rate = parse_number<unsigned int>(name, value);
+		}},
+		{"--session-burst", [&](const std::string& name, const std::string& value) {
+			config.session_burst = parse_number<unsigned int>(name, value);
+		}},
+		{"--group-rate", [&](const std::string& name, const std::string& value) {
+			config.group_rate = parse_number<unsigned int>(name, value);
+		}},
+		{"--group-burst", [&](const std::string& name, const std::string& value) {
+			config.group_burst = parse_number<unsigned int>(name, value);
+		}},
+		{"--rate-limit-policy", [&](const std::string& name, const std::string& value) {
+			if (value == "reject") {
+				config.rate_limit_policy = RateLimitPolicy::reject;
+			}
+			else if (value == "conflate") {
+				config.rate_limit_policy = RateLimitPolicy::conflate;
+			}
+			else {
+				throw std::invalid_argument("Invalid value for " + name + ": " + value);
+			}
+		}},
+		{"--heartbeat-interval", [&](const std::string& name, const std::string& value) {
+			config.heartbeat_interval = parse_number<unsigned int>(name, value);
+		}},
+		{"--idle-timeout", [&](const std::string& name, const std::string& value) {
+			config.idle_timeout = parse_number<unsigned int>(name, value);
+		}},
+		{"--group-linger", [&](const std::string& name, const std::string& value) {
+			config.group_linger = parse_number<unsigned int>(name, value);
+		}},
+		{"--parallel-fanout", [&](const std::string& name, const std::string& value) {
+			config.parallel_fanout = parse_number<std::size_t>(name, value);
+		}},
+		{"--stats-interval", [&](const std::string& name, const std::string& value) {
+			config.stats_interval = parse_number<unsigned int>(name, value);
+		}},
+		{"--log-level", [&](const std::string& name, const std::string& value) {
+			const std::map<std::string, LogLevel> levels = {
+				{"debug", LogLevel::debug},
+				{"info", LogLevel::info},
+				{"warning", LogLevel::warning},
+				{"error", LogLevel::error},
+				{"off", LogLevel::off}
+			};
+			auto level = levels.find(value);
+			if (level == levels.end()) {
+				throw std::invalid_argument("Invalid value for " + name + ": " + value);
+			}
+			config.log_level = level->second;
+		}},
+		{"--metrics-port", [&](const std::string& name, const std::string& value) {
+			config.metrics_port = parse_number<unsigned short>(name, value);
+		}},
+	};
+
+	for (int i = 1; i < argc; ++i) {
+		const std::string name = argv[i];
+		auto option = options.find(name);
+		if (option == options.end()) {
+			throw std::invalid_argument("Unknown option " + name);
+		}
+		if (i + 1 >= argc) {
+			throw std::invalid_argument("Missing value for " + name);
+		}
+		option->second(name, argv[++i]);
+	}
+
+	if (config.threads == 0) {
+		config.threads = std::max(1u, std::thread::hardware_concurrency());
+	}
+
+	// datagram tokens are only known to the process that handed them out
+	if (config.reuse_port && config.udp_port != 0) {
+		throw std::invalid_argument("--udp-port cannot be combined with --reuse-port");
+	}
+	if (!config.cluster_address.empty() && !config.relay_directory.empty()) {
+		throw std::invalid_argument("--cluster-address cannot be combined with --relay-dir");
+	}
+	if (config.cluster_address.empty() && !config.cluster_peers.empty()) {
+		throw std::invalid_argument("--cluster-peers needs --cluster-address");
+	}
+	if (!config.state_directory.empty() && config.group_history == 0) {
+		throw std::invalid_argument("--state-dir needs a --group-history to keep");
+	}
+	// the other process would need the UDP socket and the cluster port too
+	if (!config.handoff_path.empty() && (config.udp_port != 0 || !config.cluster_address.empty())) {
+		throw std::invalid_argument("--handoff-path cannot be combined with --udp-port or --cluster-address");
+	}
+
+	return config;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstddef>
+
+#include "logger.h"
+
+enum class SlowConsumerPolicy {
+	disconnect,
+	drop_oldest,
+	conflate
+};
+
+enum class RateLimitPolicy {
+	reject,
+	conflate
+};
+
+struct Config {
+	unsigned short port = 5000;
+	unsigned short udp_port = 0; // 0 disables the datagram fast path
+	bool reuse_port = false;
+	std::string relay_directory; // empty disables the relay between processes
+	std::string cluster_address; // host:port of this node, empty disables cluster mode
+	std::vector<std::string> cluster_peers;
+	std::string state_directory; // empty keeps no state across restarts
+	std::size_t wal_size = 16 * 1024 * 1024;
+	unsigned int snapshot_interval = 60;
+	std::string capture_directory; // empty records no traffic
+	std::string handoff_path; // empty disables handing over to a new process
+	bool handoff_sessions = true;
+	unsigned int drain_timeout = 10;
+	std::size_t threads = 1;
+	std::size_t max_write_bytes = 64 * 1024;
+	unsigned int stats_interval = 0;
+	LogLevel log_level = LogLevel::info;
+	unsigned short metrics_port = 0; // 0 disables the metrics endpoint
+	std::size_t group_history = 64;
+	std::size_t dedupe_window = 256;
+	std::size_t max_queue_bytes = 1024 * 1024;
+	std::size_t max_queue_messages = 4096;
+	SlowConsumerPolicy slow_consumer_policy = SlowConsumerPolicy::drop_oldest;
+	unsigned int session_rate = 0; // events per second, 0 disables the limit
+	unsigned int session_burst = 20;
+	unsigned int group_rate = 0;
+	unsigned int group_burst = 50;
+	RateLimitPolicy rate_limit_policy = RateLimitPolicy::reject;
+	unsigned int heartbeat_interval = 30;
+	unsigned int idle_timeout = 90;
+	unsigned int group_linger = 120;
+	std::size_t parallel_fanout = 1000; // receivers from which a group fans out on their shards, 0 never
+};
+
+Config parse_config(int argc, char* argv[]);
@@ -0,0 +1,162 @@
+#pragma once
+
+#include <cstddef>
+#include <utility>
+#include <exception>
+#include <coroutine>
+#include <boost/asio.hpp>
+
+// Storage for the one asynchronous operation a coroutine has pending at a time. asio allocates
+// the operation through the handler's allocator and frees it before the handler runs, so the
+// next operation reuses the same block. Larger or overlapping operations go to the heap.
+class HandlerMemory {
+public:
+	HandlerMemory() = default;
+	HandlerMemory(const HandlerMemory&) = delete;
+	HandlerMemory& operator=(const HandlerMemory&) = delete;
+
+	void* allocate(std::size_t size) {
+		if (!in_use && size <= sizeof(storage)) {
+			in_use = true;
+			return &storage;
+		}
+		return ::operator new(size);
+	}
+
+	void deallocate(void* pointer) {
+		if (pointer == &storage) {
+			in_use = false;
+		}
+		else {
+			::operator delete(pointer);
+		}
+	}
+private:
+	alignas(std::max_align_t) unsigned char storage[512];
+	bool in_use = false;
+};
+
+template <typename T>
+class RecyclingAllocator {
+public:
+	using value_type = T;
+
+	explicit RecyclingAllocator(HandlerMemory& memory) noexcept
+	:	memory(&memory) {
+	}
+
+	template <typename U>
+	RecyclingAllocator(const RecyclingAllocator<U>& other) noexcept
+	:	memory(other.memory) {
+	}
+
+	T* allocate(std::size_t n) {
+		return static_cast<T*>(memory->allocate(sizeof(T) * n));
+	}
+
+	void deallocate(T* pointer, std::size_t) {
+		memory->deallocate(pointer);
+	}
+
+	template <typename U>
+	bool operator==(const RecyclingAllocator<U>& other) const noexcept {
+		return memory == other.memory;
+	}
+private:
+	template <typename> friend class RecyclingAllocator;
+
+	HandlerMemory* memory;
+};
+
+// Return type of a detached coroutine. It starts right away and its frame is freed once it
+// returns, whatever it needs to stay alive has to be among its parameters.
+struct Task {
+	struct promise_type {
+		Task get_return_object() noexcept {
+			return {};
+		}
+		std::suspend_never initial_suspend() noexcept {
+			return {};
+		}
+		std::suspend_never final_suspend() noexcept {
+			return {};
+		}
+		void return_void() noexcept {
+		}
+		void unhandled_exception() {
+			throw;
+		}
+	};
+};
+
+// Awaits an asio operation started by initiate with a completion handler, which resumes the
+// coroutine with the error code and bytes transferred. The operation is allocated from memory,
+// so a coroutine looping over operations allocates nothing once it runs.
+template <typename Initiate>
+class OperationAwaiter {
+public:
+	OperationAwaiter(HandlerMemory& memory, Initiate initiate)
+	:	memory(memory),
+		initiate(std::move(initiate)) {
+	}
+
+	bool await_ready() const noexcept {
+		return false;
+	}
+
+	void await_suspend(std::coroutine_handle<> coroutine) {
+		initiate(Handler{this, coroutine});
+	}
+
+	std::pair<boost::system::error_code, std::size_t> await_resume() const noexcept {
+		return {ec, bytes_transferred};
+	}
+private:
+	struct Handler {
+		using allocator_type = RecyclingAllocator<void>;
+
+		OperationAwaiter* awaiter;
+		std::coroutine_handle<> coroutine;
+
+		allocator_type get_allocator() const noexcept {
+			return allocator_type(awaiter->memory);
+		}
+
+		void operator()(boost::system::error_code ec, std::size_t bytes_transferred = 0) {
+			awaiter->ec = ec;
+			awaiter->bytes_transferred = bytes_transferred;
+			coroutine.resume();
+		}
+	};
+
+	HandlerMemory& memory;
+	Initiate initiate;
+	boost::system::error_code ec;
+	std::size_t bytes_transferred = 0;
+};
+
+template <typename Initiate>
+OperationAwaiter<Initiate> async_operation(HandlerMemory& memory, Initiate initiate) {
+	return OperationAwaiter<Initiate>(memory, std::move(initiate));
+}
+
+// Suspends the coroutine until whoever holds the handle resumes it.
+class Parked {
+public:
+	explicit Parked(std::coroutine_handle<>& slot)
+	:	slot(slot) {
+	}
+
+	bool await_ready() const noexcept {
+		return false;
+	}
+
+	void await_suspend(std::coroutine_handle<> coroutine) noexcept {
+		slot = coroutine;
+	}
+
+	void await_resume() const noexcept {
+	}
+private:
+	std::coroutine_handle<>& slot;
+};
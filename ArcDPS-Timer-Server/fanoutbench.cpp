@@ -0,0 +1,215 @@
+// Broadcast benchmark for Group. Fills a group on a shard with each given number of receivers
+// that only keep the last frame they were handed, then times sending events through it the way
+// a member's event is relayed. Prints one JSON object per size.
+//
+// With --threads the receivers are spread over that many shards, groups from --parallel-fanout
+// receivers on then fan out on all of them. The time includes waiting for every shard to finish.
+//
+// With --reencode the receivers parse the frame and serialize it again, what every session did
+// per event before the group framed it once, as the baseline to compare against.
+
+#include <map>
+#include <latch>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <stdexcept>
+#include <functional>
+#include <nlohmann/json.hpp>
+
+#include "protocol.h"
+#include "options.h"
+#include "config.h"
+#include "group.h"
+#include "shard.h"
+
+using json = nlohmann::json;
+using Clock = std::chrono::steady_clock;
+
+struct BenchConfig {
+	std::vector<std::size_t> sizes = {5, 50, 500, 5000, 10000};
+	std::size_t events = 1000;
+	Encoding encoding = Encoding::json;
+	std::size_t threads = 1;
+	std::size_t parallel_fanout = Config().parallel_fanout;
+	bool reencode = false;
+};
+
+static BenchConfig parse_bench_config(int argc, char* argv[]) {
+	BenchConfig config;
+
+	const std::map<std::string, std::function<void(const std::string&, const std::string&)>> options = {
+		{"--sizes", [&](const std::string& name, const std::string& value) {
+			config.sizes.clear();
+			std::size_t start = 0;
+			while (start <= value.size()) {
+				const std::size_t end = std::min(value.find(',', start), value.size());
+				config.sizes.push_back(parse_number<std::size_t>(name, value.substr(start, end - start)));
+				start = end + 1;
+			}
+		}},
+		{"--events", [&](const std::string& name, const std::string& value) {
+			config.events = std::max<std::size_t>(1, parse_number<std::size_t>(name, value));
+		}},
+		{"--threads", [&](const std::string& name, const std::string& value) {
+			config.threads = std::max<std::size_t>(1, parse_number<std::size_t>(name, value));
+		}},
+		{"--parallel-fanout", [&](const std::string& name, const std::string& value) {
+			config.parallel_fanout = parse_number<std::size_t>(name, value);
+		}},
+		{"--protocol", [&](const std::string& name, const std::string& value) {
+			if (value == "json") {
+				config.encoding = Encoding::json;
+			}
+			else if (value == "binary") {
+				config.encoding = Encoding::binary;
+			}
+			else {
+				throw std::invalid_argument("Invalid value for " + name + ": " + value);
+			}
+		}},
+		{"--reencode", [&](const std::string& name, const std::string& value) {
+			config.reencode = parse_number<unsigned int>(name, value) != 0;
+		}}
+	};
+
+	for (int i = 1; i < argc; i += 2) {
+		const std::string name = argv[i];
+		auto option = options.find(name);
+		if (option == options.end()) {
+			throw std::invalid_argument("Unknown option " + name);
+		}
+		if (i + 1 >= argc) {
+			throw std::invalid_argument("Missing value for " + name);
+		}
+		option->second(name, argv[i + 1]);
+	}
+
+	return config;
+}
+
+// holds on to the frame like a session queueing it would, without a socket behind it
+class BenchReceiver : public Receiver {
+public:
+	BenchReceiver(Encoding receiver_encoding, std::size_t receiver_shard, bool reencode)
+	:	reencode(reencode) {
+		encoding = receiver_encoding;
+		shard_index = receiver_shard;
+	}
+
+	void send_message(Payload message, Payload, std::shared_ptr<Delivery>) override {
+		if (reencode && encoding == Encoding::json) {
+			json response = {
+				{"status", "state"},
+				{"data", json::parse(message->data)["data"]}
+			};
+			message = std::make_shared<const Frame>(response.dump() + "\n", message->key);
+		}
+		last = std::move(message);
+		++received;
+	}
+
+	void send_batch(std::vector<Payload> messages) override {
+		received += messages.size();
+	}
+
+	std::size_t received = 0;
+private:
+	bool reencode;
+	Payload last;
+};
+
+static EventMessage make_event(std::uint64_t sequence) {
+	Event event{};
+	for (std::size_t i = 0; i < 8; ++i) {
+		event.uuid[i] = static_cast<std::uint8_t>(sequence >> (8 * i));
+	}
+	event.time = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+	event.type = 4; // segment, never clears the history
+	event.source = 1; // combat
+	return EventMessage::from_json(event_to_json(event));
+}
+
+// the shard's inbox runs in order, once this ran the fan-out tasks queued before did too
+static void wait_for_shards(ShardPool& shards) {
+	std::latch done(static_cast<std::ptrdiff_t>(shards.size()));
+	for (std::size_t i = 0; i < shards.size(); ++i) {
+		shards.at(i).dispatch([&done]() {
+			done.count_down();
+		});
+	}
+	done.wait();
+}
+
+static json run_size(std::size_t size, ShardPool& shards, const BenchConfig& bench, const Config& config) {
+	const std::string name = "bench-" + std::to_string(size);
+	auto group = Group::get_group(name, config);
+
+	std::vector<std::shared_ptr<BenchReceiver>> receivers;
+	receivers.reserve(size);
+	for (std::size_t i = 0; i < size; ++i) {
+		receivers.push_back(std::make_shared<BenchReceiver>(bench.encoding, i % shards.size(), bench.reencode));
+		group->join(receivers.back(), false);
+	}
+
+	// built up front, only the fan-out is timed
+	std::vector<EventMessage> events;
+	events.reserve(bench.events);
+	for (std::size_t i = 0; i < bench.events; ++i) {
+		events.push_back(make_event((static_cast<std::uint64_t>(size) << 32) | i));
+	}
+
+	ShardStats& stats = Shard::current()->stats;
+	const std::uint64_t allocations = stats.allocations.get();
+	const auto start = Clock::now();
+	for (auto& event : events) {
+		group->send_message(std::move(event), nullptr, Clock::time_point());
+	}
+	wait_for_shards(shards);
+	const auto elapsed = Clock::now() - start;
+	const std::uint64_t allocated = stats.allocations.get() - allocations;
+
+	std::size_t delivered = 0;
+	for (const auto& receiver : receivers) {
+		delivered += receiver->received;
+		group->leave(receiver);
+	}
+
+	const double nanoseconds = std::chrono::duration<double, std::nano>(elapsed).count();
+	return {
+		{"receivers", size},
+		{"threads", shards.size()},
+		{"events", bench.events},
+		{"delivered", delivered},
+		{"ns_per_event", nanoseconds / bench.events},
+		{"ns_per_delivery", delivered > 0 ? nanoseconds / delivered : 0.0},
+		{"allocations_per_event", static_cast<double>(allocated) / bench.events}
+	};
+}
+
+int main(int argc, char* argv[]) {
+	try {
+		const BenchConfig bench = parse_bench_config(argc, argv);
+		Config config;
+		config.threads = bench.threads;
+		config.parallel_fanout = bench.parallel_fanout;
+
+		// the groups live on the first shard, the runs are its only task
+		ShardPool shards(config.threads);
+		Group::set_shards(&shards);
+		shards.at(0).dispatch([&]() {
+			for (const std::size_t size : bench.sizes) {
+				std::cout << run_size(size, shards, bench, config).dump() << std::endl;
+			}
+			shards.stop();
+		});
+		shards.run();
+	}
+	catch (std::exception& e) {
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
@@ -1,32 +1,406 @@
 #include "group.h"
 
-std::map<std::string, std::shared_ptr<Group>> Group::groups;
+#include <algorithm>
 
-void Group::join(std::shared_ptr<Receiver> receiver) {
-	receivers.insert(receiver);
+#include "relay.h"
+#include "cluster.h"
+#include "state_store.h"
+
+thread_local Group::GroupTable Group::groups;
+Relay* Group::relay = nullptr;
+Cluster* Group::cluster = nullptr;
+StateStore* Group::state_store = nullptr;
+ShardPool* Group::shards = nullptr;
+
+Group::Group(std::string name, GroupHandle handle, const Config& config)
+:	name(name),
+	handle(handle),
+	config(config),
+	recent_keys(config.dedupe_window),
+	event_limit(config.group_rate, config.group_burst) {
+}
+
+// group sizes are tracked by the shard owning the group
+static void resize(std::size_t old_size, std::size_t new_size) {
+	ShardStats& stats = Shard::current()->stats;
+	if (old_size > 0) {
+		stats.group_sizes[group_size_bucket(old_size)].add(-1);
+	}
+	if (new_size > 0) {
+		stats.group_sizes[group_size_bucket(new_size)].add(1);
+	}
+}
+
+void Group::join(std::shared_ptr<Receiver> receiver, bool catch_up) {
+	const bool joined = receiver_slots.try_emplace(receiver.get(), receivers.size()).second;
+	if (joined) {
+		receivers.push_back(receiver);
+		partitions_stale = true;
+		resize(receivers.size() - 1, receivers.size());
+		if (receivers.size() == 1 && name != "default") {
+			if (relay) {
+				relay->subscribe(name);
+			}
+			if (cluster) {
+				cluster->join(name);
+			}
+		}
+	}
+
+	if (joined && catch_up && !history.empty()) {
+		std::vector<Payload> messages;
+		messages.reserve(history.size());
+		for (auto& message : history) {
+			Payload payload = message.framed(receiver->get_encoding());
+			if (payload) {
+				messages.push_back(payload);
+			}
+		}
+		receiver->send_batch(std::move(messages));
+	}
 }
 
 void Group::leave(std::shared_ptr<Receiver> receiver) {
-	receivers.erase(receiver);
+	auto slot = receiver_slots.find(receiver.get());
+	if (slot == receiver_slots.end()) {
+		return;
+	}
+	const std::size_t position = slot->second;
+	receiver_slots.erase(slot);
+	if (position + 1 != receivers.size()) {
+		receivers[position] = std::move(receivers.back());
+		receiver_slots[receivers[position].get()] = position;
+	}
+	receivers.pop_back();
+	partitions_stale = true;
+	resize(receivers.size() + 1, receivers.size());
+
+	// the address may be taken by a new session before the held event goes out
+	if (held_event && held_event->origin == receiver.get()) {
+		held_event->origin = nullptr;
+	}
 
 	if (receivers.empty()) {
+		if (name != "default") {
+			if (relay) {
+				relay->unsubscribe(name);
+			}
+			if (cluster) {
+				cluster->leave(name);
+			}
+		}
+		release();
+	}
+}
+
+void Group::add_remote_members(int delta) {
+	remote_members += delta;
+	if (remote_members == 0 && receivers.empty()) {
+		release();
+	}
+}
+
+// groups with history linger so reconnecting members still catch up, the sweep removes them
+void Group::release() {
+	if (remote_members > 0) {
+		return;
+	}
+
+	if (history.empty()) {
+		Shard::current()->stats.groups.add(-1);
 		groups.erase(name);
 	}
+	else {
+		empty_since = std::chrono::steady_clock::now();
+	}
 }
 
-void Group::send_message(std::string message) {
+bool Group::send_message(EventMessage message, const Receiver* origin, std::chrono::steady_clock::time_point received) {
 	if (name == "default") {
+		return false;
+	}
+	// the key is only taken once the event goes out, a retry of a rejected or replaced event
+	// must not read as its duplicate
+	if (recent_keys.contains(message.get_key())) {
+		Shard::current()->stats.messages_deduplicated.increment();
+		return false;
+	}
+	// events from other processes or nodes were limited where they came in, a held event
+	// keeps later ones back so they cannot overtake it
+	if (origin && (held_event || !event_limit.take(Shard::current()->get_wheel().now()))) {
+		Shard::current()->stats.group_rate_limited.increment();
+		if (config.rate_limit_policy == RateLimitPolicy::conflate) {
+			hold(std::move(message), origin, received);
+		}
+		return true;
+	}
+
+	fan_out(message, origin, origin != nullptr, received);
+	return true;
+}
+
+// local events came from a member of this process and go on to the other processes
+void Group::fan_out(EventMessage& message, const Receiver* origin, bool local, std::chrono::steady_clock::time_point received) {
+	recent_keys.insert(message.get_key());
+	if (local) {
+		if (relay) {
+			relay->publish(name, message);
+		}
+		if (cluster) {
+			cluster->publish(name, message);
+		}
+	}
+
+	// one extra pending count keeps the delivery open until every receiver got its share
+	std::shared_ptr<Delivery> delivery;
+	if (received != std::chrono::steady_clock::time_point()) {
+		delivery = std::make_shared<Delivery>(received, receivers.size() + 1);
+	}
+
+	std::size_t skipped = 0;
+	if (shards && shards->size() > 1 && config.parallel_fanout != 0 && receivers.size() >= config.parallel_fanout) {
+		fan_out_parallel(message, origin, delivery);
+	}
+	else {
+		// the group shrank below the limit
+		if (!partitions.empty()) {
+			partitions.clear();
+			partitions_stale = true;
+		}
+
+		// frame once per encoding, every receiver of that encoding queues the same buffer
+		for (const auto& receiver : receivers) {
+			if (receiver.get() == origin && !receiver->wants_echo()) {
+				++skipped;
+				continue;
+			}
+
+			Payload payload = message.framed(receiver->get_encoding());
+			if (payload) {
+				receiver->send_message(payload, receiver->wants_datagrams() ? message.framed(Encoding::binary) : nullptr, delivery);
+			}
+			else {
+				++skipped;
+			}
+		}
+	}
+
+	if (delivery) {
+		delivery->complete(Shard::current()->stats.fanout_latency, skipped + 1);
+	}
+
+	// logged once it is in the history, a compaction on a full log must snapshot it
+	record(std::move(message));
+	if (state_store && !history.empty()) {
+		state_store->append_event(name, history.back());
+	}
+}
+
+// Every shard gets one task for its share of the receivers. All events for a receiver go through
+// its shard's inbox from this shard, so they keep their order whether the group fans out serially
+// or in parallel.
+void Group::fan_out_parallel(EventMessage& message, const Receiver* origin, const std::shared_ptr<Delivery>& delivery) {
+	if (partitions_stale) {
+		partition();
+	}
+
+	// framed here, the message itself must not be touched from other shards
+	const Payload json_frame = message.framed(Encoding::json);
+	const Payload binary_frame = message.framed(Encoding::binary);
+	for (std::size_t i = 0; i < partitions.size(); ++i) {
+		if (!partitions[i]) {
+			continue;
+		}
+
+		shards->at(i).dispatch([partition = partitions[i], json_frame, binary_frame, origin, delivery]() {
+			std::size_t skipped = 0;
+			for (const auto& receiver : *partition) {
+				if (receiver.get() == origin && !receiver->wants_echo()) {
+					++skipped;
+					continue;
+				}
+
+				const Payload& payload = receiver->get_encoding() == Encoding::binary ? binary_frame : json_frame;
+				if (payload) {
+					receiver->send_message(payload, receiver->wants_datagrams() ? binary_frame : nullptr, delivery);
+				}
+				else {
+					++skipped;
+				}
+			}
+
+			if (delivery && skipped > 0) {
+				delivery->complete(Shard::current()->stats.fanout_latency, skipped);
+			}
+		});
+	}
+}
+
+void Group::partition() {
+	std::vector<std::vector<std::shared_ptr<Receiver>>> shares(shards->size());
+	for (const auto& receiver : receivers) {
+		shares[receiver->get_shard_index()].push_back(receiver);
+	}
+
+	partitions.clear();
+	for (auto& share : shares) {
+		if (share.empty()) {
+			partitions.push_back(nullptr);
+		}
+		else {
+			partitions.push_back(std::make_shared<const std::vector<std::shared_ptr<Receiver>>>(std::move(share)));
+		}
+	}
+	partitions_stale = false;
+}
+
+void Group::hold(EventMessage message, const Receiver* origin, std::chrono::steady_clock::time_point received) {
+	if (held_event) {
+		Shard::current()->stats.rate_limit_conflated.increment();
+	}
+	held_event = HeldEvent{std::move(message), origin, received};
+	schedule_held_event();
+}
+
+void Group::schedule_held_event() {
+	if (held_event_scheduled) {
 		return;
 	}
+	held_event_scheduled = true;
+
+	// the group may be gone by then, it is looked up again
+	TimingWheel& wheel = Shard::current()->get_wheel();
+	wheel.schedule(event_limit.wait(wheel.now()), [name = name]() {
+		auto group = find_group(name);
+		if (group) {
+			group->send_held_event();
+		}
+	});
+}
 
-	for (auto receiver : receivers) {
-		receiver->send_message(message);
+void Group::send_held_event() {
+	held_event_scheduled = false;
+	if (!held_event) {
+		return;
 	}
+	if (!event_limit.take(Shard::current()->get_wheel().now())) {
+		schedule_held_event();
+		return;
+	}
+
+	HeldEvent held = std::move(*held_event);
+	held_event.reset();
+	// a copy over another channel may have gone out while it was held
+	if (recent_keys.contains(held.message.get_key())) {
+		Shard::current()->stats.messages_deduplicated.increment();
+		return;
+	}
+	fan_out(held.message, held.origin, true, held.received);
+}
+
+const std::deque<EventMessage>& Group::get_history() const {
+	return history;
 }
 
-std::shared_ptr<Group> Group::get_group(std::string name) {
-	if (groups.find(name) == groups.end()) {
-		groups[name] = std::make_shared<Group>();
+GroupHandle Group::get_handle() const {
+	return handle;
+}
+
+void Group::record(EventMessage message) {
+	if (config.group_history == 0) {
+		return;
+	}
+
+	const std::string_view type = event_types[message.get_type()];
+	if (type == "reset" || type == "map_change") {
+		history.clear();
+	}
+
+	history.push_back(std::move(message));
+	while (history.size() > config.group_history) {
+		history.pop_front();
+	}
+}
+
+std::shared_ptr<Group> Group::get_group(std::string name, const Config& config) {
+	Shard& shard = *Shard::current();
+	return groups.intern(name, [&](GroupTable::Handle local_handle) {
+		shard.stats.groups.add(1);
+		const GroupHandle handle = (static_cast<GroupHandle>(shard.get_index()) << GroupTable::handle_bits) | local_handle;
+		return std::make_shared<Group>(name, handle, config);
+	}).second;
+}
+
+std::shared_ptr<Group> Group::find_group(const std::string& name) {
+	auto group = groups.find(name);
+	return group ? *group : nullptr;
+}
+
+std::shared_ptr<Group> Group::find_group(GroupHandle handle) {
+	auto group = groups.find(handle & ((GroupHandle(1) << GroupTable::handle_bits) - 1));
+	return group ? *group : nullptr;
+}
+
+std::size_t Group::shard_of(GroupHandle handle) {
+	return static_cast<std::size_t>(handle >> GroupTable::handle_bits);
+}
+
+void Group::set_relay(Relay* new_relay) {
+	relay = new_relay;
+}
+
+void Group::set_cluster(Cluster* new_cluster) {
+	cluster = new_cluster;
+}
+
+void Group::set_state_store(StateStore* new_state_store) {
+	state_store = new_state_store;
+}
+
+void Group::set_shards(ShardPool* new_shards) {
+	shards = new_shards;
+}
+
+void Group::restore(const std::string& name, const std::vector<EventMessage>& history, const Config& config) {
+	auto group = get_group(name, config);
+	for (const auto& message : history) {
+		if (group->recent_keys.insert(message.get_key())) {
+			group->record(message);
+		}
+	}
+	if (group->receivers.empty()) {
+		group->release();
+	}
+}
+
+void Group::for_each_group(const std::function<void(const std::string&, const std::shared_ptr<Group>&)>& f) {
+	groups.for_each(f);
+}
+
+void Group::schedule_sweep(Shard& shard, const Config& config) {
+	shard.get_wheel().schedule(std::chrono::seconds(std::max(1u, config.group_linger / 4)), [&shard, &config]() {
+		sweep(shard, config);
+		schedule_sweep(shard, config);
+	});
+}
+
+void Group::sweep(Shard& shard, const Config& config) {
+	const auto now = std::chrono::steady_clock::now();
+	std::vector<std::string> swept;
+	groups.erase_if([&](const std::string& name, const std::shared_ptr<Group>& group) {
+		const bool expired = group->receivers.empty() && group->remote_members == 0 && now - group->empty_since >= std::chrono::seconds(config.group_linger);
+		if (expired) {
+			shard.stats.groups_swept.increment();
+			shard.stats.groups.add(-1);
+			swept.push_back(name);
+		}
+		return expired;
+	});
+
+	// logged once the groups are gone, a compaction on a full log must not snapshot them
+	if (state_store) {
+		for (const auto& name : swept) {
+			state_store->append_drop(name);
+		}
 	}
-	return groups[name];
 }
@@ -1,22 +1,109 @@
 #pragma once
 
-#include <set>
+#include <deque>
+#include <vector>
 #include <memory>
 #include <string>
-#include <map>
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <functional>
+#include <unordered_map>
 
 #include "receiver.h"
+#include "protocol.h"
+#include "config.h"
+#include "shard.h"
+#include "recent_keys.h"
+#include "rate_limit.h"
+#include "intern_table.h"
 
+class Relay;
+class Cluster;
+class StateStore;
+
+// Names a group on its shard for as long as it exists: the owning shard's index above the
+// handle of the shard's name table. Fits into a JSON number.
+using GroupHandle = std::uint64_t;
+
+// Groups live on the shard their name hashes to and must only be touched from that shard's thread.
 class Group {
 public:
-	void join(std::shared_ptr<Receiver> receiver);
+	Group(std::string name, GroupHandle handle, const Config& config);
+
+	// catch_up replays the history to the new receiver
+	void join(std::shared_ptr<Receiver> receiver, bool catch_up = true);
 	void leave(std::shared_ptr<Receiver> receiver);
-	void send_message(std::string message);
+	// returns false if the event was dropped as a duplicate, events over the rate limit count as taken
+	bool send_message(EventMessage message, const Receiver* origin, std::chrono::steady_clock::time_point received);
+	const std::deque<EventMessage>& get_history() const;
+	GroupHandle get_handle() const;
+	// members on other cluster nodes keep the group alive on its owner
+	void add_remote_members(int delta);
 
-	static std::shared_ptr<Group> get_group(std::string group_name);
+	static std::shared_ptr<Group> get_group(std::string group_name, const Config& config);
+	static std::shared_ptr<Group> find_group(const std::string& group_name);
+	// called on the shard the handle names
+	static std::shared_ptr<Group> find_group(GroupHandle handle);
+	static std::size_t shard_of(GroupHandle handle);
+	static void schedule_sweep(Shard& shard, const Config& config);
+	// set once before the shards run, events from local members are then forwarded to other processes
+	static void set_relay(Relay* relay);
+	static void set_cluster(Cluster* cluster);
+	static void set_state_store(StateStore* state_store);
+	static void set_shards(ShardPool* shards);
+	// rebuilds a group from the state store, it lingers like a group whose members left
+	static void restore(const std::string& group_name, const std::vector<EventMessage>& history, const Config& config);
+	// calls f(name, group) for every group of the calling shard
+	static void for_each_group(const std::function<void(const std::string&, const std::shared_ptr<Group>&)>& f);
 private:
+	// an event the rate limit held back, sent once there is room unless a later one replaces it
+	struct HeldEvent {
+		EventMessage message;
+		const Receiver* origin; // cleared if it leaves meanwhile, the event still counts as local
+		std::chrono::steady_clock::time_point received;
+	};
+
 	std::string name;
-	std::set<std::shared_ptr<Receiver>> receivers;
+	GroupHandle handle;
+	// dense so fan-out walks one array, a receiver's position is kept in receiver_slots and a
+	// leaving receiver's place is taken by the last one. The positions stay with the group rather
+	// than the receiver: a session switching groups is briefly in both, and the groups may live on
+	// different shards, so a position stored in the receiver would be written from two threads.
+	// Only join and leave look it up, fan-out never does.
+	std::vector<std::shared_ptr<Receiver>> receivers;
+	std::unordered_map<const Receiver*, std::size_t> receiver_slots;
+	// the receivers by the shard they live on, rebuilt for the first parallel fan-out after a
+	// change; a shard's share is immutable so it can read it while the group changes
+	std::vector<std::shared_ptr<const std::vector<std::shared_ptr<Receiver>>>> partitions;
+	bool partitions_stale = true;
+	std::size_t remote_members = 0;
+	const Config& config;
+
+	// events since the last reset or map change, replayed to late joiners
+	std::deque<EventMessage> history;
+	// uuids relayed lately, copies re-posted by other members or arriving over a second channel are dropped
+	RecentKeys recent_keys;
+	std::chrono::steady_clock::time_point empty_since;
+	TokenBucket event_limit;
+	std::optional<HeldEvent> held_event;
+	bool held_event_scheduled = false;
+
+	void fan_out(EventMessage& message, const Receiver* origin, bool local, std::chrono::steady_clock::time_point received);
+	void fan_out_parallel(EventMessage& message, const Receiver* origin, const std::shared_ptr<Delivery>& delivery);
+	void partition();
+	void hold(EventMessage message, const Receiver* origin, std::chrono::steady_clock::time_point received);
+	void schedule_held_event();
+	void send_held_event();
+	void record(EventMessage message);
+	void release();
+
+	using GroupTable = InternTable<std::shared_ptr<Group>>;
+	static thread_local GroupTable groups;
+	static Relay* relay;
+	static Cluster* cluster;
+	static StateStore* state_store;
+	static ShardPool* shards;
 
-	static std::map<std::string, std::shared_ptr<Group>> groups;
-};
\ No newline at end of file
+	static void sweep(Shard& shard, const Config& config);
+};
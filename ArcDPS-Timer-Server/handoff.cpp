@@ -0,0 +1,532 @@
+#include "handoff.h"
+
+#include <memory>
+#include <cstring>
+#include <string>
+#include <stdexcept>
+
+#include "group.h"
+#include "logger.h"
+#include "session.h"
+
+Handoff::Handoff(ShardPool& shards, const Config& config)
+:	shards(shards),
+	config(config),
+	shard(shards.at(0)),
+	drain_timer(shard.context())
+#if defined(BOOST_ASIO_HAS_POSIX_STREAM_DESCRIPTOR)
+	,
+	listener(shard.context()),
+	connection(shard.context())
+#endif
+{
+}
+
+bool Handoff::is_shutting_down() const {
+	return shutting_down;
+}
+
+void Handoff::shut_down() {
+	if (shutting_down) {
+		return;
+	}
+	shutting_down = true;
+	drain(false);
+}
+
+void Handoff::exit_process(int status) {
+	on_every_shard([this](std::function<void()> done) {
+		if (recorder) {
+			recorder->flush(*Shard::current());
+		}
+		done();
+	}, [status]() {
+		Logger::stop();
+		exit(status);
+	});
+}
+
+void Handoff::on_every_shard(std::function<void(std::function<void()>)> task, std::function<void()> all_done) {
+	// only touched on shard 0
+	auto remaining = std::make_shared<std::size_t>(shards.size());
+	for (std::size_t i = 0; i < shards.size(); ++i) {
+		shards.at(i).dispatch([this, task, all_done, remaining]() {
+			task([this, all_done, remaining]() {
+				shard.dispatch([all_done, remaining]() {
+					if (--*remaining == 0) {
+						all_done();
+					}
+				});
+			});
+		});
+	}
+}
+
+// Sessions stop handling input first. Two rounds through every shard then let the events they
+// already read reach their groups' shards and from there the sessions' shards, after that nothing
+// is added to the queues anymore and each session is handed over or closed once its queue is empty.
+void Handoff::drain(bool hand_over_sessions) {
+	server->stop_accepting();
+	if (metrics) {
+		metrics->stop_accepting();
+	}
+
+	// clients that stopped reading do not hold up the exit forever
+	drain_timer.expires_after(std::chrono::seconds(config.drain_timeout));
+	drain_timer.async_wait([this](const boost::system::error_code& ec) {
+		if (!ec) {
+			log_warning("Drain timed out, exiting");
+			exit_process(0);
+		}
+	});
+
+	using Task = std::function<void(std::function<void()>)>;
+	const Task nothing = [](std::function<void()> done) {
+		done();
+	};
+	const Task pause_sessions = [](std::function<void()> done) {
+		for (const auto& session : Session::get_sessions()) {
+			session->pause();
+		}
+		done();
+	};
+	const Task send_history = [this](std::function<void()> done) {
+		Group::for_each_group([this](const std::string& name, const std::shared_ptr<Group>& group) {
+			if (group->get_history().empty()) {
+				return;
+			}
+
+			std::string message;
+			message.push_back(static_cast<char>(name.size() & 0xFF));
+			message.push_back(static_cast<char>((name.size() >> 8) & 0xFF));
+			message.append(name);
+			for (const auto& event : group->get_history()) {
+				const std::string packed = event.pack();
+				for (std::size_t i = 0; i < 4; ++i) {
+					message.push_back(static_cast<char>((packed.size() >> (8 * i)) & 0xFF));
+				}
+				message.append(packed);
+			}
+			shard.dispatch([this, message]() {
+				send(HandoffKind::history, message);
+			});
+		});
+		done();
+	};
+	const Task drain_sessions = [this, hand_over_sessions](std::function<void()> done) {
+		auto sessions = Session::get_sessions();
+		auto remaining = std::make_shared<std::size_t>(sessions.size() + 1);
+		auto finished = [remaining, done]() {
+			if (--*remaining == 0) {
+				done();
+			}
+		};
+
+		for (const auto& session : sessions) {
+			session->pause();
+			session->drain([this, session, hand_over_sessions, finished]() {
+				if (hand_over_sessions && session->can_hand_off()) {
+					hand_over_session(*session);
+				}
+				else {
+					session->finish();
+				}
+				finished();
+			});
+		}
+		finished();
+	};
+
+	on_every_shard(pause_sessions, [=, this]() {
+		on_every_shard(nothing, [=, this]() {
+			on_every_shard(nothing, [=, this]() {
+				on_every_shard(hand_over_sessions ? send_history : nothing, [=, this]() {
+					on_every_shard(drain_sessions, [this, hand_over_sessions]() {
+						if (hand_over_sessions) {
+							send(HandoffKind::done, {});
+							log_info("Handed over, exiting");
+						}
+						else {
+							log_info("Drained all sessions, exiting");
+						}
+						exit_process(0);
+					});
+				});
+			});
+		});
+	});
+}
+
+#if defined(BOOST_ASIO_HAS_POSIX_STREAM_DESCRIPTOR)
+
+#include <sys/un.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+static sockaddr_un make_address(const std::string& path) {
+	sockaddr_un address{};
+	address.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(address.sun_path)) {
+		throw std::invalid_argument("Handoff path too long: " + path);
+	}
+	std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+	return address;
+}
+
+// Returns the result of recvmsg, any passed file descriptors end up in fds.
+static ssize_t receive_message(int socket, int flags, std::string& message, std::vector<int>& fds) {
+	message.resize(max_handoff_message_size);
+	iovec iov{message.data(), message.size()};
+	alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * 4)];
+
+	msghdr header{};
+	header.msg_iov = &iov;
+	header.msg_iovlen = 1;
+	header.msg_control = control;
+	header.msg_controllen = sizeof(control);
+
+	const ssize_t length = ::recvmsg(socket, &header, flags | MSG_CMSG_CLOEXEC);
+	for (cmsghdr* cmsg = CMSG_FIRSTHDR(&header); length >= 0 && cmsg; cmsg = CMSG_NXTHDR(&header, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+			const std::size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			for (std::size_t i = 0; i < count; ++i) {
+				int fd;
+				std::memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+				fds.push_back(fd);
+			}
+		}
+	}
+
+	if (length >= 0 && (header.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	message.resize(std::max<ssize_t>(length, 0));
+	return length;
+}
+
+static unsigned short local_port(int socket) {
+	sockaddr_storage address{};
+	socklen_t length = sizeof(address);
+	if (::getsockname(socket, reinterpret_cast<sockaddr*>(&address), &length) < 0) {
+		return 0;
+	}
+	if (address.ss_family == AF_INET) {
+		return ntohs(reinterpret_cast<sockaddr_in*>(&address)->sin_port);
+	}
+	if (address.ss_family == AF_INET6) {
+		return ntohs(reinterpret_cast<sockaddr_in6*>(&address)->sin6_port);
+	}
+	return 0;
+}
+
+InheritedListeners Handoff::take_over() {
+	if (config.handoff_path.empty()) {
+		return {};
+	}
+
+	const sockaddr_un address = make_address(config.handoff_path);
+	const int fd = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		throw std::runtime_error("Could not create the handoff socket: " + std::string(std::strerror(errno)));
+	}
+	if (::connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) < 0) {
+		// nobody to take over from, possibly a stale path of a crashed process
+		::close(fd);
+		return {};
+	}
+	connection.assign(fd);
+
+	timeval timeout{10, 0};
+	::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	std::string message;
+	std::vector<int> fds;
+	const ssize_t length = receive_message(fd, 0, message, fds);
+	if (length <= 0 || static_cast<HandoffKind>(message[0]) != HandoffKind::listeners || fds.empty()) {
+		for (const int inherited : fds) {
+			::close(inherited);
+		}
+		throw std::runtime_error("The process on " + config.handoff_path + " did not hand over its listening socket");
+	}
+	timeout = {0, 0};
+	::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	// a socket for another port than configured is left to close with the old process
+	InheritedListeners inherited;
+	if (local_port(fds[0]) == config.port) {
+		inherited.server = fds[0];
+	}
+	else {
+		::close(fds[0]);
+	}
+	for (std::size_t i = 1; i < fds.size(); ++i) {
+		if (i == 1 && config.metrics_port != 0 && local_port(fds[i]) == config.metrics_port) {
+			inherited.metrics = fds[i];
+		}
+		else {
+			::close(fds[i]);
+		}
+	}
+
+	log_info("Taking over from the process on " + config.handoff_path);
+	return inherited;
+}
+
+void Handoff::start(Server& new_server, MetricsServer* new_metrics, StateStore* new_state_store, Recorder* new_recorder) {
+	server = &new_server;
+	metrics = new_metrics;
+	state_store = new_state_store;
+	recorder = new_recorder;
+
+	if (config.handoff_path.empty()) {
+		return;
+	}
+	shard.dispatch([this]() {
+		if (connection.is_open()) {
+			receive();
+		}
+		else {
+			listen();
+		}
+	});
+}
+
+void Handoff::receive() {
+	connection.async_wait(boost::asio::posix::stream_descriptor::wait_read, [this](const boost::system::error_code& ec) {
+		if (ec == boost::asio::error::operation_aborted) {
+			return;
+		}
+
+		bool done = ec.failed();
+		while (!done) {
+			std::string message;
+			std::vector<int> fds;
+			const ssize_t length = receive_message(connection.native_handle(), MSG_DONTWAIT, message, fds);
+			if (length < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				receive();
+				return;
+			}
+
+			// a message that did not fit is dropped as a whole
+			if (length > 0 && static_cast<HandoffKind>(message[0]) != HandoffKind::done) {
+				handle_message(static_cast<HandoffKind>(message[0]), std::string_view(message).substr(1), fds);
+			}
+			else if (length >= 0 || errno != EMSGSIZE) {
+				done = true;
+			}
+			for (const int fd : fds) {
+				::close(fd);
+			}
+		}
+
+		log_info("Took over from the previous process");
+		boost::system::error_code close_ec;
+		connection.close(close_ec);
+		listen();
+	});
+}
+
+// Adopts what the old process hands over, file descriptors it takes are removed from fds.
+void Handoff::handle_message(HandoffKind kind, std::string_view rest, std::vector<int>& fds) {
+	switch (kind) {
+	case HandoffKind::history: {
+		if (rest.size() < 2) {
+			return;
+		}
+		const std::size_t name_length = static_cast<std::uint8_t>(rest[0]) | (static_cast<std::uint8_t>(rest[1]) << 8);
+		if (rest.size() < 2 + name_length) {
+			return;
+		}
+		const std::string name(rest.substr(2, name_length));
+
+		std::vector<EventMessage> history;
+		std::size_t offset = 2 + name_length;
+		while (rest.size() - offset >= 4) {
+			std::size_t length = 0;
+			for (std::size_t i = 0; i < 4; ++i) {
+				length |= static_cast<std::size_t>(static_cast<std::uint8_t>(rest[offset + i])) << (8 * i);
+			}
+			if (rest.size() - offset - 4 < length) {
+				break;
+			}
+			auto message = EventMessage::unpack(rest.substr(offset + 4, length));
+			if (message) {
+				history.push_back(std::move(message.value()));
+			}
+			offset += 4 + length;
+		}
+
+		shards.owner_of(name).dispatch([name, history, &config = config]() {
+			Group::restore(name, history, config);
+		});
+		break;
+	}
+	case HandoffKind::session: {
+		auto state = SessionState::unpack(rest);
+		if (!state || fds.size() != 1) {
+			return;
+		}
+
+		Shard& session_shard = shards.next();
+		boost::asio::ip::tcp::socket socket(session_shard.context());
+		boost::system::error_code ec;
+		socket.assign(boost::asio::ip::tcp::v4(), fds[0], ec);
+		if (ec) {
+			return;
+		}
+		fds.clear();
+
+		// UDP is not handed over, the client falls back to TCP until it binds again
+		auto session = std::make_shared<Session>(std::move(socket), session_shard, shards, config, nullptr);
+		session_shard.dispatch([session, state = std::move(state.value())]() {
+			session->resume(state);
+		});
+		break;
+	}
+	case HandoffKind::listeners:
+	case HandoffKind::done:
+		break;
+	}
+}
+
+void Handoff::listen() {
+	::unlink(config.handoff_path.c_str());
+
+	const sockaddr_un address = make_address(config.handoff_path);
+	const int fd = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0 || ::bind(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) < 0 || ::listen(fd, 1) < 0) {
+		log_error("Could not listen for handoffs on " + config.handoff_path + ": " + std::strerror(errno));
+		if (fd >= 0) {
+			::close(fd);
+		}
+		return;
+	}
+
+	listener.assign(fd);
+	log_info("Waiting for handoffs on " + config.handoff_path);
+	accept();
+}
+
+void Handoff::accept() {
+	listener.async_wait(boost::asio::posix::stream_descriptor::wait_read, [this](const boost::system::error_code& ec) {
+		if (ec) {
+			return;
+		}
+
+		const int fd = ::accept4(listener.native_handle(), nullptr, nullptr, SOCK_CLOEXEC);
+		if (fd < 0 || shutting_down) {
+			if (fd >= 0) {
+				::close(fd);
+			}
+			accept();
+			return;
+		}
+		hand_over(fd);
+	});
+}
+
+void Handoff::hand_over(int connection_fd) {
+	log_info("Handing over to a new process");
+	shutting_down = true;
+	// the successor listens on the path once it took everything over
+	boost::system::error_code ec;
+	listener.close(ec);
+	connection.assign(connection_fd);
+	connection.non_blocking(false);
+
+	// the successor starts on the state directory once appends still running on other shards are done
+	if (state_store) {
+		state_store->detach();
+	}
+	on_every_shard([](std::function<void()> done) {
+		done();
+	}, [this]() {
+		std::vector<int> fds = {server->native_handle()};
+		if (metrics) {
+			fds.push_back(metrics->native_handle());
+		}
+		send(HandoffKind::listeners, {}, fds);
+		drain(config.handoff_sessions);
+	});
+}
+
+void Handoff::hand_over_session(Session& session) {
+	SessionState state;
+	const int fd = session.release(state);
+	shard.dispatch([this, fd, packed = state.pack()]() {
+		// a session with too much unhandled input is closed, its client reconnects
+		if (packed.size() < max_handoff_message_size) {
+			send(HandoffKind::session, packed, {fd});
+		}
+		::close(fd);
+	});
+}
+
+// Blocking, the new process reads while this one drains.
+void Handoff::send(HandoffKind kind, std::string_view rest, const std::vector<int>& fds) {
+	std::string message(1, static_cast<char>(kind));
+	message.append(rest);
+
+	iovec iov{message.data(), message.size()};
+	msghdr header{};
+	header.msg_iov = &iov;
+	header.msg_iovlen = 1;
+
+	std::vector<char> control;
+	if (!fds.empty()) {
+		control.resize(CMSG_SPACE(sizeof(int) * fds.size()));
+		header.msg_control = control.data();
+		header.msg_controllen = control.size();
+		cmsghdr* cmsg = CMSG_FIRSTHDR(&header);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+		std::memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+	}
+
+	if (::sendmsg(connection.native_handle(), &header, MSG_NOSIGNAL) < 0) {
+		log_error(std::string("Could not send handoff message: ") + std::strerror(errno));
+	}
+}
+
+#else
+
+InheritedListeners Handoff::take_over() {
+	if (!config.handoff_path.empty()) {
+		throw std::runtime_error("Handoffs need Unix domain sockets, which are not available on this platform");
+	}
+	return {};
+}
+
+void Handoff::start(Server& new_server, MetricsServer* new_metrics, StateStore* new_state_store, Recorder* new_recorder) {
+	server = &new_server;
+	metrics = new_metrics;
+	state_store = new_state_store;
+	recorder = new_recorder;
+}
+
+void Handoff::receive() {
+}
+
+void Handoff::handle_message(HandoffKind kind, std::string_view rest, std::vector<int>& fds) {
+}
+
+void Handoff::listen() {
+}
+
+void Handoff::accept() {
+}
+
+void Handoff::hand_over(int connection_fd) {
+}
+
+void Handoff::hand_over_session(Session& session) {
+	session.finish();
+}
+
+void Handoff::send(HandoffKind kind, std::string_view rest, const std::vector<int>& fds) {
+}
+
+#endif
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <optional>
+#include <functional>
+#include <string_view>
+#include <boost/asio.hpp>
+
+#include "config.h"
+#include "shard.h"
+#include "server.h"
+#include "metrics.h"
+#include "state_store.h"
+#include "recorder.h"
+#include "session.h"
+
+// Hands a running server over to a new process without cutting its sessions. The old process
+// listens on a Unix seqpacket socket at --handoff-path. A new process started with the same path
+// connects to it and gets the listening sockets passed with SCM_RIGHTS, so new connections go to
+// it right away. The old process then stops reading its sessions, lets the events in flight fan
+// out and drains every queue. It passes the groups' history and each session's socket and
+// protocol state on, or closes the sessions if --handoff-sessions is off, and exits.
+// Messages are uint8 kind, kind specific rest.
+enum class HandoffKind : std::uint8_t {
+	listeners = 0, // carries the listening socket and the metrics socket if there is one, rest is uint8 1 with metrics
+	history = 1,   // uint16 little endian group name length, group name, then uint32 little endian length and packed EventMessage per event
+	session = 2,   // carries the session's socket, rest is a packed SessionState
+	done = 3       // everything was handed over, the old process exits
+};
+
+constexpr std::size_t max_handoff_message_size = 128 * 1024;
+
+struct InheritedListeners {
+	std::optional<boost::asio::ip::tcp::acceptor::native_handle_type> server;
+	std::optional<boost::asio::ip::tcp::acceptor::native_handle_type> metrics;
+};
+
+class Handoff {
+public:
+	Handoff(ShardPool& shards, const Config& config);
+	Handoff(const Handoff&) = delete;
+	Handoff& operator=(const Handoff&) = delete;
+
+	// Before the servers start: takes the listening sockets over from the process serving the
+	// handoff path, if there is one. Blocks until it sent them.
+	InheritedListeners take_over();
+	// Once the servers exist: adopts the old process's sessions as they arrive and then serves
+	// the handoff path for the next process.
+	void start(Server& server, MetricsServer* metrics, StateStore* state_store, Recorder* recorder);
+	// Stops accepting, drains every session and exits, used on signals.
+	void shut_down();
+	bool is_shutting_down() const;
+	// Every shard flushes its capture file, then the process exits with status. exit() skips the
+	// destructors that would do it otherwise.
+	void exit_process(int status);
+private:
+	ShardPool& shards;
+	const Config& config;
+	Shard& shard;
+	Server* server = nullptr;
+	MetricsServer* metrics = nullptr;
+	StateStore* state_store = nullptr;
+	Recorder* recorder = nullptr;
+	bool shutting_down = false;
+	boost::asio::steady_timer drain_timer;
+
+#if defined(BOOST_ASIO_HAS_POSIX_STREAM_DESCRIPTOR)
+	// the handoff path's listening socket, and the connection to the process on the other side
+	boost::asio::posix::stream_descriptor listener;
+	boost::asio::posix::stream_descriptor connection;
+#endif
+
+	void listen();
+	void accept();
+	void receive();
+	void handle_message(HandoffKind kind, std::string_view rest, std::vector<int>& fds);
+	void hand_over(int connection_fd);
+	void hand_over_session(Session& session);
+	void drain(bool hand_over_sessions);
+	void send(HandoffKind kind, std::string_view rest, const std::vector<int>& fds = {});
+	// runs task on every shard, it calls the done it gets there, all_done then runs on shard 0
+	void on_every_shard(std::function<void(std::function<void()>)> task, std::function<void()> all_done);
+};
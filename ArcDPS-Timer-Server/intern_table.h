@@ -0,0 +1,197 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <optional>
+#include <functional>
+#include <string_view>
+
+// Interned names mapped to values, with a compact handle per name. Names live in slots that
+// keep their index for as long as the name is interned; a handle is the slot index and the
+// slot's generation, so the handle of a removed name never finds the name that reuses its slot
+// (until the 16 bit generation wraps). Handles take 40 bits for up to 2^24 names.
+// Lookups by name probe an open-addressing index of slot numbers (linear probing, removals
+// shift the following entries back instead of leaving tombstones), lookups by handle are one
+// array access.
+template <typename Value>
+class InternTable {
+public:
+	using Handle = std::uint64_t; // 0 is never a handle
+	static constexpr unsigned int handle_bits = 40;
+
+	InternTable()
+	:	index(16, 0) {
+	}
+
+	InternTable(const InternTable&) = delete;
+	InternTable& operator=(const InternTable&) = delete;
+
+	Value* find(std::string_view name) {
+		const std::size_t position = find_position(name, hash_of(name));
+		return index[position] == 0 ? nullptr : &*slots[index[position] - 1].value;
+	}
+
+	Value* find(Handle handle) {
+		const std::size_t slot = handle & slot_mask;
+		if (slot >= slots.size() || !slots[slot].value || slots[slot].generation != (handle >> slot_bits)) {
+			return nullptr;
+		}
+		return &*slots[slot].value;
+	}
+
+	// make is only called if the name is new
+	template <typename Make>
+	std::pair<Handle, Value&> intern(std::string_view name, Make make) {
+		const std::uint64_t hash = hash_of(name);
+		std::size_t position = find_position(name, hash);
+		if (index[position] != 0) {
+			const std::uint32_t slot = index[position] - 1;
+			return {make_handle(slot), *slots[slot].value};
+		}
+
+		std::uint32_t slot;
+		if (!free_slots.empty()) {
+			slot = free_slots.back();
+			free_slots.pop_back();
+		}
+		else {
+			slot = static_cast<std::uint32_t>(slots.size());
+			slots.emplace_back();
+		}
+		Slot& entry = slots[slot];
+		entry.name = name;
+		entry.hash = hash;
+		entry.value.emplace(make(make_handle(slot)));
+		index[position] = slot + 1;
+
+		// at most half full keeps probe sequences short
+		if (++count * 2 > index.size()) {
+			grow();
+		}
+		return {make_handle(slot), *entry.value};
+	}
+
+	bool erase(std::string_view name) {
+		const std::size_t position = find_position(name, hash_of(name));
+		if (index[position] == 0) {
+			return false;
+		}
+		remove(position);
+		return true;
+	}
+
+	// removes every entry predicate(name, value) returns true for
+	template <typename Predicate>
+	void erase_if(Predicate predicate) {
+		for (std::size_t slot = 0; slot < slots.size(); ++slot) {
+			if (slots[slot].value && predicate(slots[slot].name, *slots[slot].value)) {
+				remove(find_position(slots[slot].name, slots[slot].hash));
+			}
+		}
+	}
+
+	// calls f(name, value) for every entry, in no particular order
+	template <typename Function>
+	void for_each(Function f) const {
+		for (const Slot& slot : slots) {
+			if (slot.value) {
+				f(slot.name, *slot.value);
+			}
+		}
+	}
+
+	std::size_t size() const {
+		return count;
+	}
+
+	// positions a lookup of the name looks at, 1 if it sits at its home position
+	std::size_t probe_length(std::string_view name) const {
+		const std::size_t mask = index.size() - 1;
+		const std::size_t home = hash_of(name) & mask;
+		return ((find_position(name, hash_of(name)) - home) & mask) + 1;
+	}
+private:
+	static constexpr unsigned int slot_bits = 24;
+	static constexpr Handle slot_mask = (Handle(1) << slot_bits) - 1;
+	static constexpr std::uint32_t generation_mask = (1u << (handle_bits - slot_bits)) - 1;
+
+	struct Slot {
+		std::string name;
+		std::uint64_t hash = 0;
+		std::uint32_t generation = 1;
+		std::optional<Value> value;
+	};
+
+	std::vector<Slot> slots;
+	std::vector<std::uint32_t> free_slots;
+	// slot number plus one, 0 is empty, the size is a power of two
+	std::vector<std::uint32_t> index;
+	std::size_t count = 0;
+
+	// ShardPool picks a name's shard from the same std::hash, so the names of one shard share
+	// its low bits; mixed, every bit decides the position (the 64 bit finalizer of MurmurHash3)
+	static std::uint64_t hash_of(std::string_view name) {
+		std::uint64_t hash = std::hash<std::string_view>{}(name);
+		hash ^= hash >> 33;
+		hash *= 0xff51afd7ed558ccdULL;
+		hash ^= hash >> 33;
+		hash *= 0xc4ceb9fe1a85ec53ULL;
+		hash ^= hash >> 33;
+		return hash;
+	}
+
+	Handle make_handle(std::uint32_t slot) const {
+		return (Handle(slots[slot].generation) << slot_bits) | slot;
+	}
+
+	// the position holding the name, or the empty position it would go to
+	std::size_t find_position(std::string_view name, std::uint64_t hash) const {
+		const std::size_t mask = index.size() - 1;
+		for (std::size_t position = hash & mask;; position = (position + 1) & mask) {
+			const std::uint32_t entry = index[position];
+			if (entry == 0 || (slots[entry - 1].hash == hash && slots[entry - 1].name == name)) {
+				return position;
+			}
+		}
+	}
+
+	void remove(std::size_t position) {
+		const std::uint32_t slot = index[position] - 1;
+		Slot& entry = slots[slot];
+		entry.value.reset();
+		entry.name.clear();
+		// generation 0 would make a handle of slot 0 read as no handle
+		entry.generation = entry.generation % generation_mask + 1;
+		free_slots.push_back(slot);
+		--count;
+
+		// entries after the hole move up if that keeps them at or after their home position
+		const std::size_t mask = index.size() - 1;
+		std::size_t hole = position;
+		for (std::size_t next = (hole + 1) & mask; index[next] != 0; next = (next + 1) & mask) {
+			const std::size_t home = slots[index[next] - 1].hash & mask;
+			if (((next - home) & mask) >= ((next - hole) & mask)) {
+				index[hole] = index[next];
+				hole = next;
+			}
+		}
+		index[hole] = 0;
+	}
+
+	void grow() {
+		std::vector<std::uint32_t> old_index(index.size() * 2, 0);
+		old_index.swap(index);
+		const std::size_t mask = index.size() - 1;
+		for (const std::uint32_t entry : old_index) {
+			if (entry == 0) {
+				continue;
+			}
+			std::size_t position = slots[entry - 1].hash & mask;
+			while (index[position] != 0) {
+				position = (position + 1) & mask;
+			}
+			index[position] = entry;
+		}
+	}
+};
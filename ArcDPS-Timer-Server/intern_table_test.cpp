@@ -0,0 +1,43 @@
+// Checks that the group names of one shard spread over the shard's name table: interns the names
+// that land on shard 0 of a 4 shard pool and measures how many positions a lookup probes. Linear
+// probing averages (1 + 1 / (1 - load)) / 2 probes for spread names, 1.5 at the half full the
+// table allows at most. Exits nonzero above that.
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <algorithm>
+
+#include "intern_table.h"
+#include "shard.h"
+
+int main() {
+	ShardPool shards(4);
+	InternTable<int> table;
+
+	std::vector<std::string> names;
+	for (std::size_t i = 0; names.size() < 50000; ++i) {
+		std::string name = "group-" + std::to_string(i);
+		if (shards.owner_of(name).get_index() == 0) {
+			names.push_back(std::move(name));
+		}
+	}
+
+	for (const auto& name : names) {
+		table.intern(name, [](InternTable<int>::Handle) {
+			return 0;
+		});
+	}
+
+	std::size_t total = 0;
+	std::size_t longest = 0;
+	for (const auto& name : names) {
+		const std::size_t length = table.probe_length(name);
+		total += length;
+		longest = std::max(longest, length);
+	}
+	const double average = static_cast<double>(total) / names.size();
+
+	std::cout << "names: " << names.size() << ", average probe length: " << average << ", longest: " << longest << std::endl;
+	return average <= 1.5 ? 0 : 1;
+}
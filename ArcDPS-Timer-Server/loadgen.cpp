@@ -0,0 +1,764 @@
+// Synthetic client swarm for arcdps-timer-server. Opens a number of sessions spread over
+// groups, speaks the real version/join/state protocol and fires events at a fixed rate,
+// then prints throughput and end-to-end latency percentiles as a single JSON object.
+//
+// The send time (steady clock) travels in the event uuid, so every receiver computes
+// the latency of its copy without any shared state between sessions.
+//
+// With --metrics-port the server's metrics are scraped before and after the run to report the
+// heap allocations its shards made per event and per delivery.
+//
+// With --udp the sessions also bind the datagram fast path and --udp-loss drops that share of
+// datagrams in both directions, so the redundancy and TCP fallback can be measured under loss.
+
+#include <map>
+#include <array>
+#include <deque>
+#include <cmath>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <iostream>
+#include <algorithm>
+#include <stdexcept>
+#include <functional>
+#include <unordered_set>
+#include <boost/asio.hpp>
+#include <nlohmann/json.hpp>
+
+#include "protocol.h"
+#include "options.h"
+
+using json = nlohmann::json;
+using boost::asio::ip::tcp;
+using Clock = std::chrono::steady_clock;
+
+struct LoadConfig {
+	std::string host = "127.0.0.1";
+	unsigned short port = 5000;
+	std::size_t sessions = 100;
+	std::size_t groups = 10;
+	double rate = 100; // events per second over all sessions
+	unsigned int duration = 10;
+	unsigned int drain = 2;
+	unsigned int connect_timeout = 10;
+	std::size_t threads = 1;
+	Encoding encoding = Encoding::json;
+	bool udp = false;
+	double udp_loss = 0;
+	bool echo = true;
+	unsigned short metrics_port = 0; // the server's, 0 does not scrape it
+};
+
+static LoadConfig parse_load_config(int argc, char* argv[]) {
+	LoadConfig config;
+
+	const std::map<std::string, std::function<void(const std::string&, const std::string&)>> options = {
+		{"--host", [&](const std::string&, const std::string& value) {
+			config.host = value;
+		}},
+		{"--port", [&](const std::string& name, const std::string& value) {
+			config.port = parse_number<unsigned short>(name, value);
+		}},
+		{"--sessions", [&](const std::string& name, const std::string& value) {
+			config.sessions = parse_number<std::size_t>(name, value);
+		}},
+		{"--groups", [&](const std::string& name, const std::string& value) {
+			config.groups = parse_number<std::size_t>(name, value);
+		}},
+		{"--rate", [&](const std::string& name, const std::string& value) {
+			config.rate = parse_real(name, value);
+		}},
+		{"--duration", [&](const std::string& name, const std::string& value) {
+			config.duration = parse_number<unsigned int>(name, value);
+		}},
+		{"--drain", [&](const std::string& name, const std::string& value) {
+			config.drain = parse_number<unsigned int>(name, value);
+		}},
+		{"--connect-timeout", [&](const std::string& name, const std::string& value) {
+			config.connect_timeout = parse_number<unsigned int>(name, value);
+		}},
+		{"--threads", [&](const std::string& name, const std::string& value) {
+			config.threads = parse_number<std::size_t>(name, value);
+		}},
+		{"--echo", [&](const std::string& name, const std::string& value) {
+			config.echo = parse_number<unsigned int>(name, value) != 0;
+		}},
+		{"--udp", [&](const std::string& name, const std::string& value) {
+			config.udp = parse_number<unsigned int>(name, value) != 0;
+		}},
+		{"--metrics-port", [&](const std::string& name, const std::string& value) {
+			config.metrics_port = parse_number<unsigned short>(name, value);
+		}},
+		{"--udp-loss", [&](const std::string& name, const std::string& value) {
+			config.udp_loss = parse_real(name, value);
+			if (config.udp_loss > 1) {
+				throw std::invalid_argument("Invalid value for " + name + ": " + value);
+			}
+		}},
+		{"--protocol", [&](const std::string& name, const std::string& value) {
+			if (value == "json") {
+				config.encoding = Encoding::json;
+			}
+			else if (value == "binary") {
+				config.encoding = Encoding::binary;
+			}
+			else {
+				throw std::invalid_argument("Invalid value for " + name + ": " + value);
+			}
+		}},
+	};
+
+	for (int i = 1; i < argc; ++i) {
+		const std::string name = argv[i];
+		auto option = options.find(name);
+		if (option == options.end()) {
+			throw std::invalid_argument("Unknown option " + name);
+		}
+		if (i + 1 >= argc) {
+			throw std::invalid_argument("Missing value for " + name);
+		}
+		option->second(name, argv[++i]);
+	}
+
+	if (config.sessions == 0 || config.groups == 0 || config.threads == 0) {
+		throw std::invalid_argument("--sessions, --groups and --threads must be positive");
+	}
+	config.groups = std::min(config.groups, config.sessions);
+	return config;
+}
+
+class Client;
+
+// One io_context and thread driving a slice of the sessions. Everything in here is only
+// touched by its own thread until the run is over.
+struct Worker {
+	Worker(double rate, double loss)
+	:	timer(io_context),
+		work_guard(io_context.get_executor()),
+		rate(rate),
+		loss(loss),
+		random(std::random_device{}()) {
+	}
+
+	// the loss simulator, true if a datagram should be dropped
+	bool lose() {
+		return loss > 0 && std::uniform_real_distribution<double>(0, 1)(random) < loss;
+	}
+
+	boost::asio::io_context io_context;
+	boost::asio::steady_timer timer;
+	boost::asio::executor_work_guard<boost::asio::io_context::executor_type> work_guard;
+	std::vector<std::shared_ptr<Client>> clients;
+	double rate;
+	double loss;
+	std::mt19937 random;
+	std::size_t next_client = 0;
+	Clock::time_point started;
+
+	std::uint64_t events_sent = 0;
+	std::uint64_t deliveries_expected = 0;
+	std::uint64_t deliveries = 0;
+	std::uint64_t datagram_deliveries = 0;
+	std::uint64_t datagrams_lost = 0;
+	std::uint64_t errors = 0;
+	std::vector<std::uint32_t> latencies; // microseconds
+};
+
+static std::atomic<std::size_t> ready_clients = 0;
+
+class Client : public std::enable_shared_from_this<Client> {
+public:
+	Client(Worker& worker, std::uint32_t id, std::string group, std::size_t group_size, Encoding encoding, bool echo, bool use_udp)
+	:	worker(worker),
+		socket(worker.io_context),
+		id(id),
+		group(std::move(group)),
+		group_size(group_size),
+		requested_encoding(encoding),
+		echo(echo),
+		use_udp(use_udp),
+		datagram_socket(worker.io_context),
+		hello_timer(worker.io_context) {
+	}
+
+	void start(const tcp::resolver::results_type& endpoints) {
+		auto self(shared_from_this());
+		boost::asio::async_connect(socket, endpoints, [this, self](boost::system::error_code ec, const tcp::endpoint&) {
+			if (ec) {
+				fail("connect", ec);
+				return;
+			}
+			socket.set_option(tcp::no_delay(true));
+
+			json version = {
+				{"command", "version"},
+				{"echo", echo}
+			};
+			if (requested_encoding == Encoding::binary) {
+				version["protocol"] = "binary";
+			}
+			send_command(version);
+			receive();
+		});
+	}
+
+	// Sends one start event whose uuid carries the send time and sender.
+	void send_event() {
+		if (!ready) {
+			return;
+		}
+
+		Event event{};
+		const auto now = Clock::now().time_since_epoch();
+		const std::uint64_t sent = std::chrono::duration_cast<std::chrono::nanoseconds>(now).count();
+		for (std::size_t i = 0; i < 8; ++i) {
+			event.uuid[i] = static_cast<std::uint8_t>(sent >> (8 * i));
+		}
+		for (std::size_t i = 0; i < 4; ++i) {
+			event.uuid[8 + i] = static_cast<std::uint8_t>(id >> (8 * i));
+			event.uuid[12 + i] = static_cast<std::uint8_t>(sequence >> (8 * i));
+		}
+		++sequence;
+		event.time = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+		event.type = 0; // start
+		event.source = 0; // manual
+
+		const std::string body = encode_event(event);
+		if (datagrams_bound) {
+			std::string datagram = make_datagram(DatagramKind::events);
+			datagram.push_back(static_cast<char>(previous_body.empty() ? 1 : 2));
+			datagram.append(body);
+			datagram.append(previous_body);
+			send_datagram(datagram);
+			previous_body = body;
+		}
+
+		if (encoding == Encoding::binary) {
+			write(encode_frame(FrameKind::event, body));
+		}
+		else {
+			json command = {
+				{"command", "state"},
+				{"data", event_to_json(event)}
+			};
+			write(command.dump() + '\n');
+		}
+
+		worker.events_sent++;
+		worker.deliveries_expected += echo ? group_size : group_size - 1;
+	}
+
+	void stop() {
+		boost::system::error_code ec;
+		socket.close(ec);
+		datagram_socket.close(ec);
+		hello_timer.cancel();
+	}
+
+private:
+	Worker& worker;
+	tcp::socket socket;
+	boost::asio::streambuf buffer;
+	std::deque<std::string> write_queue;
+	std::uint32_t id;
+	std::uint32_t sequence = 0;
+	std::string group;
+	std::size_t group_size;
+	Encoding requested_encoding;
+	Encoding encoding = Encoding::json;
+	bool echo;
+	bool joined = false;
+	bool ready = false;
+	bool failed = false;
+
+	// datagram fast path, see udp.h of the server
+	enum class DatagramKind : std::uint8_t {
+		hello = 0,
+		events = 1
+	};
+
+	bool use_udp;
+	bool datagrams_bound = false;
+	std::uint64_t token = 0;
+	boost::asio::ip::udp::socket datagram_socket;
+	boost::asio::steady_timer hello_timer;
+	std::array<char, 512> datagram_buffer;
+	std::string previous_body;
+	std::size_t hello_attempts = 0;
+
+	// events arrive over both channels, only the first copy counts
+	std::unordered_set<std::string> seen;
+	std::deque<std::string> seen_order;
+
+	void fail(const char* what, const boost::system::error_code& ec) {
+		if (!failed && ec != boost::asio::error::operation_aborted) {
+			std::cerr << "Session " << id << " " << what << " failed: " << ec.message() << std::endl;
+			worker.errors++;
+		}
+		failed = true;
+	}
+
+	void receive() {
+		while (true) {
+			const auto data = buffer.data();
+			const std::string_view available(static_cast<const char*>(data.data()), data.size());
+
+			if (encoding == Encoding::json) {
+				const std::size_t end = available.find('\n');
+				if (end == std::string_view::npos) {
+					break;
+				}
+				handle_line(available.substr(0, end));
+				buffer.consume(end + 1);
+			}
+			else {
+				if (available.size() < frame_header_size) {
+					break;
+				}
+				const std::size_t length = static_cast<std::uint8_t>(available[0]) | (static_cast<std::uint8_t>(available[1]) << 8);
+				if (length == 0 || available.size() < 2 + length) {
+					break;
+				}
+				handle_frame(static_cast<FrameKind>(available[2]), available.substr(frame_header_size, length - 1));
+				buffer.consume(2 + length);
+			}
+		}
+
+		auto self(shared_from_this());
+		boost::asio::async_read(socket, buffer, boost::asio::transfer_at_least(1), [this, self](boost::system::error_code ec, std::size_t) {
+			if (ec) {
+				fail("read", ec);
+				return;
+			}
+			receive();
+		});
+	}
+
+	void handle_line(std::string_view line) {
+		json message = json::parse(line, nullptr, false);
+		if (message.is_discarded()) {
+			worker.errors++;
+			return;
+		}
+
+		if (message.value("status", "") == "state") {
+			auto event = event_from_json(message["data"]);
+			if (event) {
+				handle_event(*event);
+			}
+			return;
+		}
+		handle_response(message);
+	}
+
+	void handle_frame(FrameKind kind, std::string_view body) {
+		if (kind == FrameKind::event) {
+			auto event = decode_event(body);
+			if (event) {
+				handle_event(*event);
+			}
+			return;
+		}
+
+		json message = json::parse(body, nullptr, false);
+		if (message.is_discarded()) {
+			worker.errors++;
+			return;
+		}
+		handle_response(message);
+	}
+
+	void handle_response(const json& response) {
+		const std::string status = response.value("status", "");
+		if (status == "ping") {
+			send_command({{"command", "pong"}});
+			return;
+		}
+		if (status != "ok") {
+			std::cerr << "Session " << id << " got " << response.dump() << std::endl;
+			worker.errors++;
+			return;
+		}
+
+		if (response.contains("version")) {
+			// everything after the version response uses the negotiated encoding
+			encoding = response.value("protocol", "json") == "binary" ? Encoding::binary : Encoding::json;
+			send_command({{"command", "join"}, {"group", group}});
+		}
+		else if (!joined) {
+			joined = true;
+			if (use_udp) {
+				send_command({{"command", "udp"}});
+			}
+			else {
+				set_ready();
+			}
+		}
+		else if (use_udp && token == 0) {
+			if (!response.contains("udp_port")) {
+				std::cerr << "Session " << id << ": server has no datagram channel" << std::endl;
+				worker.errors++;
+				return;
+			}
+			token = std::stoull(response["token"].get<std::string>(), nullptr, 16);
+			bind_datagrams(response["udp_port"].get<unsigned short>());
+		}
+	}
+
+	void set_ready() {
+		ready = true;
+		ready_clients++;
+	}
+
+	std::string make_datagram(DatagramKind kind) const {
+		std::string datagram(1, static_cast<char>(kind));
+		for (std::size_t i = 0; i < 8; ++i) {
+			datagram.push_back(static_cast<char>(token >> (8 * i)));
+		}
+		return datagram;
+	}
+
+	void send_datagram(const std::string& datagram) {
+		if (worker.lose()) {
+			worker.datagrams_lost++;
+			return;
+		}
+		boost::system::error_code ec;
+		datagram_socket.send(boost::asio::buffer(datagram), 0, ec);
+	}
+
+	void bind_datagrams(unsigned short port) {
+		boost::system::error_code ec;
+		const boost::asio::ip::udp::endpoint endpoint(socket.remote_endpoint(ec).address(), port);
+		datagram_socket.open(endpoint.protocol(), ec);
+		datagram_socket.connect(endpoint, ec);
+		if (ec) {
+			fail("datagram connect", ec);
+			return;
+		}
+
+		receive_datagram();
+		send_hello();
+	}
+
+	// hellos may get lost as well, repeat until acknowledged
+	void send_hello() {
+		if (datagrams_bound) {
+			return;
+		}
+		if (hello_attempts++ == 50) {
+			std::cerr << "Session " << id << ": no datagram hello acknowledged" << std::endl;
+			worker.errors++;
+			return;
+		}
+
+		send_datagram(make_datagram(DatagramKind::hello));
+
+		auto self(shared_from_this());
+		hello_timer.expires_after(std::chrono::milliseconds(100));
+		hello_timer.async_wait([this, self](boost::system::error_code ec) {
+			if (!ec) {
+				send_hello();
+			}
+		});
+	}
+
+	void receive_datagram() {
+		auto self(shared_from_this());
+		datagram_socket.async_receive(boost::asio::buffer(datagram_buffer), [this, self](boost::system::error_code ec, std::size_t length) {
+			if (ec) {
+				if (ec == boost::asio::error::operation_aborted) {
+					return;
+				}
+				receive_datagram();
+				return;
+			}
+			if (worker.lose()) {
+				worker.datagrams_lost++;
+				receive_datagram();
+				return;
+			}
+
+			const std::string_view datagram(datagram_buffer.data(), length);
+			if (!datagram.empty() && static_cast<DatagramKind>(datagram[0]) == DatagramKind::hello) {
+				if (!datagrams_bound) {
+					datagrams_bound = true;
+					hello_timer.cancel();
+					set_ready();
+				}
+			}
+			else if (datagram.size() >= 2 && static_cast<DatagramKind>(datagram[0]) == DatagramKind::events) {
+				const std::size_t count = static_cast<std::uint8_t>(datagram[1]);
+				for (std::size_t i = 0; i < count && 2 + (i + 1) * event_body_size <= datagram.size(); ++i) {
+					auto event = decode_event(datagram.substr(2 + i * event_body_size, event_body_size));
+					if (event && handle_event(*event)) {
+						worker.datagram_deliveries++;
+					}
+				}
+			}
+			receive_datagram();
+		});
+	}
+
+	// returns whether this was the first copy of the event
+	bool handle_event(const Event& event) {
+		if (use_udp) {
+			std::string key(event.uuid.begin(), event.uuid.end());
+			if (!seen.insert(key).second) {
+				return false;
+			}
+			seen_order.push_back(std::move(key));
+			if (seen_order.size() > 4096) {
+				seen.erase(seen_order.front());
+				seen_order.pop_front();
+			}
+		}
+
+		std::uint64_t sent = 0;
+		for (std::size_t i = 0; i < 8; ++i) {
+			sent |= static_cast<std::uint64_t>(event.uuid[i]) << (8 * i);
+		}
+
+		const auto now = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+		const std::uint64_t latency = (static_cast<std::uint64_t>(now) - sent) / 1000;
+		worker.deliveries++;
+		worker.latencies.push_back(static_cast<std::uint32_t>(std::min<std::uint64_t>(latency, UINT32_MAX)));
+		return true;
+	}
+
+	void send_command(const json& command) {
+		if (encoding == Encoding::binary) {
+			write(encode_frame(FrameKind::command, command.dump()));
+		}
+		else {
+			write(command.dump() + '\n');
+		}
+	}
+
+	void write(std::string data) {
+		if (failed) {
+			return;
+		}
+
+		const bool write_in_progress = !write_queue.empty();
+		write_queue.push_back(std::move(data));
+		if (!write_in_progress) {
+			write_next();
+		}
+	}
+
+	void write_next() {
+		auto self(shared_from_this());
+		boost::asio::async_write(socket, boost::asio::buffer(write_queue.front()), [this, self](boost::system::error_code ec, std::size_t) {
+			if (ec) {
+				fail("write", ec);
+				write_queue.clear();
+				return;
+			}
+			write_queue.pop_front();
+			if (!write_queue.empty()) {
+				write_next();
+			}
+		});
+	}
+};
+
+// Fires the worker's share of the rate on a 1 ms tick, catching up on late ticks.
+static void schedule_events(Worker& worker, Clock::duration duration) {
+	worker.timer.expires_after(std::chrono::milliseconds(1));
+	worker.timer.async_wait([&worker, duration](const boost::system::error_code& ec) {
+		if (ec) {
+			return;
+		}
+
+		const auto elapsed = Clock::now() - worker.started;
+		const auto until = std::min(elapsed, duration);
+		const std::uint64_t due = static_cast<std::uint64_t>(worker.rate * std::chrono::duration<double>(until).count());
+		while (worker.events_sent < due) {
+			const std::uint64_t before = worker.events_sent;
+			for (std::size_t i = 0; i < worker.clients.size() && worker.events_sent == before; ++i) {
+				worker.clients[worker.next_client++ % worker.clients.size()]->send_event();
+			}
+			if (worker.events_sent == before) {
+				break; // no usable session left
+			}
+		}
+
+		if (elapsed < duration) {
+			schedule_events(worker, duration);
+		}
+	});
+}
+
+// Reads a counter off the server's Prometheus metrics.
+static std::uint64_t scrape_counter(const LoadConfig& config, const std::string& name) {
+	boost::asio::io_context io_context;
+	tcp::socket socket(io_context);
+	boost::asio::connect(socket, tcp::resolver(io_context).resolve(config.host, std::to_string(config.metrics_port)));
+
+	const std::string request = "GET /metrics HTTP/1.1\r\nHost: " + config.host + "\r\nConnection: close\r\n\r\n";
+	boost::asio::write(socket, boost::asio::buffer(request));
+
+	std::string response;
+	boost::system::error_code ec;
+	boost::asio::read(socket, boost::asio::dynamic_buffer(response), ec);
+
+	const std::string prefix = "\n" + name + " ";
+	const std::size_t start = response.find(prefix);
+	if (start == std::string::npos) {
+		throw std::runtime_error("No " + name + " in the server's metrics");
+	}
+	return std::stoull(response.substr(start + prefix.size()));
+}
+
+static std::uint32_t percentile(const std::vector<std::uint32_t>& sorted, double fraction) {
+	if (sorted.empty()) {
+		return 0;
+	}
+	const std::size_t rank = static_cast<std::size_t>(std::ceil(fraction * sorted.size()));
+	return sorted[std::clamp<std::size_t>(rank, 1, sorted.size()) - 1];
+}
+
+int main(int argc, char* argv[]) {
+	try {
+		const LoadConfig config = parse_load_config(argc, argv);
+
+		std::vector<std::unique_ptr<Worker>> workers;
+		for (std::size_t i = 0; i < config.threads; ++i) {
+			workers.push_back(std::make_unique<Worker>(config.rate / config.threads, config.udp_loss));
+		}
+
+		tcp::resolver resolver(workers[0]->io_context);
+		const auto endpoints = resolver.resolve(config.host, std::to_string(config.port));
+
+		// fresh group names per run so no history of an earlier run gets replayed
+		const std::string prefix = "loadgen-" + std::to_string(std::random_device()()) + "-";
+		for (std::size_t i = 0; i < config.sessions; ++i) {
+			const std::size_t group = i % config.groups;
+			const std::size_t group_size = config.sessions / config.groups + (group < config.sessions % config.groups ? 1 : 0);
+			Worker& worker = *workers[i % workers.size()];
+			worker.clients.push_back(std::make_shared<Client>(worker, static_cast<std::uint32_t>(i), prefix + std::to_string(group), group_size, config.encoding, config.echo, config.udp));
+		}
+
+		std::vector<std::thread> threads;
+		for (auto& worker : workers) {
+			for (auto& client : worker->clients) {
+				client->start(endpoints);
+			}
+			threads.emplace_back([&worker]() {
+				worker->io_context.run();
+			});
+		}
+
+		const auto connect_deadline = Clock::now() + std::chrono::seconds(config.connect_timeout);
+		while (ready_clients < config.sessions && Clock::now() < connect_deadline) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+		const std::size_t ready = ready_clients;
+		std::cerr << ready << " of " << config.sessions << " sessions joined, running for " << config.duration << "s" << std::endl;
+
+		// counted from here, connecting and joining are not part of it
+		const std::uint64_t allocations_before = config.metrics_port != 0 ? scrape_counter(config, "arcdps_timer_allocations_total") : 0;
+
+		const Clock::duration duration = std::chrono::seconds(config.duration);
+		for (auto& worker : workers) {
+			Worker* w = worker.get();
+			boost::asio::post(w->io_context, [w, duration]() {
+				w->started = Clock::now();
+				schedule_events(*w, duration);
+			});
+		}
+
+		std::this_thread::sleep_for(std::chrono::seconds(config.duration + config.drain));
+		const std::uint64_t allocations = config.metrics_port != 0 ? scrape_counter(config, "arcdps_timer_allocations_total") - allocations_before : 0;
+
+		for (auto& worker : workers) {
+			Worker* w = worker.get();
+			boost::asio::post(w->io_context, [w]() {
+				w->timer.cancel();
+				for (auto& client : w->clients) {
+					client->stop();
+				}
+				w->work_guard.reset();
+			});
+		}
+		for (auto& thread : threads) {
+			thread.join();
+		}
+
+		std::uint64_t events_sent = 0;
+		std::uint64_t deliveries_expected = 0;
+		std::uint64_t deliveries = 0;
+		std::uint64_t datagram_deliveries = 0;
+		std::uint64_t datagrams_lost = 0;
+		std::uint64_t errors = 0;
+		std::vector<std::uint32_t> latencies;
+		for (auto& worker : workers) {
+			events_sent += worker->events_sent;
+			deliveries_expected += worker->deliveries_expected;
+			deliveries += worker->deliveries;
+			datagram_deliveries += worker->datagram_deliveries;
+			datagrams_lost += worker->datagrams_lost;
+			errors += worker->errors;
+			latencies.insert(latencies.end(), worker->latencies.begin(), worker->latencies.end());
+		}
+		std::sort(latencies.begin(), latencies.end());
+
+		double mean = 0;
+		for (auto latency : latencies) {
+			mean += latency;
+		}
+		mean = latencies.empty() ? 0 : mean / latencies.size();
+
+		json result = {
+			{"config", {
+				{"host", config.host},
+				{"port", config.port},
+				{"sessions", config.sessions},
+				{"groups", config.groups},
+				{"rate", config.rate},
+				{"duration", config.duration},
+				{"threads", config.threads},
+				{"protocol", config.encoding == Encoding::binary ? "binary" : "json"},
+				{"echo", config.echo},
+				{"udp", config.udp},
+				{"udp_loss", config.udp_loss}
+			}},
+			{"sessions_joined", ready},
+			{"events_sent", events_sent},
+			{"deliveries_expected", deliveries_expected},
+			{"deliveries", deliveries},
+			{"datagram_deliveries", datagram_deliveries},
+			{"datagrams_lost", datagrams_lost},
+			{"errors", errors},
+			{"events_per_second", events_sent / static_cast<double>(std::max(1u, config.duration))},
+			{"deliveries_per_second", deliveries / static_cast<double>(std::max(1u, config.duration))},
+			{"latency_us", {
+				{"mean", mean},
+				{"p50", percentile(latencies, 0.5)},
+				{"p99", percentile(latencies, 0.99)},
+				{"p999", percentile(latencies, 0.999)},
+				{"max", latencies.empty() ? 0 : latencies.back()}
+			}}
+		};
+		if (config.metrics_port != 0) {
+			result["server_allocations"] = {
+				{"total", allocations},
+				{"per_event", allocations / static_cast<double>(std::max<std::uint64_t>(1, events_sent))},
+				{"per_delivery", allocations / static_cast<double>(std::max<std::uint64_t>(1, deliveries))}
+			};
+		}
+		std::cout << result.dump() << std::endl;
+
+		return ready == config.sessions && deliveries == deliveries_expected ? 0 : 1;
+	}
+	catch (std::exception& e) {
+		std::cerr << "Error: " << e.what() << std::endl;
+		return 2;
+	}
+}
@@ -0,0 +1,176 @@
+#include "logger.h"
+
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <utility>
+#include <algorithm>
+
+#include "ring_buffer.h"
+#include "rate_limit.h"
+
+namespace {
+
+// Fields are copied into fixed buffers, anything longer is cut off.
+template <std::size_t Size>
+struct FixedText {
+	std::array<char, Size> data;
+	std::uint16_t size = 0;
+
+	void assign(std::string_view text) {
+		size = static_cast<std::uint16_t>(std::min(text.size(), Size));
+		std::copy_n(text.data(), size, data.data());
+	}
+
+	std::string_view view() const {
+		return std::string_view(data.data(), size);
+	}
+};
+
+struct LogRecord {
+	std::chrono::system_clock::time_point time;
+	LogLevel level;
+	std::uint32_t suppressed;
+	std::uint64_t session;
+	FixedText<64> group;
+	FixedText<16> command;
+	FixedText<384> message;
+};
+
+constexpr std::array<std::string_view, 4> level_names = {
+	"debug", "info", "warning", "error"
+};
+
+// warnings and errors a thread may log per second and at once before they are suppressed
+constexpr unsigned int error_rate = 10;
+constexpr unsigned int error_burst = 20;
+
+RingBuffer<LogRecord, 4096> records;
+std::atomic<std::uint64_t> dropped = 0;
+std::atomic<bool> stopping = false;
+std::thread writer;
+
+thread_local TokenBucket error_limit(error_rate, error_burst);
+thread_local std::uint32_t suppressed = 0;
+
+void append_time(std::string& line, std::chrono::system_clock::time_point time) {
+	const auto point = std::chrono::floor<std::chrono::microseconds>(time);
+	const auto days = std::chrono::floor<std::chrono::days>(point);
+	const std::chrono::year_month_day date{days};
+	const std::chrono::hh_mm_ss clock{point - days};
+
+	char text[40];
+	std::snprintf(text, sizeof(text), "time=%04d-%02u-%02uT%02d:%02d:%02d.%06dZ",
+		static_cast<int>(date.year()), static_cast<unsigned>(date.month()), static_cast<unsigned>(date.day()),
+		static_cast<int>(clock.hours().count()), static_cast<int>(clock.minutes().count()),
+		static_cast<int>(clock.seconds().count()), static_cast<int>(clock.subseconds().count()));
+	line.append(text);
+}
+
+void append_quoted(std::string& line, std::string_view key, std::string_view value) {
+	line.push_back(' ');
+	line.append(key);
+	line.append("=\"");
+	for (const char c : value) {
+		if (c == '"' || c == '\\') {
+			line.push_back('\\');
+		}
+		line.push_back(c == '\n' ? ' ' : c);
+	}
+	line.push_back('"');
+}
+
+// one logfmt line: time, level, msg and the fields that are set
+void format_record(std::string& line, const LogRecord& record) {
+	append_time(line, record.time);
+	line.append(" level=");
+	line.append(level_names[static_cast<std::size_t>(record.level)]);
+	append_quoted(line, "msg", record.message.view());
+	if (record.session != 0) {
+		line.append(" session=");
+		line.append(std::to_string(record.session));
+	}
+	if (record.group.size > 0) {
+		append_quoted(line, "group", record.group.view());
+	}
+	if (record.command.size > 0) {
+		append_quoted(line, "command", record.command.view());
+	}
+	if (record.suppressed > 0) {
+		line.append(" suppressed=");
+		line.append(std::to_string(record.suppressed));
+	}
+	line.push_back('\n');
+}
+
+// writes everything queued in one go, returns whether there was anything
+bool write_records() {
+	std::string lines;
+	while (records.pop([&](const LogRecord& record) {
+		format_record(lines, record);
+	})) {
+	}
+
+	const std::uint64_t lost = dropped.exchange(0, std::memory_order_relaxed);
+	if (lost > 0) {
+		LogRecord record{std::chrono::system_clock::now(), LogLevel::warning, 0, 0, {}, {}, {}};
+		record.message.assign("Log records dropped, the ring was full: " + std::to_string(lost));
+		format_record(lines, record);
+	}
+
+	if (lines.empty()) {
+		return false;
+	}
+	std::fwrite(lines.data(), 1, lines.size(), stdout);
+	std::fflush(stdout);
+	return true;
+}
+
+}
+
+std::atomic<LogLevel> Logger::minimum_level = LogLevel::info;
+
+void Logger::start() {
+	writer = std::thread([]() {
+		while (!stopping.load(std::memory_order_acquire)) {
+			if (!write_records()) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			}
+		}
+		write_records();
+	});
+}
+
+void Logger::stop() {
+	if (!writer.joinable() || writer.get_id() == std::this_thread::get_id()) {
+		return;
+	}
+	stopping.store(true, std::memory_order_release);
+	writer.join();
+}
+
+void Logger::write(LogLevel level, std::string_view message, const LogFields& fields) {
+	std::uint32_t passed_suppressed = 0;
+	if (level >= LogLevel::warning) {
+		if (!error_limit.take(std::chrono::steady_clock::now())) {
+			++suppressed;
+			return;
+		}
+		passed_suppressed = std::exchange(suppressed, 0);
+	}
+
+	const bool queued = records.push([&](LogRecord& record) {
+		record.time = std::chrono::system_clock::now();
+		record.level = level;
+		record.suppressed = passed_suppressed;
+		record.session = fields.session;
+		record.group.assign(fields.group);
+		record.command.assign(fields.command);
+		record.message.assign(message);
+	});
+	if (!queued) {
+		dropped.fetch_add(1, std::memory_order_relaxed);
+	}
+}
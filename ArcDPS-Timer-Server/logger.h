@@ -0,0 +1,68 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string_view>
+
+enum class LogLevel : std::uint8_t {
+	debug,
+	info,
+	warning,
+	error,
+	off
+};
+
+// Structured fields of a record, left out of the line while empty.
+struct LogFields {
+	std::uint64_t session = 0;
+	std::string_view group;
+	std::string_view command;
+};
+
+// Records are copied into a lock-free ring and written as logfmt lines by a background thread,
+// so logging never blocks a shard on the stream. A full ring drops records and says how many.
+// Warnings and errors are rate limited per thread, the next one that passes tells how many
+// were suppressed. Filtered out records cost one relaxed load.
+class Logger {
+public:
+	// starts the writer thread, records before it are kept until then
+	static void start();
+	// writes what is left and stops the writer thread
+	static void stop();
+
+	static void set_level(LogLevel level) {
+		minimum_level.store(level, std::memory_order_relaxed);
+	}
+
+	static bool enabled(LogLevel level) {
+		return level >= minimum_level.load(std::memory_order_relaxed);
+	}
+
+	static void write(LogLevel level, std::string_view message, const LogFields& fields);
+private:
+	static std::atomic<LogLevel> minimum_level;
+};
+
+inline void log_debug(std::string_view message, const LogFields& fields = {}) {
+	if (Logger::enabled(LogLevel::debug)) {
+		Logger::write(LogLevel::debug, message, fields);
+	}
+}
+
+inline void log_info(std::string_view message, const LogFields& fields = {}) {
+	if (Logger::enabled(LogLevel::info)) {
+		Logger::write(LogLevel::info, message, fields);
+	}
+}
+
+inline void log_warning(std::string_view message, const LogFields& fields = {}) {
+	if (Logger::enabled(LogLevel::warning)) {
+		Logger::write(LogLevel::warning, message, fields);
+	}
+}
+
+inline void log_error(std::string_view message, const LogFields& fields = {}) {
+	if (Logger::enabled(LogLevel::error)) {
+		Logger::write(LogLevel::error, message, fields);
+	}
+}
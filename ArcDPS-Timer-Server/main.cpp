@@ -1,28 +1,123 @@
-#include <iostream>
+#include <string>
+#include <optional>
 #include <boost/asio.hpp>
 
+#include "config.h"
+#include "group.h"
+#include "metrics.h"
 #include "server.h"
+#include "shard.h"
+#include "stats.h"
+#include "udp.h"
+#include "relay.h"
+#include "cluster.h"
+#include "state_store.h"
+#include "handoff.h"
+#include "recorder.h"
+#include "session.h"
+#include "logger.h"
 
-void signal_handler(const boost::system::error_code& error, int signal_number) {
-    std::cout << "Shutting down because of signal " << signal_number << std::endl;
-    exit(1);
+void schedule_statistics(boost::asio::steady_timer& timer, ShardPool& shards, std::chrono::seconds interval) {
+    timer.expires_after(interval);
+    timer.async_wait([&timer, &shards, interval](const boost::system::error_code& error) {
+        if (!error) {
+            print_statistics(shards);
+            schedule_statistics(timer, shards, interval);
+        }
+    });
 }
 
-int main() {
-    std::cout << "Server starting" << std::endl;
+// The first signal drains the sessions, a second one exits without waiting for them.
+void wait_for_signal(boost::asio::signal_set& signals, Handoff& handoff) {
+    signals.async_wait([&signals, &handoff](const boost::system::error_code& error, int signal_number) {
+        if (error) {
+            return;
+        }
+        if (handoff.is_shutting_down()) {
+            log_warning("Shutting down because of signal " + std::to_string(signal_number));
+            handoff.exit_process(1);
+            return;
+        }
+
+        log_info("Draining sessions because of signal " + std::to_string(signal_number));
+        handoff.shut_down();
+        wait_for_signal(signals, handoff);
+    });
+}
+
+int main(int argc, char* argv[]) {
+    Logger::start();
+    log_info("Server starting");
 
     try {
-        boost::asio::io_context io_context;
+        Config config = parse_config(argc, argv);
+        Logger::set_level(config.log_level);
+        ShardPool shards(config.threads);
+        Group::set_shards(&shards);
+
+        // before the state store, the old process stops writing to it when it hands over
+        Handoff handoff(shards, config);
+        const InheritedListeners inherited = handoff.take_over();
+
+        boost::asio::signal_set signals(shards.at(0).context(), SIGINT, SIGTERM);
+        wait_for_signal(signals, handoff);
+
+        std::optional<StateStore> state_store;
+        if (!config.state_directory.empty()) {
+            state_store.emplace(shards, config);
+            Group::set_state_store(&*state_store);
+        }
+
+        std::optional<Relay> relay;
+        if (!config.relay_directory.empty()) {
+            relay.emplace(shards, config);
+            Group::set_relay(&*relay);
+        }
 
-        boost::asio::signal_set signals(io_context, SIGINT);
-        signals.async_wait(signal_handler);
+        std::optional<Cluster> cluster;
+        if (!config.cluster_address.empty()) {
+            cluster.emplace(shards, config);
+            Group::set_cluster(&*cluster);
+        }
 
-        boost::asio::ip::tcp::endpoint endpoint(boost::asio::ip::tcp::v4(), 5000);
-        Server server(io_context, endpoint);
+        std::optional<Recorder> recorder;
+        if (!config.capture_directory.empty()) {
+            recorder.emplace(shards, config);
+            Session::set_recorder(&*recorder);
+        }
 
-        io_context.run();
+        std::optional<UdpChannel> udp;
+        if (config.udp_port != 0) {
+            udp.emplace(shards, boost::asio::ip::udp::endpoint(boost::asio::ip::udp::v4(), config.udp_port));
+        }
+
+        boost::asio::ip::tcp::endpoint endpoint(boost::asio::ip::tcp::v4(), config.port);
+        Server server(shards, config, endpoint, udp ? &*udp : nullptr, inherited.server);
+
+        for (std::size_t i = 0; i < shards.size(); ++i) {
+            Shard& shard = shards.at(i);
+            shard.dispatch([&shard, &config]() {
+                Group::schedule_sweep(shard, config);
+            });
+        }
+
+        std::optional<MetricsServer> metrics_server;
+        if (config.metrics_port != 0) {
+            metrics_server.emplace(shards, shards.at(0).context(), boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), config.metrics_port), inherited.metrics);
+        }
+
+        handoff.start(server, metrics_server ? &*metrics_server : nullptr, state_store ? &*state_store : nullptr, recorder ? &*recorder : nullptr);
+
+        boost::asio::steady_timer statistics_timer(shards.at(0).context());
+        if (config.stats_interval > 0) {
+            schedule_statistics(statistics_timer, shards, std::chrono::seconds(config.stats_interval));
+        }
+
+        shards.run();
     }
     catch (std::exception& e) {
-		std::cerr << "Unhandled exception: " << e.what() << std::endl;
+		log_error(std::string("Unhandled exception: ") + e.what());
 	}
+
+	Logger::stop();
 }
@@ -0,0 +1,220 @@
+#include "metrics.h"
+
+#include <string>
+#include <sstream>
+#include <functional>
+
+#include "logger.h"
+
+#if !defined(_WIN32)
+#include <sys/resource.h>
+#endif
+
+static void write_header(std::ostringstream& out, const std::string& name, const std::string& type, const std::string& help) {
+	out << "# HELP " << name << " " << help << "\n";
+	out << "# TYPE " << name << " " << type << "\n";
+}
+
+template <typename Value>
+static void write_total(std::ostringstream& out, ShardPool& shards, const std::string& name, const std::string& type, const std::string& help, Value value) {
+	std::int64_t total = 0;
+	for (std::size_t i = 0; i < shards.size(); ++i) {
+		total += static_cast<std::int64_t>(value(shards.at(i).stats));
+	}
+
+	write_header(out, name, type, help);
+	out << name << " " << total << "\n";
+}
+
+std::string format_metrics(ShardPool& shards) {
+	std::ostringstream out;
+
+	write_total(out, shards, "arcdps_timer_sessions", "gauge", "Connected sessions.",
+		[](const ShardStats& stats) { return stats.sessions.get(); });
+	write_total(out, shards, "arcdps_timer_groups", "gauge", "Groups held in memory.",
+		[](const ShardStats& stats) { return stats.groups.get(); });
+	write_total(out, shards, "arcdps_timer_queued_messages", "gauge", "Messages waiting in session outbound queues.",
+		[](const ShardStats& stats) { return stats.queued_messages.get(); });
+	write_total(out, shards, "arcdps_timer_queued_bytes", "gauge", "Bytes waiting in session outbound queues.",
+		[](const ShardStats& stats) { return stats.queued_bytes.get(); });
+	write_total(out, shards, "arcdps_timer_received_bytes_total", "counter", "Bytes read from sessions.",
+		[](const ShardStats& stats) { return stats.bytes_received.get(); });
+	write_total(out, shards, "arcdps_timer_sent_bytes_total", "counter", "Bytes written to sessions.",
+		[](const ShardStats& stats) { return stats.bytes_sent.get(); });
+	write_total(out, shards, "arcdps_timer_sent_datagrams_total", "counter", "Event datagrams and hello acks sent.",
+		[](const ShardStats& stats) { return stats.datagrams_sent.get(); });
+	write_total(out, shards, "arcdps_timer_received_datagrams_total", "counter", "Datagrams received.",
+		[](const ShardStats& stats) { return stats.datagrams_received.get(); });
+	write_total(out, shards, "arcdps_timer_dropped_datagrams_total", "counter", "Datagrams that could not be sent right away.",
+		[](const ShardStats& stats) { return stats.datagrams_dropped.get(); });
+	write_total(out, shards, "arcdps_timer_relay_sent_total", "counter", "Datagrams sent to other server processes.",
+		[](const ShardStats& stats) { return stats.relay_sent.get(); });
+	write_total(out, shards, "arcdps_timer_relay_received_total", "counter", "Datagrams received from other server processes.",
+		[](const ShardStats& stats) { return stats.relay_received.get(); });
+	write_total(out, shards, "arcdps_timer_relay_dropped_total", "counter", "Datagrams to other server processes that could not be sent right away.",
+		[](const ShardStats& stats) { return stats.relay_dropped.get(); });
+	write_total(out, shards, "arcdps_timer_cluster_sent_total", "counter", "Messages sent to other cluster nodes.",
+		[](const ShardStats& stats) { return stats.cluster_sent.get(); });
+	write_total(out, shards, "arcdps_timer_cluster_received_total", "counter", "Messages received from other cluster nodes.",
+		[](const ShardStats& stats) { return stats.cluster_received.get(); });
+	write_total(out, shards, "arcdps_timer_cluster_dropped_total", "counter", "Messages to other cluster nodes dropped because their backlog was full.",
+		[](const ShardStats& stats) { return stats.cluster_dropped.get(); });
+	write_total(out, shards, "arcdps_timer_sent_messages_total", "counter", "Messages written to sessions.",
+		[](const ShardStats& stats) { return stats.messages_sent.get(); });
+	write_total(out, shards, "arcdps_timer_writes_total", "counter", "Gathered socket writes.",
+		[](const ShardStats& stats) { return stats.writes.get(); });
+	write_total(out, shards, "arcdps_timer_write_calls_total", "counter", "Write syscalls issued for gathered writes.",
+		[](const ShardStats& stats) { return stats.write_calls.get(); });
+	write_total(out, shards, "arcdps_timer_slow_consumer_disconnects_total", "counter", "Sessions closed for exceeding their queue limits.",
+		[](const ShardStats& stats) { return stats.slow_consumer_disconnects.get(); });
+	write_total(out, shards, "arcdps_timer_dropped_messages_total", "counter", "Messages dropped from full queues.",
+		[](const ShardStats& stats) { return stats.messages_dropped.get(); });
+	write_total(out, shards, "arcdps_timer_conflated_messages_total", "counter", "Messages discarded as duplicates of a queued event.",
+		[](const ShardStats& stats) { return stats.messages_conflated.get(); });
+	write_total(out, shards, "arcdps_timer_deduplicated_messages_total", "counter", "Events not relayed because their uuid was seen recently in the group.",
+		[](const ShardStats& stats) { return stats.messages_deduplicated.get(); });
+	write_total(out, shards, "arcdps_timer_session_rate_limited_total", "counter", "Events over their session's rate limit, rejected or conflated.",
+		[](const ShardStats& stats) { return stats.session_rate_limited.get(); });
+	write_total(out, shards, "arcdps_timer_group_rate_limited_total", "counter", "Events over their group's rate limit, rejected or conflated.",
+		[](const ShardStats& stats) { return stats.group_rate_limited.get(); });
+	write_total(out, shards, "arcdps_timer_rate_limit_conflated_total", "counter", "Held back events replaced by a later one of the same session or group.",
+		[](const ShardStats& stats) { return stats.rate_limit_conflated.get(); });
+	write_total(out, shards, "arcdps_timer_idle_timeouts_total", "counter", "Sessions closed for being idle.",
+		[](const ShardStats& stats) { return stats.idle_timeouts.get(); });
+	write_total(out, shards, "arcdps_timer_swept_groups_total", "counter", "Empty groups removed by the sweep.",
+		[](const ShardStats& stats) { return stats.groups_swept.get(); });
+	write_total(out, shards, "arcdps_timer_snapshots_written_total", "counter", "Snapshots of group state written, each one clears a write-ahead log.",
+		[](const ShardStats& stats) { return stats.snapshots_written.get(); });
+	write_total(out, shards, "arcdps_timer_allocations_total", "counter", "Heap allocations made on the shards, 0 unless built to count them.",
+		[](const ShardStats& stats) { return stats.allocations.get(); });
+
+	write_header(out, "arcdps_timer_commands_total", "counter", "Commands received by type.");
+	for (std::size_t command = 0; command < command_names.size(); ++command) {
+		std::uint64_t total = 0;
+		for (std::size_t i = 0; i < shards.size(); ++i) {
+			total += shards.at(i).stats.commands[command].get();
+		}
+		out << "arcdps_timer_commands_total{command=\"" << command_names[command] << "\"} " << total << "\n";
+	}
+
+	write_header(out, "arcdps_timer_groups_by_size", "gauge", "Groups by member count, bucketed by power of two.");
+	for (std::size_t bucket = 0; bucket < group_size_buckets; ++bucket) {
+		std::int64_t total = 0;
+		for (std::size_t i = 0; i < shards.size(); ++i) {
+			total += shards.at(i).stats.group_sizes[bucket].get();
+		}
+		out << "arcdps_timer_groups_by_size{min=\"" << (std::uint64_t(1) << bucket) << "\"} " << total << "\n";
+	}
+
+	write_header(out, "arcdps_timer_fanout_latency_seconds", "histogram", "Time from receiving an event to the last receiver's write completing.");
+	std::uint64_t cumulative = 0;
+	std::uint64_t count = 0;
+	std::uint64_t sum = 0;
+	for (std::size_t i = 0; i < shards.size(); ++i) {
+		count += shards.at(i).stats.fanout_latency.get_count();
+		sum += shards.at(i).stats.fanout_latency.get_sum();
+	}
+	for (std::size_t bucket = 0; bucket < Histogram::bucket_count; ++bucket) {
+		for (std::size_t i = 0; i < shards.size(); ++i) {
+			cumulative += shards.at(i).stats.fanout_latency.get_bucket(bucket);
+		}
+		out << "arcdps_timer_fanout_latency_seconds_bucket{le=\"" << Histogram::upper_bound(bucket) / 1e6 << "\"} " << cumulative << "\n";
+	}
+	out << "arcdps_timer_fanout_latency_seconds_bucket{le=\"+Inf\"} " << std::max(cumulative, count) << "\n";
+	out << "arcdps_timer_fanout_latency_seconds_sum " << sum / 1e6 << "\n";
+	out << "arcdps_timer_fanout_latency_seconds_count " << count << "\n";
+
+#if !defined(_WIN32)
+	// what a replay costs the server, read as a difference between two scrapes
+	rusage usage{};
+	if (getrusage(RUSAGE_SELF, &usage) == 0) {
+		const double seconds = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+		write_header(out, "process_cpu_seconds_total", "counter", "User and system CPU time spent by the server.");
+		out << "process_cpu_seconds_total " << std::to_string(seconds) << "\n";
+	}
+#endif
+
+	return out.str();
+}
+
+MetricsServer::MetricsServer(ShardPool& shards, boost::asio::io_context& io_context, boost::asio::ip::tcp::endpoint endpoint,
+	std::optional<boost::asio::ip::tcp::acceptor::native_handle_type> inherited)
+:	shards(shards),
+	acceptor(io_context) {
+	if (inherited) {
+		acceptor.assign(endpoint.protocol(), *inherited);
+	}
+	else {
+		acceptor.open(endpoint.protocol());
+		acceptor.set_option(boost::asio::socket_base::reuse_address(true));
+		acceptor.bind(endpoint);
+		acceptor.listen();
+	}
+	log_info("Metrics available on port " + std::to_string(endpoint.port()));
+	accept_connection();
+}
+
+boost::asio::ip::tcp::acceptor::native_handle_type MetricsServer::native_handle() {
+	return acceptor.native_handle();
+}
+
+void MetricsServer::stop_accepting() {
+	accepting = false;
+	boost::system::error_code ec;
+	acceptor.cancel(ec);
+}
+
+void MetricsServer::accept_connection() {
+	if (!accepting) {
+		return;
+	}
+
+	acceptor.async_accept(
+		[this](boost::system::error_code ec, boost::asio::ip::tcp::socket socket) {
+			if (!ec) {
+				handle_request(std::make_shared<boost::asio::ip::tcp::socket>(std::move(socket)));
+			}
+
+			accept_connection();
+		}
+	);
+}
+
+void MetricsServer::handle_request(std::shared_ptr<boost::asio::ip::tcp::socket> socket) {
+	auto request = std::make_shared<boost::asio::streambuf>(8192);
+	boost::asio::async_read_until(*socket, *request, "\r\n\r\n",
+		[this, socket, request](boost::system::error_code ec, std::size_t) {
+			if (ec) {
+				return;
+			}
+
+			std::istream request_stream(request.get());
+			std::string method, path;
+			request_stream >> method >> path;
+
+			std::string body;
+			std::string status;
+			if (method == "GET" && (path == "/metrics" || path == "/")) {
+				status = "200 OK";
+				body = format_metrics(shards);
+			}
+			else {
+				status = "404 Not Found";
+				body = "Not Found\n";
+			}
+
+			auto response = std::make_shared<std::string>(
+				"HTTP/1.1 " + status + "\r\n"
+				"Content-Type: text/plain; version=0.0.4\r\n"
+				"Content-Length: " + std::to_string(body.size()) + "\r\n"
+				"Connection: close\r\n\r\n" + body);
+
+			boost::asio::async_write(*socket, boost::asio::buffer(*response),
+				[socket, response](boost::system::error_code, std::size_t) {
+					boost::system::error_code ignored;
+					socket->shutdown(boost::asio::ip::tcp::socket::shutdown_both, ignored);
+				}
+			);
+		}
+	);
+}
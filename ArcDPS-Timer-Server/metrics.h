@@ -0,0 +1,29 @@
+#pragma once
+
+#include <memory>
+#include <optional>
+#include <string>
+#include <boost/asio.hpp>
+
+#include "shard.h"
+
+// Minimal HTTP listener serving the shard statistics in the Prometheus text format.
+// It only reads the lock-free per-shard counters, the shards themselves are never blocked.
+class MetricsServer {
+public:
+	// inherited is a listening socket handed over by the previous process, used instead of binding
+	MetricsServer(ShardPool& shards, boost::asio::io_context& io_context, boost::asio::ip::tcp::endpoint endpoint,
+		std::optional<boost::asio::ip::tcp::acceptor::native_handle_type> inherited = std::nullopt);
+
+	boost::asio::ip::tcp::acceptor::native_handle_type native_handle();
+	void stop_accepting();
+private:
+	ShardPool& shards;
+	boost::asio::ip::tcp::acceptor acceptor;
+	bool accepting = true;
+
+	void accept_connection();
+	void handle_request(std::shared_ptr<boost::asio::ip::tcp::socket> socket);
+};
+
+std::string format_metrics(ShardPool& shards);
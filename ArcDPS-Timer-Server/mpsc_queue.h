@@ -0,0 +1,64 @@
+#pragma once
+
+#include <atomic>
+#include <optional>
+#include <utility>
+
+// Intrusive multi-producer single-consumer queue (Vyukov). push() is wait-free
+// and may be called from any thread, pop() only from the consuming thread.
+template <typename T>
+class MPSCQueue {
+public:
+	MPSCQueue()
+	:	head(&stub),
+		tail(&stub) {
+	}
+
+	~MPSCQueue() {
+		while (pop()) {
+		}
+		if (tail != &stub) {
+			delete tail;
+		}
+	}
+
+	MPSCQueue(const MPSCQueue&) = delete;
+	MPSCQueue& operator=(const MPSCQueue&) = delete;
+
+	void push(T value) {
+		Node* node = new Node(std::move(value));
+		Node* previous = head.exchange(node, std::memory_order_acq_rel);
+		previous->next.store(node, std::memory_order_release);
+	}
+
+	std::optional<T> pop() {
+		Node* current = tail;
+		Node* next = current->next.load(std::memory_order_acquire);
+		if (next == nullptr) {
+			return std::nullopt;
+		}
+
+		tail = next;
+		std::optional<T> value = std::move(next->value);
+		next->value.reset();
+		if (current != &stub) {
+			delete current;
+		}
+		return value;
+	}
+
+private:
+	struct Node {
+		Node() = default;
+		explicit Node(T value)
+		:	value(std::move(value)) {
+		}
+
+		std::atomic<Node*> next = nullptr;
+		std::optional<T> value;
+	};
+
+	std::atomic<Node*> head;
+	Node* tail;
+	Node stub;
+};
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cmath>
+#include <limits>
+#include <string>
+#include <stdexcept>
+
+// Values of numeric command line options for the server and its tools. Anything malformed or out
+// of range throws std::invalid_argument naming the option.
+
+// Whole numbers that fit into T, without sign, fraction or exponent.
+template <typename T>
+T parse_number(const std::string& name, const std::string& value) {
+	try {
+		std::size_t length = 0;
+		const unsigned long long number = std::stoull(value, &length);
+		// stoull negates a leading minus instead of rejecting it
+		if (length != value.size() || value.starts_with('-') || number > std::numeric_limits<T>::max()) {
+			throw std::invalid_argument(value);
+		}
+		return static_cast<T>(number);
+	}
+	catch (const std::logic_error&) {
+		throw std::invalid_argument("Invalid value for " + name + ": " + value);
+	}
+}
+
+// Finite numbers of at least zero, such as rates and factors.
+inline double parse_real(const std::string& name, const std::string& value) {
+	try {
+		std::size_t length = 0;
+		const double number = std::stod(value, &length);
+		if (length != value.size() || !std::isfinite(number) || number < 0) {
+			throw std::invalid_argument(value);
+		}
+		return number;
+	}
+	catch (const std::logic_error&) {
+		throw std::invalid_argument("Invalid value for " + name + ": " + value);
+	}
+}
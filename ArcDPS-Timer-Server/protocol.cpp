@@ -0,0 +1,611 @@
+#include "protocol.h"
+
+#include <chrono>
+#include <cstdio>
+
+using json = nlohmann::json;
+
+static void write_le(std::string& out, std::uint64_t value, std::size_t bytes) {
+	for (std::size_t i = 0; i < bytes; ++i) {
+		out.push_back(static_cast<char>((value >> (8 * i)) & 0xFF));
+	}
+}
+
+static std::uint64_t read_le(std::string_view in, std::size_t offset, std::size_t bytes) {
+	std::uint64_t value = 0;
+	for (std::size_t i = 0; i < bytes; ++i) {
+		value |= static_cast<std::uint64_t>(static_cast<std::uint8_t>(in[offset + i])) << (8 * i);
+	}
+	return value;
+}
+
+template <std::size_t N>
+static std::optional<std::uint8_t> find_name(const std::array<std::string_view, N>& names, std::string_view name) {
+	for (std::size_t i = 0; i < N; ++i) {
+		if (names[i] == name) {
+			return static_cast<std::uint8_t>(i);
+		}
+	}
+	return std::nullopt;
+}
+
+static std::optional<std::array<std::uint8_t, 16>> parse_uuid(std::string_view text) {
+	if (text.size() != 36) {
+		return std::nullopt;
+	}
+
+	std::array<std::uint8_t, 16> uuid{};
+	std::size_t nibble = 0;
+	for (std::size_t i = 0; i < text.size(); ++i) {
+		if (i == 8 || i == 13 || i == 18 || i == 23) {
+			if (text[i] != '-') {
+				return std::nullopt;
+			}
+			continue;
+		}
+
+		const char c = text[i];
+		std::uint8_t value;
+		if (c >= '0' && c <= '9') value = c - '0';
+		else if (c >= 'a' && c <= 'f') value = c - 'a' + 10;
+		else if (c >= 'A' && c <= 'F') value = c - 'A' + 10;
+		else return std::nullopt;
+
+		uuid[nibble / 2] |= (nibble % 2 == 0) ? value << 4 : value;
+		++nibble;
+	}
+	return uuid;
+}
+
+static std::string format_uuid(const std::array<std::uint8_t, 16>& uuid) {
+	static constexpr char digits[] = "0123456789abcdef";
+	std::string text;
+	text.reserve(36);
+	for (std::size_t i = 0; i < uuid.size(); ++i) {
+		if (i == 4 || i == 6 || i == 8 || i == 10) {
+			text.push_back('-');
+		}
+		text.push_back(digits[uuid[i] >> 4]);
+		text.push_back(digits[uuid[i] & 0xF]);
+	}
+	return text;
+}
+
+// "YYYY-MM-DDTHH:MM:SS[.mmm]" as sent by the client, UTC
+static std::optional<std::int64_t> parse_time(const std::string& text) {
+	int year, month, day, hour, minute, second, millisecond = 0;
+	const int fields = std::sscanf(text.c_str(), "%4d-%2d-%2dT%2d:%2d:%2d.%3d", &year, &month, &day, &hour, &minute, &second, &millisecond);
+	if (fields < 6) {
+		return std::nullopt;
+	}
+
+	const std::chrono::year_month_day date{std::chrono::year(year), std::chrono::month(month), std::chrono::day(day)};
+	if (!date.ok()) {
+		return std::nullopt;
+	}
+
+	const auto time = std::chrono::sys_days(date) + std::chrono::hours(hour) + std::chrono::minutes(minute)
+		+ std::chrono::seconds(second) + std::chrono::milliseconds(millisecond);
+	return std::chrono::duration_cast<std::chrono::milliseconds>(time.time_since_epoch()).count();
+}
+
+static std::string format_time(std::int64_t time) {
+	const std::chrono::sys_time<std::chrono::milliseconds> point{std::chrono::milliseconds(time)};
+	const auto days = std::chrono::floor<std::chrono::days>(point);
+	const std::chrono::year_month_day date{days};
+	const std::chrono::hh_mm_ss clock{point - days};
+
+	char text[32];
+	std::snprintf(text, sizeof(text), "%04d-%02u-%02uT%02d:%02d:%02d.%03d",
+		static_cast<int>(date.year()), static_cast<unsigned>(date.month()), static_cast<unsigned>(date.day()),
+		static_cast<int>(clock.hours().count()), static_cast<int>(clock.minutes().count()),
+		static_cast<int>(clock.seconds().count()), static_cast<int>(clock.subseconds().count()));
+	return text;
+}
+
+// Perfect hash of the command names: the first letter modulo seven puts each name in a slot of
+// its own, so a single comparison settles any name. The spare slot points at a name that fails it.
+static constexpr std::size_t command_slot_count = 7;
+
+static constexpr std::size_t command_slot(std::string_view name) {
+	return static_cast<std::uint8_t>(name[0]) % command_slot_count;
+}
+
+static constexpr std::array<std::uint8_t, command_slot_count> command_slots = [] {
+	std::array<std::uint8_t, command_slot_count> slots{};
+	for (std::size_t i = 0; i < command_names.size(); ++i) {
+		slots[command_slot(command_names[i])] = static_cast<std::uint8_t>(i);
+	}
+	return slots;
+}();
+
+static_assert([] {
+	for (std::size_t i = 0; i < command_names.size(); ++i) {
+		if (command_slots[command_slot(command_names[i])] != i) {
+			return false;
+		}
+	}
+	return true;
+}(), "command names must hash to distinct slots");
+
+std::optional<Command> find_command(std::string_view name) {
+	if (name.empty()) {
+		return std::nullopt;
+	}
+
+	const std::uint8_t index = command_slots[command_slot(name)];
+	if (command_names[index] != name) {
+		return std::nullopt;
+	}
+	return static_cast<Command>(index);
+}
+
+// Cursor over a JSON text for scan_command and scan_event. Whatever it accepts is valid JSON, it
+// gives up on what it cannot read as is: escapes in keys and read strings, \u escapes and
+// non-ASCII bytes anywhere, which would need decoding or UTF-8 validation.
+class JsonScanner {
+public:
+	explicit JsonScanner(std::string_view text)
+	:	text(text) {
+	}
+
+	std::size_t mark() {
+		skip_whitespace();
+		return position;
+	}
+
+	bool consume(char c) {
+		skip_whitespace();
+		if (position < text.size() && text[position] == c) {
+			++position;
+			return true;
+		}
+		return false;
+	}
+
+	bool at_end() {
+		return mark() == text.size();
+	}
+
+	std::optional<std::string_view> plain_string() {
+		if (!consume('"')) {
+			return std::nullopt;
+		}
+
+		const std::size_t start = position;
+		for (; position < text.size(); ++position) {
+			const auto c = static_cast<std::uint8_t>(text[position]);
+			if (c == '"') {
+				return text.substr(start, position++ - start);
+			}
+			if (c == '\\' || c < 0x20 || c >= 0x80) {
+				return std::nullopt;
+			}
+		}
+		return std::nullopt;
+	}
+
+	std::optional<bool> boolean() {
+		if (literal("true")) {
+			return true;
+		}
+		if (literal("false")) {
+			return false;
+		}
+		return std::nullopt;
+	}
+
+	// on_field gets each key and reads its value
+	template <typename OnField>
+	bool object(OnField on_field) {
+		if (!consume('{')) {
+			return false;
+		}
+		if (consume('}')) {
+			return true;
+		}
+		do {
+			auto key = plain_string();
+			if (!key || !consume(':') || !on_field(*key)) {
+				return false;
+			}
+		} while (consume(','));
+		return consume('}');
+	}
+
+	bool skip_value(std::size_t depth = 0) {
+		if (depth > max_depth || mark() == text.size()) {
+			return false;
+		}
+
+		switch (text[position]) {
+		case '"':
+			return skip_string();
+		case '{':
+			return object([&](std::string_view) {
+				return skip_value(depth + 1);
+			});
+		case '[':
+			++position;
+			if (consume(']')) {
+				return true;
+			}
+			do {
+				if (!skip_value(depth + 1)) {
+					return false;
+				}
+			} while (consume(','));
+			return consume(']');
+		case 't':
+			return literal("true");
+		case 'f':
+			return literal("false");
+		case 'n':
+			return literal("null");
+		default:
+			return skip_number();
+		}
+	}
+private:
+	static constexpr std::size_t max_depth = 32;
+
+	std::string_view text;
+	std::size_t position = 0;
+
+	void skip_whitespace() {
+		while (position < text.size() && (text[position] == ' ' || text[position] == '\t' || text[position] == '\n' || text[position] == '\r')) {
+			++position;
+		}
+	}
+
+	bool literal(std::string_view word) {
+		skip_whitespace();
+		if (text.substr(position, word.size()) != word) {
+			return false;
+		}
+		position += word.size();
+		return true;
+	}
+
+	bool skip_string() {
+		++position;
+		for (; position < text.size(); ++position) {
+			const auto c = static_cast<std::uint8_t>(text[position]);
+			if (c == '"') {
+				++position;
+				return true;
+			}
+			if (c < 0x20 || c >= 0x80) {
+				return false;
+			}
+			if (c == '\\') {
+				if (++position == text.size() || std::string_view(R"("\/bfnrt)").find(text[position]) == std::string_view::npos) {
+					return false;
+				}
+			}
+		}
+		return false;
+	}
+
+	bool skip_digits() {
+		const std::size_t start = position;
+		while (position < text.size() && text[position] >= '0' && text[position] <= '9') {
+			++position;
+		}
+		return position > start;
+	}
+
+	// -?(0|[1-9][0-9]*)(.[0-9]+)?([eE][+-]?[0-9]+)?
+	bool skip_number() {
+		if (text[position] == '-') {
+			++position;
+		}
+		if (position < text.size() && text[position] == '0') {
+			++position;
+		}
+		else if (!skip_digits()) {
+			return false;
+		}
+		if (position < text.size() && text[position] == '.') {
+			++position;
+			if (!skip_digits()) {
+				return false;
+			}
+		}
+		if (position < text.size() && (text[position] == 'e' || text[position] == 'E')) {
+			++position;
+			if (position < text.size() && (text[position] == '+' || text[position] == '-')) {
+				++position;
+			}
+			if (!skip_digits()) {
+				return false;
+			}
+		}
+		return true;
+	}
+};
+
+static std::optional<EventFields> scan_event_object(JsonScanner& scanner, std::string_view text) {
+	const std::size_t start = scanner.mark();
+	std::optional<std::string_view> source, type, uuid, time;
+	auto read = [&](std::optional<std::string_view>& field) {
+		field = scanner.plain_string();
+		return field.has_value();
+	};
+
+	const bool scanned = scanner.object([&](std::string_view key) {
+		if (key == "source") {
+			return read(source);
+		}
+		if (key == "type") {
+			return read(type);
+		}
+		if (key == "uuid") {
+			return read(uuid);
+		}
+		if (key == "time") {
+			return read(time);
+		}
+		return scanner.skip_value();
+	});
+	if (!scanned || !source || !type || !uuid || !time) {
+		return std::nullopt;
+	}
+
+	return EventFields{
+		.text = text.substr(start, scanner.mark() - start),
+		.source = *source,
+		.type = *type,
+		.uuid = *uuid,
+		.time = *time
+	};
+}
+
+std::optional<CommandFields> scan_command(std::string_view line) {
+	JsonScanner scanner(line);
+	CommandFields fields;
+	auto read = [&](std::optional<std::string_view>& field) {
+		field = scanner.plain_string();
+		return field.has_value();
+	};
+	auto read_boolean = [&](std::optional<bool>& field) {
+		field = scanner.boolean();
+		return field.has_value();
+	};
+
+	const bool scanned = scanner.object([&](std::string_view key) {
+		if (key == "command") {
+			return read(fields.command);
+		}
+		if (key == "group") {
+			return read(fields.group);
+		}
+		if (key == "protocol") {
+			return read(fields.protocol);
+		}
+		if (key == "heartbeat") {
+			return read_boolean(fields.heartbeat);
+		}
+		if (key == "echo") {
+			return read_boolean(fields.echo);
+		}
+		if (key == "data") {
+			fields.data = scan_event_object(scanner, line);
+			return fields.data.has_value();
+		}
+		return scanner.skip_value();
+	});
+	if (!scanned || !scanner.at_end()) {
+		return std::nullopt;
+	}
+	return fields;
+}
+
+std::optional<EventFields> scan_event(std::string_view data) {
+	JsonScanner scanner(data);
+	auto fields = scan_event_object(scanner, data);
+	if (!fields || !scanner.at_end()) {
+		return std::nullopt;
+	}
+	return fields;
+}
+
+std::string encode_frame(FrameKind kind, std::string_view body) {
+	std::string frame;
+	frame.reserve(frame_header_size + body.size());
+	write_le(frame, body.size() + 1, 2);
+	frame.push_back(static_cast<char>(kind));
+	frame.append(body);
+	return frame;
+}
+
+std::string encode_event(const Event& event) {
+	std::string body;
+	body.reserve(event_body_size);
+	body.append(reinterpret_cast<const char*>(event.uuid.data()), event.uuid.size());
+	write_le(body, static_cast<std::uint64_t>(event.time), 8);
+	body.push_back(static_cast<char>(event.type));
+	body.push_back(static_cast<char>(event.source));
+	return body;
+}
+
+std::optional<Event> decode_event(std::string_view body) {
+	if (body.size() != event_body_size) {
+		return std::nullopt;
+	}
+
+	Event event;
+	for (std::size_t i = 0; i < event.uuid.size(); ++i) {
+		event.uuid[i] = static_cast<std::uint8_t>(body[i]);
+	}
+	event.time = static_cast<std::int64_t>(read_le(body, 16, 8));
+	event.type = static_cast<std::uint8_t>(body[24]);
+	event.source = static_cast<std::uint8_t>(body[25]);
+
+	if (event.type >= event_types.size() || event.source >= event_sources.size()) {
+		return std::nullopt;
+	}
+	return event;
+}
+
+std::optional<Event> event_from_json(const json& data) {
+	if (!data.is_object() || !data.contains("uuid") || !data.contains("time") || !data.contains("type") || !data.contains("source")) {
+		return std::nullopt;
+	}
+
+	const json& uuid = data["uuid"];
+	const json& time = data["time"];
+	const json& type = data["type"];
+	const json& source = data["source"];
+	if (!uuid.is_string() || !time.is_string() || !type.is_string() || !source.is_string()) {
+		return std::nullopt;
+	}
+
+	return event_from_fields(EventFields{
+		.text = {},
+		.source = source.get_ref<const std::string&>(),
+		.type = type.get_ref<const std::string&>(),
+		.uuid = uuid.get_ref<const std::string&>(),
+		.time = time.get_ref<const std::string&>()
+	});
+}
+
+std::optional<Event> event_from_fields(const EventFields& data) {
+	auto parsed_uuid = parse_uuid(data.uuid);
+	auto parsed_time = parse_time(std::string(data.time));
+	auto parsed_type = find_name(event_types, data.type);
+	auto parsed_source = find_name(event_sources, data.source);
+	if (!parsed_uuid || !parsed_time || !parsed_type || !parsed_source) {
+		return std::nullopt;
+	}
+
+	return Event{
+		.uuid = *parsed_uuid,
+		.time = *parsed_time,
+		.type = *parsed_type,
+		.source = *parsed_source
+	};
+}
+
+json event_to_json(const Event& event) {
+	return {
+		{"source", event_sources[event.source]},
+		{"type", event_types[event.type]},
+		{"uuid", format_uuid(event.uuid)},
+		{"time", format_time(event.time)}
+	};
+}
+
+EventMessage EventMessage::from_json(const json& data) {
+	EventMessage message;
+	message.json_data = data.dump();
+	message.type = find_name(event_types, data["type"].get_ref<const std::string&>()).value_or(0);
+
+	// same key for the same event no matter which encoding it arrives in
+	const std::string& uuid = data["uuid"].get_ref<const std::string&>();
+	auto parsed_uuid = parse_uuid(uuid);
+	message.key = parsed_uuid ? std::string(parsed_uuid->begin(), parsed_uuid->end()) : uuid;
+	return message;
+}
+
+EventMessage EventMessage::from_json(const EventFields& data) {
+	EventMessage message;
+	// line breaks can only be whitespace between tokens, but relayed verbatim they would end the
+	// state line early and let the rest read as lines of its own
+	if (data.text.find_first_of("\r\n") == std::string_view::npos) {
+		message.json_data = std::string(data.text);
+	}
+	else {
+		message.json_data = json::parse(data.text).dump();
+	}
+	message.type = find_name(event_types, data.type).value_or(0);
+
+	auto parsed_uuid = parse_uuid(data.uuid);
+	message.key = parsed_uuid ? std::string(parsed_uuid->begin(), parsed_uuid->end()) : std::string(data.uuid);
+	return message;
+}
+
+std::optional<EventMessage> EventMessage::from_binary(std::string_view body) {
+	auto event = decode_event(body);
+	if (!event) {
+		return std::nullopt;
+	}
+
+	EventMessage message;
+	message.binary_body = std::string(body);
+	message.type = event->type;
+	message.key = std::string(event->uuid.begin(), event->uuid.end());
+	return message;
+}
+
+std::string EventMessage::pack() const {
+	std::string packed;
+	if (binary_body) {
+		packed.push_back(static_cast<char>(Encoding::binary));
+		packed.append(*binary_body);
+	}
+	else {
+		packed.push_back(static_cast<char>(Encoding::json));
+		packed.append(*json_data);
+	}
+	return packed;
+}
+
+std::optional<EventMessage> EventMessage::unpack(std::string_view packed) {
+	if (packed.empty()) {
+		return std::nullopt;
+	}
+
+	const std::string_view data = packed.substr(1);
+	if (static_cast<Encoding>(packed[0]) == Encoding::binary) {
+		return from_binary(data);
+	}
+
+	if (auto fields = scan_event(data)) {
+		return from_json(*fields);
+	}
+	json parsed = json::parse(data, nullptr, false);
+	if (!parsed.is_object() || !parsed.contains("type") || !parsed["type"].is_string() || !parsed.contains("uuid") || !parsed["uuid"].is_string()) {
+		return std::nullopt;
+	}
+	return from_json(parsed);
+}
+
+std::uint8_t EventMessage::get_type() const {
+	return type;
+}
+
+const std::string& EventMessage::get_key() const {
+	return key;
+}
+
+Payload EventMessage::framed(Encoding encoding) {
+	if (encoding == Encoding::json) {
+		if (!json_frame) {
+			if (!json_data) {
+				json_data = event_to_json(*decode_event(*binary_body)).dump();
+			}
+			constexpr std::string_view prefix = R"({"status":"state","data":)";
+			std::string line;
+			line.reserve(prefix.size() + json_data->size() + 2);
+			line.append(prefix).append(*json_data).append("}\n");
+			json_frame = std::make_shared<const Frame>(std::move(line), key);
+		}
+		return json_frame;
+	}
+
+	if (!binary_frame && !binary_unavailable) {
+		if (!binary_body) {
+			auto fields = scan_event(*json_data);
+			auto event = fields ? event_from_fields(*fields) : event_from_json(json::parse(*json_data));
+			if (!event) {
+				// not representable in binary (e.g. a free-form uuid), skip binary receivers
+				binary_unavailable = true;
+				return nullptr;
+			}
+			binary_body = encode_event(*event);
+		}
+		binary_frame = std::make_shared<const Frame>(encode_frame(FrameKind::event, *binary_body), key);
+	}
+	return binary_frame;
+}
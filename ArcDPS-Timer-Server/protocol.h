@@ -0,0 +1,130 @@
+#pragma once
+
+#include <array>
+#include <memory>
+#include <string>
+#include <cstdint>
+#include <optional>
+#include <string_view>
+#include <nlohmann/json.hpp>
+
+// Framed, immutable message shared between all outbound queues it is sent to.
+struct Frame {
+	std::string data;
+	std::string key; // uuid of the event it carries, empty for responses
+};
+
+using Payload = std::shared_ptr<const Frame>;
+
+// Wire encoding of a connection, negotiated through the version command.
+// json: newline delimited JSON lines
+// binary: frames of uint16 little endian length (of kind and body), uint8 kind, body
+enum class Encoding : std::uint8_t {
+	json,
+	binary
+};
+
+enum class FrameKind : std::uint8_t {
+	command = 0, // body is a JSON command or response
+	event = 1    // body is an encoded Event
+};
+
+constexpr std::size_t frame_header_size = 3;
+constexpr std::size_t max_frame_body_size = 0xFFFF - 1;
+
+// Timer event as sent by the client, tables below follow the client's EventType and EventSource order
+struct Event {
+	std::array<std::uint8_t, 16> uuid;
+	std::int64_t time; // milliseconds since epoch
+	std::uint8_t type;
+	std::uint8_t source;
+};
+
+constexpr std::size_t event_body_size = 16 + 8 + 1 + 1;
+
+constexpr std::array<std::string_view, 9> event_types = {
+	"start", "stop", "reset", "prepare", "segment", "segment_clear", "map_change", "history_clear", "none"
+};
+
+constexpr std::array<std::string_view, 4> event_sources = {
+	"manual", "combat", "movement", "other"
+};
+
+// Commands a client can send, in the order of command_names.
+enum class Command : std::uint8_t {
+	join,
+	version,
+	state,
+	pong,
+	udp,
+	time
+};
+
+constexpr std::array<std::string_view, 6> command_names = {
+	"join", "version", "state", "pong", "udp", "time"
+};
+
+std::optional<Command> find_command(std::string_view name);
+
+// longer group names are invalid in bytes, on top of the schema's maxLength in code points
+constexpr std::size_t max_group_name_size = 64;
+
+// Fields of an event's JSON data object, viewing into the text they were scanned from.
+struct EventFields {
+	std::string_view text; // the whole object as it arrived
+	std::string_view source;
+	std::string_view type;
+	std::string_view uuid;
+	std::string_view time;
+};
+
+// Top level fields of a JSON command line, viewing into the line.
+struct CommandFields {
+	std::optional<std::string_view> command;
+	std::optional<std::string_view> group;
+	std::optional<std::string_view> protocol;
+	std::optional<bool> heartbeat;
+	std::optional<bool> echo;
+	std::optional<EventFields> data;
+};
+
+// Single pass scanners that check the JSON syntax on the way but build nothing. They only take
+// the common shape of a command: the fields above with the expected types, ASCII strings
+// without escapes, so each view reads the same as the decoded string. Anything else returns
+// nullopt and is left to a full parser, which takes or rejects it.
+std::optional<CommandFields> scan_command(std::string_view line);
+std::optional<EventFields> scan_event(std::string_view data);
+
+std::string encode_frame(FrameKind kind, std::string_view body);
+std::string encode_event(const Event& event);
+std::optional<Event> decode_event(std::string_view body);
+std::optional<Event> event_from_json(const nlohmann::json& data);
+std::optional<Event> event_from_fields(const EventFields& data);
+nlohmann::json event_to_json(const Event& event);
+
+// A state event relayed to a group. It keeps the encoding it arrived in and
+// only transcodes if a receiver speaks the other one, each frame is built once.
+class EventMessage {
+public:
+	static EventMessage from_json(const nlohmann::json& data);
+	// keeps the data object's bytes as they are to be relayed verbatim, unless they span lines
+	static EventMessage from_json(const EventFields& data);
+	static std::optional<EventMessage> from_binary(std::string_view body);
+
+	// Self-contained form for passing events between server processes: uint8 encoding,
+	// then the binary body or the JSON data the event arrived with.
+	std::string pack() const;
+	static std::optional<EventMessage> unpack(std::string_view packed);
+
+	Payload framed(Encoding encoding);
+	std::uint8_t get_type() const;
+	const std::string& get_key() const;
+private:
+	std::uint8_t type = 0;
+	std::string key;
+	std::optional<std::string> json_data;
+	std::optional<std::string> binary_body;
+	Payload json_frame;
+	Payload binary_frame;
+	bool binary_unavailable = false;
+};
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <chrono>
+#include <algorithm>
+
+// Token bucket holding up to burst events, refilled with rate events per second. The time is
+// passed in, the shards use their timing wheel's clock so a check reads no clock at all.
+// A rate of 0 lets everything through.
+class TokenBucket {
+public:
+	using Clock = std::chrono::steady_clock;
+
+	TokenBucket(unsigned int rate, unsigned int burst)
+	:	rate(rate),
+		burst(std::max(1u, burst)),
+		tokens(this->burst) {
+	}
+
+	// Returns false if the bucket is empty, nothing is taken then.
+	bool take(Clock::time_point now) {
+		if (rate == 0) {
+			return true;
+		}
+
+		refill(now);
+		if (tokens < 1) {
+			return false;
+		}
+		tokens -= 1;
+		return true;
+	}
+
+	// time until take succeeds again
+	Clock::duration wait(Clock::time_point now) {
+		refill(now);
+		if (rate == 0 || tokens >= 1) {
+			return Clock::duration::zero();
+		}
+		return std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>((1 - tokens) / rate));
+	}
+private:
+	unsigned int rate;
+	unsigned int burst;
+	double tokens;
+	Clock::time_point refilled;
+
+	void refill(Clock::time_point now) {
+		if (now > refilled) {
+			tokens = std::min<double>(burst, tokens + std::chrono::duration<double>(now - refilled).count() * rate);
+			refilled = now;
+		}
+	}
+};
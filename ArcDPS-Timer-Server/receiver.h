@@ -1,7 +1,41 @@
 #pragma once
 
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "protocol.h"
+#include "stats.h"
+
 class Receiver {
 public:
 	virtual ~Receiver() = default;
-	virtual void send_message(std::string message) = 0;
-};
\ No newline at end of file
+	// datagram is the binary frame of the event for receivers with a bound datagram channel, otherwise null;
+	// delivery is null unless fan-out latency is being tracked
+	virtual void send_message(Payload message, Payload datagram, std::shared_ptr<Delivery> delivery) = 0;
+	virtual void send_batch(std::vector<Payload> messages) = 0;
+
+	// read by the group's shard to pick the frame to send
+	Encoding get_encoding() const {
+		return encoding.load(std::memory_order_relaxed);
+	}
+
+	bool wants_datagrams() const {
+		return datagrams.load(std::memory_order_relaxed);
+	}
+
+	// false if the receiver does not want its own events relayed back
+	bool wants_echo() const {
+		return echo.load(std::memory_order_relaxed);
+	}
+
+	// the shard the receiver lives on, a large group hands it its events through that shard
+	std::size_t get_shard_index() const {
+		return shard_index;
+	}
+protected:
+	std::size_t shard_index = 0;
+	std::atomic<Encoding> encoding = Encoding::json;
+	std::atomic<bool> datagrams = false;
+	std::atomic<bool> echo = true;
+};
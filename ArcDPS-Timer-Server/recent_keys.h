@@ -0,0 +1,156 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <functional>
+#include <string_view>
+
+// LRU set of recently seen event keys. Seeing a key again refreshes it, beyond
+// the capacity the least recently seen key is forgotten.
+// Keys live in slots linked from most to least recently seen, a forgotten key's slot and its
+// string's buffer take the next new key, so a full set inserts without allocating. Lookups
+// probe an open-addressing index of slot numbers (linear probing, removals shift the following
+// entries back instead of leaving tombstones).
+class RecentKeys {
+public:
+	explicit RecentKeys(std::size_t capacity)
+	:	capacity(capacity) {
+	}
+
+	RecentKeys(const RecentKeys&) = delete;
+	RecentKeys& operator=(const RecentKeys&) = delete;
+
+	// Returns whether the key is known, seeing it refreshes it.
+	bool contains(std::string_view key) {
+		if (index.empty()) {
+			return false;
+		}
+
+		const std::size_t position = find_position(key, hash_of(key));
+		if (index[position] == 0) {
+			return false;
+		}
+		const std::uint32_t slot = index[position] - 1;
+		unlink(slot);
+		link_newest(slot);
+		return true;
+	}
+
+	// Returns false if the key was already known.
+	bool insert(std::string_view key) {
+		if (capacity == 0) {
+			return true;
+		}
+		if (index.empty()) {
+			// at most half full keeps probe sequences short
+			std::size_t size = 8;
+			while (size < capacity * 2) {
+				size *= 2;
+			}
+			index.assign(size, 0);
+		}
+
+		const std::uint64_t hash = hash_of(key);
+		std::size_t position = find_position(key, hash);
+		if (index[position] != 0) {
+			const std::uint32_t slot = index[position] - 1;
+			unlink(slot);
+			link_newest(slot);
+			return false;
+		}
+
+		std::uint32_t slot;
+		if (slots.size() < capacity) {
+			slot = static_cast<std::uint32_t>(slots.size());
+			slots.emplace_back();
+		}
+		else {
+			slot = oldest;
+			unlink(slot);
+			remove(find_position(slots[slot].key, slots[slot].hash));
+			position = find_position(key, hash);
+		}
+
+		slots[slot].key.assign(key);
+		slots[slot].hash = hash;
+		index[position] = slot + 1;
+		link_newest(slot);
+		return true;
+	}
+
+private:
+	static constexpr std::uint32_t none = UINT32_MAX;
+
+	struct Slot {
+		std::string key;
+		std::uint64_t hash = 0;
+		std::uint32_t newer = none;
+		std::uint32_t older = none;
+	};
+
+	std::size_t capacity;
+	std::vector<Slot> slots;
+	std::uint32_t newest = none;
+	std::uint32_t oldest = none;
+	// slot number plus one, 0 is empty, the size is a power of two
+	std::vector<std::uint32_t> index;
+
+	static std::uint64_t hash_of(std::string_view key) {
+		return std::hash<std::string_view>{}(key);
+	}
+
+	// the position holding the key, or the empty position it would go to
+	std::size_t find_position(std::string_view key, std::uint64_t hash) const {
+		const std::size_t mask = index.size() - 1;
+		for (std::size_t position = hash & mask;; position = (position + 1) & mask) {
+			const std::uint32_t entry = index[position];
+			if (entry == 0 || (slots[entry - 1].hash == hash && slots[entry - 1].key == key)) {
+				return position;
+			}
+		}
+	}
+
+	void remove(std::size_t position) {
+		// entries after the hole move up if that keeps them at or after their home position
+		const std::size_t mask = index.size() - 1;
+		std::size_t hole = position;
+		for (std::size_t next = (hole + 1) & mask; index[next] != 0; next = (next + 1) & mask) {
+			const std::size_t home = slots[index[next] - 1].hash & mask;
+			if (((next - home) & mask) >= ((next - hole) & mask)) {
+				index[hole] = index[next];
+				hole = next;
+			}
+		}
+		index[hole] = 0;
+	}
+
+	void unlink(std::uint32_t slot) {
+		Slot& entry = slots[slot];
+		if (entry.newer != none) {
+			slots[entry.newer].older = entry.older;
+		}
+		else {
+			newest = entry.older;
+		}
+		if (entry.older != none) {
+			slots[entry.older].newer = entry.newer;
+		}
+		else {
+			oldest = entry.newer;
+		}
+		entry.newer = none;
+		entry.older = none;
+	}
+
+	void link_newest(std::uint32_t slot) {
+		slots[slot].older = newest;
+		if (newest != none) {
+			slots[newest].newer = slot;
+		}
+		newest = slot;
+		if (oldest == none) {
+			oldest = slot;
+		}
+	}
+};
@@ -0,0 +1,46 @@
+#include "recorder.h"
+
+#include <filesystem>
+
+#include "logger.h"
+
+Recorder::Recorder(ShardPool& shards, const Config& config)
+:	start(std::chrono::steady_clock::now()) {
+	std::filesystem::create_directories(config.capture_directory);
+	for (std::size_t i = 0; i < shards.size(); ++i) {
+		const auto path = std::filesystem::path(config.capture_directory) / ("capture-" + std::to_string(i));
+		files.push_back(std::make_unique<CaptureFile>(path.string()));
+
+		Shard& shard = shards.at(i);
+		shard.dispatch([this, &shard]() {
+			schedule_flush(shard);
+		});
+	}
+	log_info("Recording sessions to " + config.capture_directory);
+}
+
+void Recorder::record(Shard& shard, CaptureKind kind, std::uint64_t session, std::string_view data) {
+	// no client sends lines this long, replaying it without them loses nothing of interest
+	if (data.size() > capture_max_data) {
+		return;
+	}
+
+	const auto time = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+	files[shard.get_index()]->append(CaptureRecord{
+		.time = static_cast<std::uint64_t>(time.count()),
+		.session = static_cast<std::uint32_t>(session),
+		.kind = kind,
+		.data = data
+	});
+}
+
+void Recorder::flush(Shard& shard) {
+	files[shard.get_index()]->flush();
+}
+
+void Recorder::schedule_flush(Shard& shard) {
+	shard.get_wheel().schedule(std::chrono::seconds(1), [this, &shard]() {
+		flush(shard);
+		schedule_flush(shard);
+	});
+}
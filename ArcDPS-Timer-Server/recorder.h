@@ -0,0 +1,33 @@
+#pragma once
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <string_view>
+
+#include "capture.h"
+#include "config.h"
+#include "shard.h"
+
+// Records what sessions send for replaying it later. Every shard writes the sessions it owns to
+// its own capture file in the capture directory, stamped with the time since the server started
+// recording. Records are buffered and flushed once a second and before the server exits.
+class Recorder {
+public:
+	Recorder(ShardPool& shards, const Config& config);
+	Recorder(const Recorder&) = delete;
+	Recorder& operator=(const Recorder&) = delete;
+
+	// called on the session's shard
+	void record(Shard& shard, CaptureKind kind, std::uint64_t session, std::string_view data = {});
+	// called on the shard, writes what it buffered
+	void flush(Shard& shard);
+private:
+	const std::chrono::steady_clock::time_point start;
+	// indexed by shard, only touched from that shard
+	std::vector<std::unique_ptr<CaptureFile>> files;
+
+	void schedule_flush(Shard& shard);
+};
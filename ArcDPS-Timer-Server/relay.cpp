@@ -0,0 +1,324 @@
+#include "relay.h"
+
+#include <filesystem>
+#include <string>
+#include <stdexcept>
+
+#include "group.h"
+#include "logger.h"
+
+static std::string make_datagram(RelayKind kind, const std::string& group, std::string_view rest = {}) {
+	std::string datagram;
+	datagram.reserve(3 + group.size() + rest.size());
+	datagram.push_back(static_cast<char>(kind));
+	datagram.push_back(static_cast<char>(group.size() & 0xFF));
+	datagram.push_back(static_cast<char>((group.size() >> 8) & 0xFF));
+	datagram.append(group);
+	datagram.append(rest);
+	return datagram;
+}
+
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+
+#include <unistd.h>
+
+Relay::Relay(ShardPool& shards, const Config& config)
+:	shard(shards.at(0)),
+	shards(shards),
+	config(config),
+	path((std::filesystem::path(config.relay_directory) / ("arcdps-timer-" + std::to_string(::getpid()) + ".sock")).string()),
+	socket(shard.context()),
+	retry_timer(shard.context()) {
+	std::filesystem::create_directories(config.relay_directory);
+	std::filesystem::remove(path);
+
+	socket.open();
+	socket.bind(boost::asio::local::datagram_protocol::endpoint(path));
+	// peers are other processes, a full socket buffer drops the event rather than stalling this one
+	socket.non_blocking(true);
+
+	log_info("Relaying through " + path);
+	receive();
+	announce();
+}
+
+Relay::~Relay() {
+	std::error_code ec;
+	std::filesystem::remove(path, ec);
+}
+
+void Relay::announce() {
+	std::error_code ec;
+	for (const auto& entry : std::filesystem::directory_iterator(config.relay_directory, ec)) {
+		const std::string peer = entry.path().string();
+		if (peer != path && entry.path().extension() == ".sock") {
+			peers.insert(peer);
+		}
+	}
+
+	send_all(make_datagram(RelayKind::hello, ""));
+}
+
+// Keeps the order per peer, a datagram only goes out directly if nothing is waiting before it.
+void Relay::send(const std::string& peer, std::string_view datagram) {
+	auto backlog = backlogs.find(peer);
+	if (backlog == backlogs.end() && try_send(peer, datagram)) {
+		return;
+	}
+	if (!peers.contains(peer)) {
+		return;
+	}
+
+	auto& pending = backlogs[peer];
+	if (pending.size() >= max_relay_backlog) {
+		shard.stats.relay_dropped.increment();
+		return;
+	}
+	pending.emplace_back(datagram);
+	schedule_retry();
+}
+
+// Returns false if the peer's queue is full, Linux only lets a few datagrams wait per socket.
+bool Relay::try_send(const std::string& peer, std::string_view datagram) {
+	boost::system::error_code ec;
+	socket.send_to(boost::asio::buffer(datagram.data(), datagram.size()), boost::asio::local::datagram_protocol::endpoint(peer), 0, ec);
+
+	if (ec == boost::asio::error::would_block || ec == boost::asio::error::no_buffer_space) {
+		return false;
+	}
+
+	if (ec == boost::asio::error::connection_refused || ec == boost::system::errc::no_such_file_or_directory) {
+		// the process behind it is gone, possibly without cleaning up
+		log_warning("Relay peer " + peer + " is gone");
+		std::error_code remove_ec;
+		std::filesystem::remove(peer, remove_ec);
+		forget_peer(peer);
+	}
+	else if (ec) {
+		shard.stats.relay_dropped.increment();
+	}
+	else {
+		shard.stats.relay_sent.increment();
+	}
+	return true;
+}
+
+void Relay::schedule_retry() {
+	if (retry_scheduled) {
+		return;
+	}
+
+	retry_scheduled = true;
+	retry_timer.expires_after(std::chrono::milliseconds(1));
+	retry_timer.async_wait([this](const boost::system::error_code& ec) {
+		retry_scheduled = false;
+		if (!ec) {
+			retry();
+		}
+	});
+}
+
+void Relay::retry() {
+	for (auto backlog = backlogs.begin(); backlog != backlogs.end();) {
+		const std::string peer = backlog->first;
+		auto& pending = backlog->second;
+		while (!pending.empty() && try_send(peer, pending.front())) {
+			pending.pop_front();
+			if (!peers.contains(peer)) {
+				break;
+			}
+		}
+
+		if (pending.empty() || !peers.contains(peer)) {
+			backlog = backlogs.erase(backlog);
+		}
+		else {
+			++backlog;
+		}
+	}
+
+	if (!backlogs.empty()) {
+		schedule_retry();
+	}
+}
+
+void Relay::send_all(std::string_view datagram) {
+	// send may forget peers while iterating
+	const std::set<std::string> targets = peers;
+	for (const auto& peer : targets) {
+		send(peer, datagram);
+	}
+}
+
+void Relay::forget_peer(const std::string& peer) {
+	peers.erase(peer);
+	// an entry being retried is cleaned up by retry()
+	auto backlog = backlogs.find(peer);
+	if (backlog != backlogs.end()) {
+		backlog->second.clear();
+	}
+	for (auto& [group, members] : subscribers) {
+		members.erase(peer);
+	}
+	std::erase_if(subscribers, [](const auto& entry) {
+		return entry.second.empty();
+	});
+}
+
+void Relay::receive() {
+	socket.async_receive_from(boost::asio::buffer(receive_buffer), sender,
+		[this](boost::system::error_code ec, std::size_t length) {
+			if (ec == boost::asio::error::operation_aborted) {
+				return;
+			}
+			if (!ec) {
+				shard.stats.relay_received.increment();
+				handle_datagram(sender.path(), std::string_view(receive_buffer.data(), length));
+			}
+			receive();
+		}
+	);
+}
+
+#else
+
+Relay::Relay(ShardPool& shards, const Config& config)
+:	shard(shards.at(0)),
+	shards(shards),
+	config(config),
+	retry_timer(shard.context()) {
+	throw std::runtime_error("The relay needs Unix domain sockets, which are not available on this platform");
+}
+
+Relay::~Relay() {
+}
+
+void Relay::announce() {
+}
+
+void Relay::send(const std::string& peer, std::string_view datagram) {
+}
+
+bool Relay::try_send(const std::string& peer, std::string_view datagram) {
+	return true;
+}
+
+void Relay::schedule_retry() {
+}
+
+void Relay::retry() {
+}
+
+void Relay::send_all(std::string_view datagram) {
+}
+
+void Relay::forget_peer(const std::string& peer) {
+}
+
+void Relay::receive() {
+}
+
+#endif
+
+void Relay::subscribe(const std::string& group) {
+	shard.dispatch([this, group]() {
+		local_groups.insert(group);
+		send_all(make_datagram(RelayKind::subscribe, group));
+	});
+}
+
+void Relay::unsubscribe(const std::string& group) {
+	shard.dispatch([this, group]() {
+		local_groups.erase(group);
+		send_all(make_datagram(RelayKind::unsubscribe, group));
+	});
+}
+
+void Relay::publish(const std::string& group, const EventMessage& message) {
+	// packed on the group's shard, the relay shard only sends
+	shard.dispatch([this, group, datagram = make_datagram(RelayKind::event, group, message.pack())]() {
+		auto members = subscribers.find(group);
+		if (members == subscribers.end()) {
+			return;
+		}
+
+		const std::set<std::string> targets = members->second;
+		for (const auto& peer : targets) {
+			send(peer, datagram);
+		}
+	});
+}
+
+void Relay::handle_datagram(const std::string& peer, std::string_view datagram) {
+	if (datagram.size() < 3 || peer.empty()) {
+		return;
+	}
+
+	const std::size_t name_length = static_cast<std::uint8_t>(datagram[1]) | (static_cast<std::uint8_t>(datagram[2]) << 8);
+	if (datagram.size() < 3 + name_length) {
+		return;
+	}
+	const std::string group(datagram.substr(3, name_length));
+	const std::string_view rest = datagram.substr(3 + name_length);
+
+	peers.insert(peer);
+	switch (static_cast<RelayKind>(datagram[0])) {
+	case RelayKind::hello:
+		for (const auto& local_group : local_groups) {
+			send(peer, make_datagram(RelayKind::subscribe, local_group));
+		}
+		break;
+	case RelayKind::subscribe:
+		subscribers[group].insert(peer);
+		hand_over_history(group, peer);
+		break;
+	case RelayKind::unsubscribe: {
+		auto members = subscribers.find(group);
+		if (members != subscribers.end()) {
+			members->second.erase(peer);
+			if (members->second.empty()) {
+				subscribers.erase(members);
+			}
+		}
+		break;
+	}
+	case RelayKind::event:
+		deliver(group, rest);
+		break;
+	}
+}
+
+void Relay::deliver(const std::string& group_name, std::string_view packed) {
+	auto message = EventMessage::unpack(packed);
+	if (!message) {
+		return;
+	}
+
+	// no origin, relayed events are not relayed again
+	shards.owner_of(group_name).dispatch([group_name, message = std::move(message.value())]() {
+		auto group = Group::find_group(group_name);
+		if (group) {
+			group->send_message(message, nullptr, std::chrono::steady_clock::time_point());
+		}
+	});
+}
+
+// A peer just got its first member of the group, the catch-up history it lacks lives here.
+void Relay::hand_over_history(const std::string& group_name, const std::string& peer) {
+	shards.owner_of(group_name).dispatch([this, group_name, peer]() {
+		auto group = Group::find_group(group_name);
+		if (!group || group->get_history().empty()) {
+			return;
+		}
+
+		std::vector<std::string> datagrams;
+		for (const auto& message : group->get_history()) {
+			datagrams.push_back(make_datagram(RelayKind::event, group_name, message.pack()));
+		}
+		shard.dispatch([this, peer, datagrams]() {
+			for (const auto& datagram : datagrams) {
+				send(peer, datagram);
+			}
+		});
+	});
+}
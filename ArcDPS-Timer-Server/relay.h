@@ -0,0 +1,71 @@
+#pragma once
+
+#include <map>
+#include <set>
+#include <deque>
+#include <array>
+#include <string>
+#include <string_view>
+#include <boost/asio.hpp>
+
+#include "protocol.h"
+#include "config.h"
+#include "shard.h"
+
+// Connects server processes sharing a port through SO_REUSEPORT. Every process binds a Unix
+// datagram socket in a common directory, tells its peers which groups have local members and
+// forwards the events of those groups to the peers subscribed to them. Datagrams are
+// uint8 kind, uint16 little endian group name length, group name, kind specific rest.
+enum class RelayKind : std::uint8_t {
+	hello = 0,       // sent to every socket in the directory on startup, answered with subscriptions
+	subscribe = 1,   // the sender has members in the group
+	unsubscribe = 2, // the sender's last member left the group
+	event = 3        // rest is a packed EventMessage
+};
+
+constexpr std::size_t max_relay_backlog = 64 * 1024;
+
+class Relay {
+public:
+	Relay(ShardPool& shards, const Config& config);
+	~Relay();
+	Relay(const Relay&) = delete;
+	Relay& operator=(const Relay&) = delete;
+
+	// may be called from any shard
+	void subscribe(const std::string& group);
+	void unsubscribe(const std::string& group);
+	void publish(const std::string& group, const EventMessage& message);
+private:
+	Shard& shard;
+	ShardPool& shards;
+	const Config& config;
+	std::string path;
+
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+	boost::asio::local::datagram_protocol::socket socket;
+	boost::asio::local::datagram_protocol::endpoint sender;
+#endif
+	std::array<char, 64 * 1024> receive_buffer;
+	boost::asio::steady_timer retry_timer;
+	bool retry_scheduled = false;
+
+	// only touched on the relay's shard
+	std::set<std::string> peers;
+	std::set<std::string> local_groups;
+	std::map<std::string, std::set<std::string>> subscribers;
+	// datagrams a peer had no room for yet, retried in order
+	std::map<std::string, std::deque<std::string>> backlogs;
+
+	void announce();
+	void send(const std::string& peer, std::string_view datagram);
+	bool try_send(const std::string& peer, std::string_view datagram);
+	void schedule_retry();
+	void retry();
+	void send_all(std::string_view datagram);
+	void forget_peer(const std::string& peer);
+	void receive();
+	void handle_datagram(const std::string& peer, std::string_view datagram);
+	void deliver(const std::string& group, std::string_view packed);
+	void hand_over_history(const std::string& group, const std::string& peer);
+};
@@ -0,0 +1,626 @@
+// Plays traffic the server recorded with --capture-dir back against a server. Every recorded
+// session gets a connection of its own that sends what the session sent, at the recorded times
+// divided by --speed (0 sends everything as fast as possible, in order). Prints the reached
+// throughput and the end-to-end latency of the replayed events as a single JSON object.
+//
+// The events are indexed by uuid while loading, the first copy of an event sent stamps its send
+// time and every delivery of it is measured against that.
+//
+// With --metrics-port the server's metrics are scraped before and after the run to report the
+// CPU time it spent in total and per event.
+
+#include <map>
+#include <deque>
+#include <cmath>
+#include <chrono>
+#include <memory>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+#include <stdexcept>
+#include <filesystem>
+#include <functional>
+#include <unordered_map>
+#include <boost/asio.hpp>
+#include <nlohmann/json.hpp>
+
+#include "capture.h"
+#include "protocol.h"
+#include "options.h"
+
+using json = nlohmann::json;
+using boost::asio::ip::tcp;
+using Clock = std::chrono::steady_clock;
+
+struct ReplayConfig {
+	std::string host = "127.0.0.1";
+	unsigned short port = 5000;
+	std::string capture_directory = "capture";
+	double speed = 1; // 0 replays as fast as possible
+	unsigned int drain = 2;
+	std::size_t threads = 1;
+	unsigned short metrics_port = 0; // the server's, 0 does not scrape it
+};
+
+static ReplayConfig parse_replay_config(int argc, char* argv[]) {
+	ReplayConfig config;
+
+	const std::map<std::string, std::function<void(const std::string&, const std::string&)>> options = {
+		{"--host", [&](const std::string&, const std::string& value) {
+			config.host = value;
+		}},
+		{"--port", [&](const std::string& name, const std::string& value) {
+			config.port = parse_number<unsigned short>(name, value);
+		}},
+		{"--capture-dir", [&](const std::string&, const std::string& value) {
+			config.capture_directory = value;
+		}},
+		{"--speed", [&](const std::string& name, const std::string& value) {
+			config.speed = parse_real(name, value);
+		}},
+		{"--drain", [&](const std::string& name, const std::string& value) {
+			config.drain = parse_number<unsigned int>(name, value);
+		}},
+		{"--threads", [&](const std::string& name, const std::string& value) {
+			config.threads = parse_number<std::size_t>(name, value);
+		}},
+		{"--metrics-port", [&](const std::string& name, const std::string& value) {
+			config.metrics_port = parse_number<unsigned short>(name, value);
+		}},
+	};
+
+	for (int i = 1; i < argc; ++i) {
+		const std::string name = argv[i];
+		auto option = options.find(name);
+		if (option == options.end()) {
+			throw std::invalid_argument("Unknown option " + name);
+		}
+		if (i + 1 >= argc) {
+			throw std::invalid_argument("Missing value for " + name);
+		}
+		option->second(name, argv[++i]);
+	}
+
+	if (config.threads == 0) {
+		throw std::invalid_argument("--threads must be positive");
+	}
+	return config;
+}
+
+// Send times of the captured events by index, stamped by whichever session sends one first.
+struct EventIndex {
+	std::unordered_map<std::string, std::size_t> by_uuid;
+	std::unique_ptr<std::atomic<std::int64_t>[]> sent; // nanoseconds of Clock, 0 until sent
+
+	std::optional<std::size_t> find(const Event& event) const {
+		auto found = by_uuid.find(std::string(event.uuid.begin(), event.uuid.end()));
+		if (found == by_uuid.end()) {
+			return std::nullopt;
+		}
+		return found->second;
+	}
+};
+
+// The uuid of the event a line or frame carries, if it carries one.
+static std::optional<Event> captured_event(CaptureKind kind, std::string_view data) {
+	std::string_view line = data;
+	if (kind == CaptureKind::frame) {
+		if (data.empty()) {
+			return std::nullopt;
+		}
+		if (static_cast<FrameKind>(data[0]) == FrameKind::event) {
+			return decode_event(data.substr(1));
+		}
+		line = data.substr(1);
+	}
+
+	auto fields = scan_command(line);
+	if (fields) {
+		return fields->data ? event_from_fields(*fields->data) : std::nullopt;
+	}
+	json command = json::parse(line, nullptr, false);
+	if (command.is_discarded() || !command.contains("data")) {
+		return std::nullopt;
+	}
+	return event_from_json(command["data"]);
+}
+
+class Client;
+
+struct Action {
+	std::uint64_t time; // nanoseconds into the capture
+	std::size_t session;
+	Client* client;
+	CaptureKind kind;
+	std::string_view data;
+	std::optional<std::size_t> event;
+};
+
+// One io_context and thread replaying the sessions assigned to it. Everything in here is only
+// touched by its own thread until the run is over.
+struct Worker {
+	Worker(const EventIndex& events)
+	:	timer(io_context),
+		work_guard(io_context.get_executor()),
+		events(events) {
+	}
+
+	boost::asio::io_context io_context;
+	boost::asio::steady_timer timer;
+	boost::asio::executor_work_guard<boost::asio::io_context::executor_type> work_guard;
+	const EventIndex& events;
+	std::vector<std::shared_ptr<Client>> clients;
+	std::vector<Action> actions; // by time
+	std::size_t next_action = 0;
+	Clock::time_point started;
+
+	std::uint64_t sessions_connected = 0;
+	std::uint64_t events_sent = 0;
+	std::uint64_t deliveries = 0;
+	std::uint64_t errors = 0;
+	std::vector<std::uint32_t> latencies; // microseconds
+};
+
+static std::atomic<std::size_t> finished_workers = 0;
+
+class Client : public std::enable_shared_from_this<Client> {
+public:
+	Client(Worker& worker, std::string name)
+	:	worker(worker),
+		socket(worker.io_context),
+		name(std::move(name)) {
+	}
+
+	void start(const tcp::resolver::results_type& endpoints) {
+		auto self(shared_from_this());
+		boost::asio::async_connect(socket, endpoints, [this, self](boost::system::error_code ec, const tcp::endpoint&) {
+			if (ec) {
+				fail("connect", ec);
+				return;
+			}
+			socket.set_option(tcp::no_delay(true));
+			connected = true;
+			worker.sessions_connected++;
+			receive();
+			if (!write_queue.empty()) {
+				write_next();
+			}
+			else if (closing) {
+				stop();
+			}
+		});
+	}
+
+	void send(const Action& action) {
+		if (action.kind == CaptureKind::line) {
+			write(std::string(action.data) + '\n');
+		}
+		else {
+			// the capture leaves out the length, which covers the kind and the body
+			std::string frame;
+			frame.reserve(2 + action.data.size());
+			frame.push_back(static_cast<char>(action.data.size() & 0xFF));
+			frame.push_back(static_cast<char>((action.data.size() >> 8) & 0xFF));
+			frame.append(action.data);
+			write(std::move(frame));
+		}
+
+		if (action.event) {
+			std::int64_t unsent = 0;
+			worker.events.sent[*action.event].compare_exchange_strong(unsent, now());
+			worker.events_sent++;
+		}
+	}
+
+	// closes once everything sent before is written
+	void close() {
+		closing = true;
+		if (connected && write_queue.empty()) {
+			stop();
+		}
+	}
+
+	void stop() {
+		boost::system::error_code ec;
+		socket.shutdown(tcp::socket::shutdown_both, ec);
+		socket.close(ec);
+	}
+
+private:
+	Worker& worker;
+	tcp::socket socket;
+	std::string name;
+	boost::asio::streambuf buffer;
+	std::deque<std::string> write_queue;
+	Encoding encoding = Encoding::json;
+	bool connected = false;
+	bool closing = false;
+	bool failed = false;
+
+	static std::int64_t now() {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+	}
+
+	void fail(const char* what, const boost::system::error_code& ec) {
+		if (!failed && !closing && ec != boost::asio::error::operation_aborted) {
+			std::cerr << "Session " << name << " " << what << " failed: " << ec.message() << std::endl;
+			worker.errors++;
+		}
+		failed = true;
+	}
+
+	void receive() {
+		while (true) {
+			const auto data = buffer.data();
+			const std::string_view available(static_cast<const char*>(data.data()), data.size());
+
+			if (encoding == Encoding::json) {
+				const std::size_t end = available.find('\n');
+				if (end == std::string_view::npos) {
+					break;
+				}
+				handle_line(available.substr(0, end));
+				buffer.consume(end + 1);
+			}
+			else {
+				if (available.size() < frame_header_size) {
+					break;
+				}
+				const std::size_t length = static_cast<std::uint8_t>(available[0]) | (static_cast<std::uint8_t>(available[1]) << 8);
+				if (length == 0 || available.size() < 2 + length) {
+					break;
+				}
+				handle_frame(static_cast<FrameKind>(available[2]), available.substr(frame_header_size, length - 1));
+				buffer.consume(2 + length);
+			}
+		}
+
+		auto self(shared_from_this());
+		boost::asio::async_read(socket, buffer, boost::asio::transfer_at_least(1), [this, self](boost::system::error_code ec, std::size_t) {
+			if (ec) {
+				if (ec != boost::asio::error::eof) {
+					fail("read", ec);
+				}
+				return;
+			}
+			receive();
+		});
+	}
+
+	void handle_line(std::string_view line) {
+		json message = json::parse(line, nullptr, false);
+		if (message.is_discarded()) {
+			worker.errors++;
+			return;
+		}
+
+		if (message.value("status", "") == "state") {
+			auto event = event_from_json(message["data"]);
+			if (event) {
+				handle_event(*event);
+			}
+			return;
+		}
+		handle_response(message);
+	}
+
+	void handle_frame(FrameKind kind, std::string_view body) {
+		if (kind == FrameKind::event) {
+			auto event = decode_event(body);
+			if (event) {
+				handle_event(*event);
+			}
+			return;
+		}
+
+		json message = json::parse(body, nullptr, false);
+		if (message.is_discarded()) {
+			worker.errors++;
+			return;
+		}
+		handle_response(message);
+	}
+
+	// the captured session answers pings and asks for the time on its own
+	void handle_response(const json& response) {
+		const std::string status = response.value("status", "");
+		if (status == "error") {
+			std::cerr << "Session " << name << " got " << response.dump() << std::endl;
+			worker.errors++;
+		}
+		else if (status == "ok" && response.contains("version")) {
+			// everything after the version response uses the negotiated encoding
+			encoding = response.value("protocol", "json") == "binary" ? Encoding::binary : Encoding::json;
+		}
+	}
+
+	// events of earlier runs or not sent yet have no send time and are not measured
+	void handle_event(const Event& event) {
+		const auto index = worker.events.find(event);
+		if (!index) {
+			return;
+		}
+		const std::int64_t sent = worker.events.sent[*index].load();
+		if (sent == 0) {
+			return;
+		}
+
+		const std::uint64_t latency = static_cast<std::uint64_t>(std::max<std::int64_t>(0, now() - sent)) / 1000;
+		worker.deliveries++;
+		worker.latencies.push_back(static_cast<std::uint32_t>(std::min<std::uint64_t>(latency, UINT32_MAX)));
+	}
+
+	void write(std::string data) {
+		if (failed) {
+			return;
+		}
+
+		const bool write_in_progress = !write_queue.empty();
+		write_queue.push_back(std::move(data));
+		if (connected && !write_in_progress) {
+			write_next();
+		}
+	}
+
+	void write_next() {
+		auto self(shared_from_this());
+		boost::asio::async_write(socket, boost::asio::buffer(write_queue.front()), [this, self](boost::system::error_code ec, std::size_t) {
+			if (ec) {
+				fail("write", ec);
+				write_queue.clear();
+				return;
+			}
+			write_queue.pop_front();
+			if (!write_queue.empty()) {
+				write_next();
+			}
+			else if (closing) {
+				stop();
+			}
+		});
+	}
+};
+
+// Runs every action that is due and sleeps until the next one.
+static void run_actions(Worker& worker, double speed) {
+	const auto due = [&](const Action& action) {
+		const double seconds = speed > 0 ? action.time / 1e9 / speed : 0;
+		return worker.started + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(seconds));
+	};
+
+	const auto now = Clock::now();
+	while (worker.next_action < worker.actions.size() && due(worker.actions[worker.next_action]) <= now) {
+		const Action& action = worker.actions[worker.next_action++];
+		switch (action.kind) {
+		case CaptureKind::open:
+			break; // connected up front
+		case CaptureKind::line:
+		case CaptureKind::frame:
+			action.client->send(action);
+			break;
+		case CaptureKind::close:
+			action.client->close();
+			break;
+		}
+	}
+
+	if (worker.next_action == worker.actions.size()) {
+		finished_workers++;
+		return;
+	}
+
+	worker.timer.expires_at(due(worker.actions[worker.next_action]));
+	worker.timer.async_wait([&worker, speed](const boost::system::error_code& ec) {
+		if (!ec) {
+			run_actions(worker, speed);
+		}
+	});
+}
+
+// Reads a value off the server's Prometheus metrics.
+static double scrape_value(const ReplayConfig& config, const std::string& name) {
+	boost::asio::io_context io_context;
+	tcp::socket socket(io_context);
+	boost::asio::connect(socket, tcp::resolver(io_context).resolve(config.host, std::to_string(config.metrics_port)));
+
+	const std::string request = "GET /metrics HTTP/1.1\r\nHost: " + config.host + "\r\nConnection: close\r\n\r\n";
+	boost::asio::write(socket, boost::asio::buffer(request));
+
+	std::string response;
+	boost::system::error_code ec;
+	boost::asio::read(socket, boost::asio::dynamic_buffer(response), ec);
+
+	const std::string prefix = "\n" + name + " ";
+	const std::size_t start = response.find(prefix);
+	if (start == std::string::npos) {
+		throw std::runtime_error("No " + name + " in the server's metrics");
+	}
+	return std::stod(response.substr(start + prefix.size()));
+}
+
+static std::uint32_t percentile(const std::vector<std::uint32_t>& sorted, double fraction) {
+	if (sorted.empty()) {
+		return 0;
+	}
+	const std::size_t rank = static_cast<std::size_t>(std::ceil(fraction * sorted.size()));
+	return sorted[std::clamp<std::size_t>(rank, 1, sorted.size()) - 1];
+}
+
+int main(int argc, char* argv[]) {
+	try {
+		const ReplayConfig config = parse_replay_config(argc, argv);
+
+		// one file per shard of the recording server, the records point into the contents
+		std::vector<std::string> contents;
+		for (const auto& entry : std::filesystem::directory_iterator(config.capture_directory)) {
+			if (!entry.is_regular_file() || !entry.path().filename().string().starts_with("capture-")) {
+				continue;
+			}
+			std::ifstream file(entry.path(), std::ios::binary);
+			std::ostringstream data;
+			data << file.rdbuf();
+			contents.push_back(data.str());
+		}
+		if (contents.empty()) {
+			throw std::runtime_error("No capture files in " + config.capture_directory);
+		}
+
+		EventIndex events;
+		std::vector<Action> actions;
+		std::map<std::pair<std::size_t, std::uint32_t>, std::size_t> session_indices; // file and session id
+		for (std::size_t file = 0; file < contents.size(); ++file) {
+			const bool valid = read_capture(contents[file], [&](const CaptureRecord& record) {
+				// session ids are reused across files, the index pairs keep them apart
+				auto [session, inserted] = session_indices.try_emplace({file, record.session}, session_indices.size());
+				Action action{record.time, session->second, nullptr, record.kind, record.data, std::nullopt};
+				if (record.kind == CaptureKind::line || record.kind == CaptureKind::frame) {
+					auto event = captured_event(record.kind, record.data);
+					if (event) {
+						auto [indexed, added] = events.by_uuid.try_emplace(std::string(event->uuid.begin(), event->uuid.end()), events.by_uuid.size());
+						action.event = indexed->second;
+					}
+				}
+				actions.push_back(action);
+			});
+			if (!valid) {
+				throw std::runtime_error("Not a capture file: file " + std::to_string(file) + " in " + config.capture_directory);
+			}
+		}
+		events.sent = std::make_unique<std::atomic<std::int64_t>[]>(events.by_uuid.size());
+		std::stable_sort(actions.begin(), actions.end(), [](const Action& a, const Action& b) {
+			return a.time < b.time;
+		});
+		const std::uint64_t first = actions.empty() ? 0 : actions.front().time;
+		for (auto& action : actions) {
+			action.time -= first;
+		}
+		const std::uint64_t capture_duration = actions.empty() ? 0 : actions.back().time;
+
+		std::vector<std::unique_ptr<Worker>> workers;
+		for (std::size_t i = 0; i < config.threads; ++i) {
+			workers.push_back(std::make_unique<Worker>(events));
+		}
+
+		// sessions go round robin to the workers, each worker keeps its actions in time order
+		std::vector<Client*> clients(session_indices.size());
+		for (const auto& [key, index] : session_indices) {
+			Worker& worker = *workers[index % workers.size()];
+			worker.clients.push_back(std::make_shared<Client>(worker, std::to_string(key.first) + ":" + std::to_string(key.second)));
+			clients[index] = worker.clients.back().get();
+		}
+		for (auto& action : actions) {
+			action.client = clients[action.session];
+			workers[action.session % workers.size()]->actions.push_back(action);
+		}
+
+		tcp::resolver resolver(workers[0]->io_context);
+		const auto endpoints = resolver.resolve(config.host, std::to_string(config.port));
+
+		const double cpu_before = config.metrics_port != 0 ? scrape_value(config, "process_cpu_seconds_total") : 0;
+		std::cerr << "Replaying " << session_indices.size() << " sessions over " << capture_duration / 1e9 << "s of capture" << std::endl;
+
+		// sessions connect up front, what they send before they are connected waits for it
+		const auto started = Clock::now();
+		std::vector<std::thread> threads;
+		for (auto& worker : workers) {
+			Worker* w = worker.get();
+			for (auto& client : w->clients) {
+				client->start(endpoints);
+			}
+			boost::asio::post(w->io_context, [w, started, speed = config.speed]() {
+				w->started = started;
+				run_actions(*w, speed);
+			});
+			threads.emplace_back([w]() {
+				w->io_context.run();
+			});
+		}
+
+		while (finished_workers < workers.size()) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+		const double elapsed = std::chrono::duration<double>(Clock::now() - started).count();
+		std::this_thread::sleep_for(std::chrono::seconds(config.drain));
+		const double cpu = config.metrics_port != 0 ? scrape_value(config, "process_cpu_seconds_total") - cpu_before : 0;
+
+		for (auto& worker : workers) {
+			Worker* w = worker.get();
+			boost::asio::post(w->io_context, [w]() {
+				w->timer.cancel();
+				for (auto& client : w->clients) {
+					client->stop();
+				}
+				w->work_guard.reset();
+			});
+		}
+		for (auto& thread : threads) {
+			thread.join();
+		}
+
+		std::uint64_t sessions_connected = 0;
+		std::uint64_t events_sent = 0;
+		std::uint64_t deliveries = 0;
+		std::uint64_t errors = 0;
+		std::vector<std::uint32_t> latencies;
+		for (auto& worker : workers) {
+			sessions_connected += worker->sessions_connected;
+			events_sent += worker->events_sent;
+			deliveries += worker->deliveries;
+			errors += worker->errors;
+			latencies.insert(latencies.end(), worker->latencies.begin(), worker->latencies.end());
+		}
+		std::sort(latencies.begin(), latencies.end());
+
+		double mean = 0;
+		for (auto latency : latencies) {
+			mean += latency;
+		}
+		mean = latencies.empty() ? 0 : mean / latencies.size();
+
+		json result = {
+			{"config", {
+				{"host", config.host},
+				{"port", config.port},
+				{"capture_dir", config.capture_directory},
+				{"speed", config.speed},
+				{"threads", config.threads}
+			}},
+			{"sessions", session_indices.size()},
+			{"sessions_connected", sessions_connected},
+			{"records", actions.size()},
+			{"capture_seconds", capture_duration / 1e9},
+			{"replay_seconds", elapsed},
+			{"events_sent", events_sent},
+			{"deliveries", deliveries},
+			{"errors", errors},
+			{"events_per_second", events_sent / std::max(elapsed, 1e-3)},
+			{"deliveries_per_second", deliveries / std::max(elapsed, 1e-3)},
+			{"latency_us", {
+				{"mean", mean},
+				{"p50", percentile(latencies, 0.5)},
+				{"p99", percentile(latencies, 0.99)},
+				{"p999", percentile(latencies, 0.999)},
+				{"max", latencies.empty() ? 0 : latencies.back()}
+			}}
+		};
+		if (config.metrics_port != 0) {
+			result["server_cpu"] = {
+				{"seconds", cpu},
+				{"per_event_us", cpu * 1e6 / static_cast<double>(std::max<std::uint64_t>(1, events_sent))}
+			};
+		}
+		std::cout << result.dump() << std::endl;
+
+		return sessions_connected == session_indices.size() && errors == 0 ? 0 : 1;
+	}
+	catch (std::exception& e) {
+		std::cerr << "Error: " << e.what() << std::endl;
+		return 2;
+	}
+}
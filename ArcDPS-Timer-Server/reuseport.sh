@@ -0,0 +1,41 @@
+#!/bin/sh
+# Process count benchmark for --reuse-port. For each process count it starts that many servers
+# sharing one port and a relay directory, runs the load generator against them and prints the
+# load generator's JSON object with the process count added.
+#
+# usage: reuseport.sh [build directory] [load generator options]
+# PROCESSES (default "1 2 4 8"), PORT (default 5000) and THREADS (each server's --threads,
+# default 1) change the setup.
+set -e
+
+build=${1:-.}
+[ $# -gt 0 ] && shift
+processes=${PROCESSES:-1 2 4 8}
+port=${PORT:-5000}
+threads=${THREADS:-1}
+relay=$(mktemp -d)
+pids=
+
+stop_servers() {
+	if [ -n "$pids" ]; then
+		kill $pids 2>/dev/null || true
+		wait $pids 2>/dev/null || true
+	fi
+	pids=
+	rm -f "$relay"/*
+}
+trap 'stop_servers; rm -rf "$relay"' EXIT INT TERM
+
+for n in $processes; do
+	i=0
+	while [ $i -lt "$n" ]; do
+		"$build/arcdps-timer-server" --port "$port" --reuse-port 1 --relay-dir "$relay" --threads "$threads" --log-level warning &
+		pids="$pids $!"
+		i=$((i + 1))
+	done
+	sleep 1
+
+	result=$("$build/arcdps-timer-loadgen" --port "$port" "$@" || true)
+	echo "{\"processes\":$n,${result#\{}"
+	stop_servers
+done
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Bounded multi-producer single-consumer ring (Vyukov). Each slot carries a sequence number
+// telling producers and the consumer whose turn it is; push() claims a slot with one CAS and
+// fails instead of waiting when the ring is full. Elements are filled and read in place.
+template <typename T, std::size_t Capacity>
+class RingBuffer {
+	static_assert((Capacity & (Capacity - 1)) == 0, "capacity must be a power of two");
+public:
+	RingBuffer() {
+		for (std::size_t i = 0; i < Capacity; ++i) {
+			slots[i].sequence.store(i, std::memory_order_relaxed);
+		}
+	}
+
+	RingBuffer(const RingBuffer&) = delete;
+	RingBuffer& operator=(const RingBuffer&) = delete;
+
+	// fill gets the slot's element, returns false if the ring is full
+	template <typename Fill>
+	bool push(Fill fill) {
+		std::size_t position = enqueue_position.load(std::memory_order_relaxed);
+		while (true) {
+			Slot& slot = slots[position & (Capacity - 1)];
+			const std::size_t sequence = slot.sequence.load(std::memory_order_acquire);
+			const auto difference = static_cast<std::intptr_t>(sequence) - static_cast<std::intptr_t>(position);
+			if (difference == 0) {
+				if (enqueue_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+					fill(slot.value);
+					slot.sequence.store(position + 1, std::memory_order_release);
+					return true;
+				}
+			}
+			else if (difference < 0) {
+				return false;
+			}
+			else {
+				position = enqueue_position.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	// consumer only, consume gets the oldest element, returns false if the ring is empty
+	template <typename Consume>
+	bool pop(Consume consume) {
+		Slot& slot = slots[dequeue_position & (Capacity - 1)];
+		if (slot.sequence.load(std::memory_order_acquire) != dequeue_position + 1) {
+			return false;
+		}
+
+		consume(slot.value);
+		slot.sequence.store(dequeue_position + Capacity, std::memory_order_release);
+		++dequeue_position;
+		return true;
+	}
+private:
+	struct Slot {
+		std::atomic<std::size_t> sequence;
+		T value;
+	};
+
+	std::array<Slot, Capacity> slots;
+	alignas(64) std::atomic<std::size_t> enqueue_position = 0;
+	alignas(64) std::size_t dequeue_position = 0;
+};
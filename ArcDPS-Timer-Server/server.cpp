@@ -1,19 +1,65 @@
 #include "server.h"
-#include <iostream>
 
-Server::Server(boost::asio::io_context& io_context, boost::asio::ip::tcp::endpoint endpoint)
-:	acceptor(io_context, endpoint) {
-    std::cout << "Server now accepting connections" << std::endl;
+#include <string>
+
+#include "logger.h"
+
+Server::Server(ShardPool& shards, const Config& config, boost::asio::ip::tcp::endpoint endpoint, UdpChannel* udp,
+	std::optional<boost::asio::ip::tcp::acceptor::native_handle_type> inherited)
+:	shards(shards),
+	config(config),
+	acceptor(shards.at(0).context()),
+	udp(udp) {
+	if (inherited) {
+		// already bound and listening, connections waiting in its backlog are accepted here
+		acceptor.assign(endpoint.protocol(), *inherited);
+		log_info("Took over the listening socket on port " + std::to_string(acceptor.local_endpoint().port()));
+	}
+	else {
+		acceptor.open(endpoint.protocol());
+		acceptor.set_option(boost::asio::socket_base::reuse_address(true));
+		if (config.reuse_port) {
+			// several processes accept on the same port, the kernel spreads the connections
+#if defined(SO_REUSEPORT)
+			acceptor.set_option(boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true));
+#else
+			throw std::runtime_error("SO_REUSEPORT is not available on this platform");
+#endif
+		}
+		acceptor.bind(endpoint);
+		acceptor.listen();
+	}
+
+    log_info("Server now accepting connections on " + std::to_string(shards.size()) + " shard(s)");
 	accept_connection();
 }
 
+boost::asio::ip::tcp::acceptor::native_handle_type Server::native_handle() {
+	return acceptor.native_handle();
+}
+
+// The socket stays open for the process it was handed to, this one only stops accepting on it.
+void Server::stop_accepting() {
+	accepting = false;
+	boost::system::error_code ec;
+	acceptor.cancel(ec);
+}
+
 void Server::accept_connection() {
+	if (!accepting) {
+		return;
+	}
+
+	Shard& shard = shards.next();
 	acceptor.async_accept(
-        [this](boost::system::error_code ec, boost::asio::ip::tcp::socket socket) {
+        shard.context(),
+        [this, &shard](boost::system::error_code ec, boost::asio::ip::tcp::socket socket) {
             if (!ec) {
-                std::cout << "Accepted connection" << std::endl;
-                auto session = std::make_shared<Session>(std::move(socket));
-                session->start();
+                log_debug("Accepted connection");
+                auto session = std::make_shared<Session>(std::move(socket), shard, shards, config, udp);
+                shard.dispatch([session]() {
+                    session->start();
+                });
             }
 
             accept_connection();
@@ -1,15 +1,28 @@
 #pragma once
 
+#include <optional>
 #include <boost/asio.hpp>
 
 #include "session.h"
+#include "shard.h"
+#include "config.h"
+#include "udp.h"
 
 class Server {
 public:
-	Server(boost::asio::io_context& io_context, boost::asio::ip::tcp::endpoint endpoint);
+	// inherited is a listening socket handed over by the previous process, used instead of binding
+	Server(ShardPool& shards, const Config& config, boost::asio::ip::tcp::endpoint endpoint, UdpChannel* udp,
+		std::optional<boost::asio::ip::tcp::acceptor::native_handle_type> inherited = std::nullopt);
 
+	// on shard 0
+	boost::asio::ip::tcp::acceptor::native_handle_type native_handle();
+	void stop_accepting();
 private:
+	ShardPool& shards;
+	const Config& config;
 	boost::asio::ip::tcp::acceptor acceptor;
+	UdpChannel* udp;
+	bool accepting = true;
 
 	void accept_connection();
-};
\ No newline at end of file
+};
@@ -1,146 +1,18 @@
 #include "session.h"
 
-#include <iostream>
+#include <span>
+#include <cstdio>
+#include <string>
+#include <algorithm>
 #include <nlohmann/json-schema.hpp>
 
+#include "logger.h"
+
 using json = nlohmann::json;
 using nlohmann::json_schema::json_validator;
 
-Session::Session(boost::asio::ip::tcp::socket socket)
-:	socket(std::move(socket)) {
-}
-
-void Session::start() {
-	group = Group::get_group("default");
-	group.value()->join(shared_from_this());
-
-	receive_command();
-}
-
-void Session::send_message(std::string message) {
-	json data = {
-		{"status", "state"},
-		{"data", json::parse(message)}
-	};
-    send_data(data.dump());
-}
-
-void Session::receive_command() {
-	auto self(shared_from_this()); // keep Session alive while async operations are running
-	boost::asio::async_read_until(socket, buffer, '\n', 
-		[this, self](boost::system::error_code ec, std::size_t length) {
-			if (!ec) {
-				std::istream istream(&buffer);
-				std::string command_string;
-				std::getline(istream, command_string);
-
-				try {
-					json command = json::parse(command_string);
-
-					std::cout << "Received command: " << command["command"] << std::endl;
-
-					bool valid = is_valid(command);
-					if (!valid) {
-						std:: cout << "Error: invalid command" << std::endl;
-
-						json response = {
-							{"status", "error"},
-							{"message", "Invalid command"}
-						};
-						send_data(response.dump());
-
-						if (group.has_value()) {
-							group.value()->leave(shared_from_this());
-						}
-					
-						return;
-					}
-
-					if (command["command"] == "join") {
-						auto old_group = group;
-
-						group = Group::get_group(command["group"]);
-						group.value()->join(shared_from_this());
-
-						if (old_group.has_value() && old_group.value() != group.value()) {
-							old_group.value()->leave(shared_from_this());
-						}
-
-						json response = {
-							{"status", "ok"}
-						};
-						send_data(response.dump());
-					}
-					else if (command["command"] == "state") {
-						if (group.has_value()) {
-							group.value()->send_message(command["data"].dump());
-						};
-					}
-					else if (command["command"] == "version") {
-						json response = {
-							{"status", "ok"},
-							{"version", 10}
-						};
-						send_data(response.dump());
-					}
-
-					receive_command();	
-				}
-				catch (json::parse_error& e) {
-					std::cout << command_string << std::endl;
-					std::cout << "Error: " << e.what() << std::endl;
-
-					json response = {
-						{"status", "error"},
-						{"message", "Invalid JSON"}
-					};
-					send_data(response.dump());
-
-					if (group.has_value()) {
-						group.value()->leave(shared_from_this());
-					}
-				}
-			}
-			else {
-				if (group.has_value()) {
-					group.value()->leave(shared_from_this());
-				}
-			}
-		}
-	);
-}
-
-void Session::send_queued_messages() {
-	auto self(shared_from_this()); // keep Session alive while async operations are running
-    boost::asio::async_write(
-        socket,
-        boost::asio::buffer(message_queue.front().data(), message_queue.front().length()),
-        [this, self](boost::system::error_code ec, std::size_t) {
-			if (!ec) {
-				message_queue.pop_front();
-				if (!message_queue.empty()) {
-					send_queued_messages();
-				}
-			}
-			else {
-                if (group.has_value()) {
-					group.value()->leave(shared_from_this());
-                }
-			}
-		}
-    );
-}
-
-void Session::send_data(std::string data) {
-	bool write_in_progress = !message_queue.empty();
-	message_queue.push_back(data + '\n');
-	if (!write_in_progress) {
-		send_queued_messages();
-	}
-}
-
-bool Session::is_valid(nlohmann::json input) {
-	static json person_schema = R"(
+static json_validator make_command_validator() {
+	static const json command_schema = R"(
 	{
 		"$schema": "http://json-schema.org/draft-07/schema#",
 		"type": "object",
@@ -150,11 +22,28 @@ bool Session::is_valid(nlohmann::json input) {
 				"enum": [
 					"join",
 					"version",
-					"state"
+					"state",
+					"pong",
+					"udp",
+					"time"
 				]
 			},
 			"group": {
-				"type": "string"
+				"type": "string",
+				"maxLength": 64
+			},
+			"heartbeat": {
+				"type": "boolean"
+			},
+			"echo": {
+				"type": "boolean"
+			},
+			"protocol": {
+				"type": "string",
+				"enum": [
+					"json",
+					"binary"
+				]
 			},
 			"data": {
 				"type": "object",
@@ -162,7 +51,7 @@ bool Session::is_valid(nlohmann::json input) {
 					"source": {
 						"type": "string",
 						"enum": [
-							"maunal",
+							"manual",
 							"combat",
 							"movement",
 							"other"
@@ -176,6 +65,7 @@ bool Session::is_valid(nlohmann::json input) {
 							"reset",
 							"prepare",
 							"segment",
+							"segment_clear",
 							"none",
 							"map_change",
 							"history_clear"
@@ -199,17 +89,938 @@ bool Session::is_valid(nlohmann::json input) {
 		"required": [
 			"command"
 		],
+		"allOf": [
+			{
+				"if": { "properties": { "command": { "const": "join" } } },
+				"then": { "required": [ "group" ] }
+			},
+			{
+				"if": { "properties": { "command": { "const": "state" } } },
+				"then": { "required": [ "data" ] }
+			}
+		],
 		"title": "command_schema"
 	}
 	)"_json;
 
 	json_validator validator;
+	validator.set_root_schema(command_schema);
+	return validator;
+}
+
+// compiled once at startup, validate() is const and shared by all shards
+static const json_validator command_validator = make_command_validator();
+
+thread_local std::unordered_map<std::uint64_t, std::weak_ptr<Session>> Session::sessions;
+thread_local std::uint64_t Session::next_id = 0;
+Recorder* Session::recorder = nullptr;
+
+std::string SessionState::pack() const {
+	std::string packed;
+	packed.reserve(4 + group.size() + input.size());
+	packed.push_back(static_cast<char>(encoding));
+	packed.push_back(static_cast<char>((heartbeat ? 1 : 0) | (echo ? 2 : 0)));
+	packed.push_back(static_cast<char>(group.size() & 0xFF));
+	packed.push_back(static_cast<char>((group.size() >> 8) & 0xFF));
+	packed.append(group);
+	packed.append(input);
+	return packed;
+}
+
+std::optional<SessionState> SessionState::unpack(std::string_view packed) {
+	if (packed.size() < 4 || static_cast<std::uint8_t>(packed[0]) > static_cast<std::uint8_t>(Encoding::binary)) {
+		return std::nullopt;
+	}
+	const std::size_t name_length = static_cast<std::uint8_t>(packed[2]) | (static_cast<std::uint8_t>(packed[3]) << 8);
+	if (packed.size() < 4 + name_length) {
+		return std::nullopt;
+	}
+
+	SessionState state;
+	state.encoding = static_cast<Encoding>(packed[0]);
+	state.heartbeat = (packed[1] & 1) != 0;
+	state.echo = (packed[1] & 2) != 0;
+	state.group = std::string(packed.substr(4, name_length));
+	state.input = std::string(packed.substr(4 + name_length));
+	return state;
+}
+
+Session::Session(boost::asio::ip::tcp::socket socket, Shard& shard, ShardPool& shards, const Config& config, UdpChannel* udp)
+:	socket(std::move(socket)),
+	shard(shard),
+	shards(shards),
+	config(config),
+	udp(udp),
+	event_limit(config.session_rate, config.session_burst) {
+	shard_index = shard.get_index();
+}
+
+Session::~Session() {
+	if (udp_token != 0) {
+		udp->unregister_session(udp_token);
+	}
+
+	// the last reference may be dropped on any shard, the gauges, histogram and registry belong to ours
+	auto remaining = std::make_shared<std::deque<QueuedMessage>>(std::move(message_queue));
+	shard.dispatch([&stats = shard.stats, remaining, bytes = queued_bytes, id = id]() {
+		sessions.erase(id);
+		stats.sessions.add(-1);
+		stats.queued_messages.add(-static_cast<std::int64_t>(remaining->size()));
+		stats.queued_bytes.add(-static_cast<std::int64_t>(bytes));
+		for (const auto& message : *remaining) {
+			if (message.delivery) {
+				message.delivery->complete(stats.fanout_latency);
+			}
+		}
+	});
+}
+
+void Session::start() {
+	register_session();
+	// sessions handed over from another process are left out, the version command that set
+	// their protocol is not in the capture
+	if (recorder != nullptr) {
+		recording = true;
+		recorder->record(shard, CaptureKind::open, id);
+	}
+	join_group("default");
+
+	read_loop(shared_from_this());
+	// joining may already have started one
+	if (!writer_running) {
+		write_loop(shared_from_this());
+	}
+	schedule_heartbeat();
+}
+
+void Session::resume(SessionState state) {
+	register_session();
+	encoding = state.encoding;
+	heartbeat_enabled = state.heartbeat;
+	echo = state.echo;
+	buffer.sputn(state.input.data(), static_cast<std::streamsize>(state.input.size()));
+	// the client already has the group's history
+	if (!state.group.empty()) {
+		join_group(state.group, false);
+	}
+
+	read_loop(shared_from_this());
+	// joining may already have started one
+	if (!writer_running) {
+		write_loop(shared_from_this());
+	}
+	schedule_heartbeat();
+}
+
+void Session::register_session() {
+	shard.stats.sessions.add(1);
+	last_received = shard.get_wheel().now();
+	id = ++next_id;
+	sessions[id] = weak_from_this();
+}
+
+LogFields Session::log_fields(std::string_view command) const {
+	return {
+		.session = id,
+		.group = group ? std::string_view(*group) : std::string_view(),
+		.command = command
+	};
+}
+
+void Session::set_recorder(Recorder* new_recorder) {
+	recorder = new_recorder;
+}
+
+std::vector<std::shared_ptr<Session>> Session::get_sessions() {
+	std::vector<std::shared_ptr<Session>> live;
+	for (const auto& [id, weak_session] : sessions) {
+		if (auto session = weak_session.lock()) {
+			live.push_back(std::move(session));
+		}
+	}
+	return live;
+}
+
+void Session::pause() {
+	paused = true;
+}
+
+void Session::drain(std::function<void()> drained) {
+	drained_callback = std::move(drained);
+	check_drained();
+}
+
+// Writes keep going while paused, once the queue is empty the pending read is the only
+// operation left and cancelling it cannot cut a write short.
+void Session::check_drained() {
+	if (!drained_callback || (!closed && !message_queue.empty())) {
+		return;
+	}
+	if (reading) {
+		boost::system::error_code ec;
+		socket.cancel(ec);
+		return;
+	}
+
+	auto drained = std::move(drained_callback);
+	drained_callback = nullptr;
+	drained();
+}
+
+// What a read completing while paused got stays in the buffer and goes along with the session.
+void Session::stop_reading(const boost::system::error_code& ec) {
+	if (ec && ec != boost::asio::error::operation_aborted) {
+		closed = true;
+		leave_group();
+	}
+	check_drained();
+}
+
+bool Session::can_hand_off() const {
+	return !closed && group.has_value();
+}
+
+boost::asio::ip::tcp::socket::native_handle_type Session::release(SessionState& state) {
+	state.group = group.value_or("");
+	state.encoding = get_encoding();
+	state.heartbeat = heartbeat_enabled;
+	state.echo = wants_echo();
+	const auto data = buffer.data();
+	state.input.assign(static_cast<const char*>(data.data()), data.size());
+
+	// anything still arriving for the session is dropped, the new process delivers it
+	closed = true;
+	leave_group();
+	return socket.release();
+}
+
+void Session::finish() {
+	if (!closed) {
+		close();
+	}
+}
+
+void Session::schedule_heartbeat() {
+	if (config.heartbeat_interval == 0) {
+		return;
+	}
+
+	std::weak_ptr<Session> weak_self = shared_from_this();
+	shard.get_wheel().schedule(std::chrono::seconds(config.heartbeat_interval), [weak_self]() {
+		if (auto self = weak_self.lock()) {
+			self->heartbeat();
+		}
+	});
+}
+
+// Pings quiet sessions so dead peers surface as write errors. Sessions that announced
+// heartbeat support in the version command also get closed once idle for too long.
+void Session::heartbeat() {
+	if (closed) {
+		return;
+	}
+
+	const auto idle = shard.get_wheel().now() - last_received;
+	if (heartbeat_enabled && idle >= std::chrono::seconds(config.idle_timeout)) {
+		log_info("Closing idle session", log_fields());
+		shard.stats.idle_timeouts.increment();
+		close();
+		return;
+	}
+
+	if (idle >= std::chrono::seconds(config.heartbeat_interval)) {
+		json ping = {
+			{"status", "ping"}
+		};
+		send_data(ping.dump());
+	}
+
+	schedule_heartbeat();
+}
+
+void Session::send_message(Payload message, Payload datagram, std::shared_ptr<Delivery> delivery) {
+	// called from the group's shard, the socket belongs to ours
+	auto self(shared_from_this());
+	shard.dispatch([this, self, message, datagram, delivery]() {
+		if (datagram && !closed) {
+			send_datagram(datagram);
+		}
+		send_payload(message, delivery);
+	});
+}
+
+void Session::bind_datagrams(boost::asio::ip::udp::endpoint endpoint) {
+	auto self(shared_from_this());
+	shard.dispatch([this, self, endpoint]() {
+		datagram_endpoint = endpoint;
+		datagrams = true;
+	});
+}
+
+void Session::receive_datagram(boost::asio::ip::udp::endpoint sender, std::vector<std::string> bodies) {
+	auto self(shared_from_this());
+	shard.dispatch([this, self, sender, bodies]() {
+		if (closed || datagram_endpoint != sender) {
+			return;
+		}
+
+		last_received = shard.get_wheel().now();
+		for (const auto& body : bodies) {
+			auto message = EventMessage::from_binary(body);
+			if (message) {
+				submit_event(std::move(message.value()));
+			}
+		}
+	});
+}
+
+// Sends the event together with the previous one, so losing a single datagram loses nothing.
+void Session::send_datagram(const Payload& frame) {
+	const std::string_view body = std::string_view(frame->data).substr(frame_header_size);
+
+	std::string datagram;
+	datagram.reserve(2 + 2 * event_body_size);
+	datagram.push_back(static_cast<char>(DatagramKind::events));
+	datagram.push_back(static_cast<char>(previous_datagram ? 2 : 1));
+	datagram.append(body);
+	if (previous_datagram) {
+		datagram.append(std::string_view(previous_datagram->data).substr(frame_header_size));
+	}
+
+	udp->send(*datagram_endpoint, datagram, shard.stats);
+	previous_datagram = frame;
+}
+
+void Session::send_batch(std::vector<Payload> messages) {
+	auto self(shared_from_this());
+	shard.dispatch([this, self, messages]() {
+		for (const auto& message : messages) {
+			if (!queue_payload(message)) {
+				return;
+			}
+		}
+		wake_writer();
+	});
+}
+
+// The group's shard sends the handle back before it joins, so the acknowledgement carrying it
+// is queued ahead of the catch-up events.
+void Session::join_group(std::string group_name, bool catch_up, bool acknowledge) {
+	auto self(shared_from_this());
+	auto old_group = group;
+
+	group = group_name;
+	group_handle = 0;
+	shards.owner_of(group_name).dispatch([this, self, group_name, catch_up, acknowledge]() {
+		auto joined = Group::get_group(group_name, config);
+		shard.dispatch([this, self, group_name, handle = joined->get_handle(), acknowledge]() {
+			joined_group(group_name, handle, acknowledge);
+		});
+		joined->join(self, catch_up);
+	});
+
+	if (old_group.has_value() && old_group.value() != group_name) {
+		shards.owner_of(old_group.value()).dispatch([self, old_group]() {
+			auto group = Group::find_group(old_group.value());
+			if (group) {
+				group->leave(self);
+			}
+		});
+	}
+}
+
+void Session::joined_group(const std::string& group_name, GroupHandle handle, bool acknowledge) {
+	// a later join may have overtaken this one, its handle is on the way
+	const bool current = group == group_name;
+	if (current) {
+		group_handle = handle;
+	}
+	if (!acknowledge) {
+		return;
+	}
+
+	json response = {
+		{"status", "ok"}
+	};
+	if (current) {
+		response["handle"] = handle;
+	}
+	send_data(response.dump());
+}
+
+void Session::leave_group() {
+	if (!group.has_value()) {
+		return;
+	}
+	group_handle = 0;
+
+	auto self(shared_from_this());
+	std::string group_name = group.value();
+	group.reset();
+
+	shards.owner_of(group_name).dispatch([self, group_name]() {
+		auto group = Group::find_group(group_name);
+		if (group) {
+			group->leave(self);
+		}
+	});
+}
+
+// Events count against the session's rate limit once, over whichever channel the first copy
+// came in; datagrams repeat what went over TCP and the previous event.
+void Session::submit_event(EventMessage message) {
+	// the group drops the copy, or takes it as the retry of an event it rejected
+	if (forwarded_keys.contains(message.get_key())) {
+		send_group(std::move(message));
+		return;
+	}
+
+	// a held event keeps later ones back so they cannot overtake it
+	if (!held_event && event_limit.take(shard.get_wheel().now())) {
+		send_group(std::move(message));
+		return;
+	}
+
+	shard.stats.session_rate_limited.increment();
+	if (config.rate_limit_policy == RateLimitPolicy::conflate) {
+		if (held_event) {
+			shard.stats.rate_limit_conflated.increment();
+		}
+		held_event = std::move(message);
+		schedule_held_event();
+	}
+}
+
+void Session::schedule_held_event() {
+	if (held_event_scheduled) {
+		return;
+	}
+	held_event_scheduled = true;
+
+	std::weak_ptr<Session> weak_self = shared_from_this();
+	TimingWheel& wheel = shard.get_wheel();
+	wheel.schedule(event_limit.wait(wheel.now()), [weak_self]() {
+		if (auto self = weak_self.lock()) {
+			self->send_held_event();
+		}
+	});
+}
+
+void Session::send_held_event() {
+	held_event_scheduled = false;
+	if (!held_event || closed) {
+		return;
+	}
+	if (!event_limit.take(shard.get_wheel().now())) {
+		schedule_held_event();
+		return;
+	}
+
+	send_group(std::move(*held_event));
+	held_event.reset();
+}
+
+void Session::send_group(EventMessage message) {
+	if (!group.has_value()) {
+		return;
+	}
+	forwarded_keys.insert(message.get_key());
+
+	// fan-out latency is only tracked while someone can scrape it
+	const auto received = config.metrics_port != 0 ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+	// the origin is only compared against, never dereferenced on the group's shard
+	const Receiver* origin = this;
+	if (group_handle != 0) {
+		shards.at(Group::shard_of(group_handle)).dispatch([handle = group_handle, message = std::move(message), origin, received]() mutable {
+			auto group = Group::find_group(handle);
+			if (group) {
+				group->send_message(std::move(message), origin, received);
+			}
+		});
+		return;
+	}
+
+	// until the handle arrives from the group's shard
+	std::string group_name = group.value();
+	shards.owner_of(group_name).dispatch([group_name, message = std::move(message), origin, received]() mutable {
+		auto group = Group::find_group(group_name);
+		if (group) {
+			group->send_message(std::move(message), origin, received);
+		}
+	});
+}
+
+// Runs for as long as the session reads, reusing one buffer and one operation's memory.
+Task Session::read_loop([[maybe_unused]] std::shared_ptr<Session> self) {
+	reader_running = true;
+	// when the input arrived, for the time command; what is buffered before the first read gets now
+	auto received = std::chrono::system_clock::now();
+	while (handle_input(received)) {
+		reading = true;
+		const auto [ec, length] = co_await async_operation(read_memory, [this](auto handler) {
+			socket.async_read_some(buffer.prepare(read_size), std::move(handler));
+		});
+		received = std::chrono::system_clock::now();
+		reading = false;
+		buffer.commit(length);
+
+		if (paused) {
+			stop_reading(ec);
+			break;
+		}
+		if (ec) {
+			leave_group();
+			break;
+		}
+		last_received = shard.get_wheel().now();
+		shard.stats.bytes_received.increment(length);
+	}
+
+	reader_running = false;
+	if (recording && !paused) {
+		recorder->record(shard, CaptureKind::close, id);
+	}
+	wake_writer();
+}
+
+// Handles every complete command or frame in the buffer, each in place before it is consumed.
+// Returns whether to keep reading.
+bool Session::handle_input(std::chrono::system_clock::time_point received) {
+	while (true) {
+		const auto data = buffer.data();
+		const std::string_view available(static_cast<const char*>(data.data()), data.size());
+
+		if (get_encoding() == Encoding::json) {
+			const std::size_t end = available.find('\n');
+			if (end == std::string_view::npos) {
+				return true;
+			}
+
+			if (recording) {
+				recorder->record(shard, CaptureKind::line, id, available.substr(0, end));
+			}
+			const bool keep_reading = handle_command(available.substr(0, end), received);
+			buffer.consume(end + 1);
+			if (!keep_reading) {
+				return false;
+			}
+			continue;
+		}
+
+		if (available.size() < frame_header_size) {
+			return true;
+		}
 
+		const std::size_t length = static_cast<std::uint8_t>(available[0]) | (static_cast<std::uint8_t>(available[1]) << 8);
+		if (length == 0) {
+			send_error("Invalid frame");
+			leave_group();
+			return false;
+		}
+		if (available.size() < 2 + length) {
+			return true;
+		}
+
+		if (recording) {
+			recorder->record(shard, CaptureKind::frame, id, available.substr(2, length));
+		}
+		const bool keep_reading = handle_frame(static_cast<FrameKind>(available[2]), available.substr(frame_header_size, length - 1), received);
+		buffer.consume(2 + length);
+		if (!keep_reading) {
+			return false;
+		}
+	}
+}
+
+bool Session::handle_frame(FrameKind kind, std::string_view body, std::chrono::system_clock::time_point received) {
+	switch (kind) {
+	case FrameKind::command:
+		return handle_command(body, received);
+	case FrameKind::event: {
+		auto message = EventMessage::from_binary(body);
+		if (!message) {
+			log_error("Invalid event frame", log_fields());
+			send_error("Invalid command");
+			leave_group();
+			return false;
+		}
+
+		shard.stats.commands[static_cast<std::size_t>(Command::state)].increment();
+		submit_event(std::move(message.value()));
+		return true;
+	}
+	}
+
+	log_error("Unknown frame kind", log_fields());
+	send_error("Invalid frame");
+	leave_group();
+	return false;
+}
+
+// Commands are read straight off the line where the scanner takes them, state data is relayed
+// as it arrived. Everything else, including every invalid command, goes through the full parser
+// and the schema, which also tell what is wrong with it.
+bool Session::handle_command(std::string_view line, std::chrono::system_clock::time_point received) {
+	auto fields = scan_command(line);
+	if (!fields || !is_valid(*fields)) {
+		return parse_command(line, received);
+	}
+
+	log_debug("Received command", log_fields(*fields->command));
+	return run_command(*fields, received);
+}
+
+bool Session::parse_command(std::string_view line, std::chrono::system_clock::time_point received) {
 	try {
-		validator.set_root_schema(person_schema);
+		json command = json::parse(line);
+
+		bool valid = is_valid(command);
+		if (!valid) {
+			log_error("Invalid command", log_fields());
+
+			send_error("Invalid command");
+			leave_group();
+					
+			return false;
+		}
+
+		auto string_field = [&](const char* name) -> std::optional<std::string_view> {
+			if (!command.contains(name)) {
+				return std::nullopt;
+			}
+			return command[name].get_ref<const std::string&>();
+		};
+		auto boolean_field = [&](const char* name) -> std::optional<bool> {
+			if (!command.contains(name)) {
+				return std::nullopt;
+			}
+			return command[name].get<bool>();
+		};
+
+		CommandFields fields{
+			.command = string_field("command"),
+			.group = string_field("group"),
+			.protocol = string_field("protocol"),
+			.heartbeat = boolean_field("heartbeat"),
+			.echo = boolean_field("echo"),
+			.data = std::nullopt
+		};
+		std::string data;
+		if (command.contains("data")) {
+			const json& event = command["data"];
+			data = event.dump();
+			fields.data = EventFields{
+				.text = data,
+				.source = event["source"].get_ref<const std::string&>(),
+				.type = event["type"].get_ref<const std::string&>(),
+				.uuid = event["uuid"].get_ref<const std::string&>(),
+				.time = event["time"].get_ref<const std::string&>()
+			};
+		}
+
+		return run_command(fields, received);
+	}
+	catch (json::parse_error& e) {
+		log_error(std::string("Invalid JSON: ") + e.what(), log_fields());
+
+		send_error("Invalid JSON");
+		leave_group();
+
+		return false;
+	}
+}
+
+// Called with valid commands only.
+bool Session::run_command(const CommandFields& fields, std::chrono::system_clock::time_point received) {
+	const Command command = *find_command(*fields.command);
+	shard.stats.commands[static_cast<std::size_t>(command)].increment();
+
+	switch (command) {
+	case Command::join:
+		join_group(std::string(*fields.group), true, true);
+		break;
+	case Command::state:
+		submit_event(EventMessage::from_json(*fields.data));
+		break;
+	case Command::version: {
+		json response = {
+			{"status", "ok"},
+			{"version", 10},
+			{"time", true} // clients only send the time command to servers that announce it
+		};
+
+		// the response still goes out in the old encoding, everything after it in the new one
+		const Encoding requested = fields.protocol == "binary" ? Encoding::binary : Encoding::json;
+		if (fields.protocol) {
+			response["protocol"] = *fields.protocol;
+		}
+		send_data(response.dump());
+		encoding = requested;
+		heartbeat_enabled = fields.heartbeat.value_or(false);
+		echo = fields.echo.value_or(true);
+		break;
+	}
+	case Command::udp: {
+		json response = {
+			{"status", "ok"}
+		};
+		if (udp != nullptr) {
+			if (udp_token == 0) {
+				udp_token = udp->register_session(weak_from_this());
+			}
+
+			// the token goes out as hex, JSON numbers are not safe for 64 bits everywhere
+			char token[17];
+			std::snprintf(token, sizeof(token), "%016llx", static_cast<unsigned long long>(udp_token));
+			response["udp_port"] = udp->get_port();
+			response["token"] = token;
+		}
+		send_data(response.dump());
+		break;
+	}
+	case Command::time: {
+		// receive and transmit in microseconds since epoch, the client takes offset and delay
+		// from them and its own send and receive times, like NTP. Receive is when the read carrying
+		// the command completed, the time it waited behind other input counts as the server's
+		const auto microseconds = [](std::chrono::system_clock::time_point time) {
+			return std::chrono::duration_cast<std::chrono::microseconds>(time.time_since_epoch()).count();
+		};
+		json response = {
+			{"status", "time"},
+			{"receive", microseconds(received)}
+		};
+		response["transmit"] = microseconds(std::chrono::system_clock::now());
+		send_data(response.dump());
+		break;
+	}
+	case Command::pong:
+		break;
+	}
+
+	return true;
+}
+
+// Gathers as much of the queue as fits into one write, messages stay queued until it completes.
+// Parks while the queue is empty and the session still reads, and ends once it does not.
+Task Session::write_loop([[maybe_unused]] std::shared_ptr<Session> self) {
+	writer_running = true;
+	while (!closed) {
+		if (message_queue.empty()) {
+			check_drained();
+			if (!reader_running || closed) {
+				break;
+			}
+			co_await Parked(parked_writer);
+			continue;
+		}
+
+		write_buffers.clear();
+		std::size_t write_bytes = 0;
+		for (const auto& message : message_queue) {
+			if (!write_buffers.empty() && write_bytes + message.payload->data.size() > config.max_write_bytes) {
+				break;
+			}
+			write_buffers.push_back(boost::asio::buffer(message.payload->data));
+			write_bytes += message.payload->data.size();
+		}
+		in_flight = write_buffers.size();
+
+		const auto [ec, bytes_transferred] = co_await async_operation(write_memory, [this, write_bytes](auto handler) {
+			// a span, asio would copy the vector into the operation
+			boost::asio::async_write(
+				socket,
+				std::span<const boost::asio::const_buffer>(write_buffers),
+				[this, write_bytes](const boost::system::error_code& ec, std::size_t bytes_transferred) -> std::size_t {
+					if (ec || bytes_transferred >= write_bytes) {
+						return 0;
+					}
+					shard.stats.write_calls.increment();
+					return boost::asio::transfer_all()(ec, bytes_transferred);
+				},
+				std::move(handler)
+			);
+		});
+
+		if (ec) {
+			closed = true;
+			leave_group();
+			check_drained();
+			break;
+		}
+
+		const std::size_t written = in_flight;
+		for (std::size_t i = 0; i < written; ++i) {
+			unqueue(message_queue[i]);
+		}
+		message_queue.erase(message_queue.begin(), message_queue.begin() + written);
+		in_flight = 0;
+		shard.stats.messages_sent.increment(written);
+		shard.stats.writes.increment();
+		shard.stats.bytes_sent.increment(bytes_transferred);
+	}
+	writer_running = false;
+}
+
+// Hands new messages to the writer, starting a new one if the last has ended, e.g. after the
+// session stopped reading for a handoff.
+void Session::wake_writer() {
+	if (parked_writer) {
+		std::exchange(parked_writer, nullptr).resume();
+	}
+	else if (!writer_running && !closed && !message_queue.empty()) {
+		write_loop(shared_from_this());
+	}
+}
+
+void Session::send_data(const std::string& data) {
+	if (get_encoding() == Encoding::binary) {
+		send_payload(std::make_shared<const Frame>(encode_frame(FrameKind::command, data)));
+	}
+	else {
+		send_payload(std::make_shared<const Frame>(data + '\n'));
+	}
+}
+
+void Session::send_error(const std::string& message) {
+	json response = {
+		{"status", "error"},
+		{"message", message}
+	};
+	send_data(response.dump());
+}
+
+void Session::send_payload(Payload payload, std::shared_ptr<Delivery> delivery) {
+	if (queue_payload(std::move(payload), std::move(delivery))) {
+		wake_writer();
+	}
+}
+
+bool Session::queue_payload(Payload payload, std::shared_ptr<Delivery> delivery) {
+	if (closed || !make_room(*payload)) {
+		// a dropped message is as done as a written one as far as the fan-out is concerned
+		if (delivery) {
+			delivery->complete(shard.stats.fanout_latency);
+		}
+		return !closed;
+	}
+
+	queued_bytes += payload->data.size();
+	shard.stats.queued_messages.add(1);
+	shard.stats.queued_bytes.add(payload->data.size());
+	message_queue.push_back({std::move(payload), std::move(delivery)});
+	return true;
+}
+
+// Accounts for a message leaving the queue, the caller erases it.
+void Session::unqueue(const QueuedMessage& message) {
+	queued_bytes -= message.payload->data.size();
+	shard.stats.queued_messages.add(-1);
+	shard.stats.queued_bytes.add(-static_cast<std::int64_t>(message.payload->data.size()));
+	if (message.delivery) {
+		message.delivery->complete(shard.stats.fanout_latency);
+	}
+}
+
+// Applies the slow consumer policy, returns whether the frame should be queued.
+// Messages of the write in flight are never touched, responses are always queued.
+bool Session::make_room(const Frame& frame) {
+	auto over_limit = [&]() {
+		return queued_bytes + frame.data.size() > config.max_queue_bytes
+			|| message_queue.size() + 1 > config.max_queue_messages;
+	};
+
+	if (!over_limit() || frame.key.empty()) {
+		return true;
+	}
+
+	switch (config.slow_consumer_policy) {
+	case SlowConsumerPolicy::disconnect:
+		log_warning("Disconnecting slow consumer", log_fields());
+		shard.stats.slow_consumer_disconnects.increment();
+		close();
+		return false;
+	case SlowConsumerPolicy::conflate: {
+		auto queued = std::find_if(message_queue.begin() + in_flight, message_queue.end(), [&](const QueuedMessage& message) {
+			return message.payload->key == frame.key;
+		});
+		if (queued != message_queue.end()) {
+			shard.stats.messages_conflated.increment();
+			return false;
+		}
+		[[fallthrough]];
+	}
+	case SlowConsumerPolicy::drop_oldest:
+		for (auto message = message_queue.begin() + in_flight; message != message_queue.end() && over_limit();) {
+			if (message->payload->key.empty()) {
+				++message;
+				continue;
+			}
+			unqueue(*message);
+			message = message_queue.erase(message);
+			shard.stats.messages_dropped.increment();
+		}
+		if (over_limit()) {
+			shard.stats.messages_dropped.increment();
+			return false;
+		}
+		return true;
+	}
+
+	return true;
+}
+
+void Session::close() {
+	closed = true;
+
+	boost::system::error_code ec;
+	socket.close(ec);
+
+	// may run inside the group's fan-out loop, leave once it is done
+	auto self(shared_from_this());
+	boost::asio::post(socket.get_executor(), [this, self]() {
+		leave_group();
+	});
+}
+
+// The same rules as the schema, for what scan_command took. The scanner already checked the
+// field types and that data has all event fields.
+bool Session::is_valid(const CommandFields& fields) {
+	if (!fields.command) {
+		return false;
+	}
+	const auto command = find_command(*fields.command);
+	if (!command) {
+		return false;
+	}
+	if (fields.group && fields.group->size() > max_group_name_size) {
+		return false;
+	}
+	if (fields.protocol && fields.protocol != "json" && fields.protocol != "binary") {
+		return false;
+	}
+	if (fields.data) {
+		const auto is_one_of = [](const auto& names, std::string_view name) {
+			return std::find(names.begin(), names.end(), name) != names.end();
+		};
+		if (!is_one_of(event_sources, fields.data->source) || !is_one_of(event_types, fields.data->type)) {
+			return false;
+		}
+	}
+	return (command != Command::join || fields.group) && (command != Command::state || fields.data);
+}
+
+bool Session::is_valid(const nlohmann::json& input) {
+	try {
+		command_validator.validate(input);
 	}
 	catch (const std::exception& e) {
-		std::cerr << "Command schema validation failed: " << e.what() << "\n";
+		log_debug(std::string("Command schema validation failed: ") + e.what(), log_fields());
+		return false;
+	}
+
+	// the schema's maxLength counts code points, the cap is on bytes
+	const auto group = input.find("group");
+	if (group != input.end() && group->is_string() && group->get_ref<const std::string&>().size() > max_group_name_size) {
 		return false;
 	}
 
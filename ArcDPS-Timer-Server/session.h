@@ -1,28 +1,147 @@
 #pragma once
 
 #include <deque>
+#include <vector>
 #include <string>
 #include <memory>
 #include <optional>
+#include <functional>
+#include <unordered_map>
+#include <string_view>
 #include <boost/asio.hpp>
 #include <nlohmann/json.hpp>
 
+#include "coroutine.h"
 #include "receiver.h"
 #include "group.h"
+#include "protocol.h"
+#include "shard.h"
+#include "udp.h"
+#include "config.h"
+#include "stats.h"
+#include "rate_limit.h"
+#include "recent_keys.h"
+#include "logger.h"
+#include "recorder.h"
+
+// Protocol state a session takes along when the server is handed over to another process.
+struct SessionState {
+	std::string group; // empty if the session is in no group
+	Encoding encoding = Encoding::json;
+	bool heartbeat = false;
+	bool echo = true;
+	std::string input; // received but not handled yet
+
+	// uint8 encoding, uint8 flags (1 heartbeat, 2 echo), uint16 little endian group name length, group name, input
+	std::string pack() const;
+	static std::optional<SessionState> unpack(std::string_view packed);
+};
 
 class Session : public Receiver, public std::enable_shared_from_this<Session> {
 public:
-	Session(boost::asio::ip::tcp::socket socket);
+	Session(boost::asio::ip::tcp::socket socket, Shard& shard, ShardPool& shards, const Config& config, UdpChannel* udp);
+	~Session();
 	void start();
-	void send_message(std::string message);
+	void send_message(Payload message, Payload datagram, std::shared_ptr<Delivery> delivery);
+	void send_batch(std::vector<Payload> messages);
+	// continues a session another process handed over, instead of start
+	void resume(SessionState state);
+
+	// Graceful shutdown, called on the session's shard. pause stops handling input, drain calls
+	// back once everything queued is written and no read is pending, then the session is either
+	// released to be handed over or finished.
+	void pause();
+	void drain(std::function<void()> drained);
+	bool can_hand_off() const;
+	boost::asio::ip::tcp::socket::native_handle_type release(SessionState& state);
+	void finish();
+
+	// the live sessions of the calling shard
+	static std::vector<std::shared_ptr<Session>> get_sessions();
+
+	// records the sessions that start from now on, null stops recording new ones
+	static void set_recorder(Recorder* recorder);
+
+	// called by the datagram channel from its shard
+	void bind_datagrams(boost::asio::ip::udp::endpoint endpoint);
+	void receive_datagram(boost::asio::ip::udp::endpoint sender, std::vector<std::string> bodies);
 private:
+	struct QueuedMessage {
+		Payload payload;
+		std::shared_ptr<Delivery> delivery;
+	};
+
+	static constexpr std::size_t read_size = 4096;
+
 	boost::asio::ip::tcp::socket socket;
 	boost::asio::streambuf buffer;
-	std::deque<std::string> message_queue;
-	std::optional<std::shared_ptr<Group>> group;
+	HandlerMemory read_memory;
+	HandlerMemory write_memory;
+	std::coroutine_handle<> parked_writer;
+	bool reader_running = false;
+	bool writer_running = false;
+	std::deque<QueuedMessage> message_queue;
+	std::vector<boost::asio::const_buffer> write_buffers;
+	std::size_t queued_bytes = 0;
+	std::size_t in_flight = 0;
+	bool closed = false;
+	bool paused = false;
+	bool reading = false;
+	std::function<void()> drained_callback;
+	std::uint64_t id = 0;
+	bool recording = false;
+	bool heartbeat_enabled = false;
+	TimingWheel::Clock::time_point last_received;
+	std::optional<std::string> group;
+	GroupHandle group_handle = 0; // 0 until the group's shard sent it
+	Shard& shard;
+	ShardPool& shards;
+	const Config& config;
+
+	UdpChannel* udp;
+	std::uint64_t udp_token = 0;
+	std::optional<boost::asio::ip::udp::endpoint> datagram_endpoint;
+	Payload previous_datagram;
+
+	TokenBucket event_limit;
+	std::optional<EventMessage> held_event; // held back by the rate limit
+	RecentKeys forwarded_keys{16}; // events sent to the group, their copies are not charged again
+	bool held_event_scheduled = false;
+
+	Task read_loop(std::shared_ptr<Session> self);
+	Task write_loop(std::shared_ptr<Session> self);
+	bool handle_input(std::chrono::system_clock::time_point received);
+	void wake_writer();
+	void schedule_heartbeat();
+	void heartbeat();
+	bool handle_command(std::string_view line, std::chrono::system_clock::time_point received);
+	bool parse_command(std::string_view line, std::chrono::system_clock::time_point received);
+	bool run_command(const CommandFields& fields, std::chrono::system_clock::time_point received);
+	bool handle_frame(FrameKind kind, std::string_view body, std::chrono::system_clock::time_point received);
+	void join_group(std::string group_name, bool catch_up = true, bool acknowledge = false);
+	void joined_group(const std::string& group_name, GroupHandle handle, bool acknowledge);
+	void leave_group();
+	void submit_event(EventMessage message);
+	void schedule_held_event();
+	void send_held_event();
+	void send_group(EventMessage message);
+	void send_datagram(const Payload& frame);
+	void send_data(const std::string& data);
+	void send_error(const std::string& message);
+	void send_payload(Payload payload, std::shared_ptr<Delivery> delivery = nullptr);
+	bool queue_payload(Payload payload, std::shared_ptr<Delivery> delivery = nullptr);
+	void unqueue(const QueuedMessage& message);
+	bool make_room(const Frame& frame);
+	void close();
+	void check_drained();
+	void stop_reading(const boost::system::error_code& ec);
+	void register_session();
+	LogFields log_fields(std::string_view command = {}) const;
+	bool is_valid(const CommandFields& fields);
+	bool is_valid(const nlohmann::json& input);
 
-	void receive_command();
-	void send_queued_messages();
-	void send_data(std::string data);
-	bool is_valid(nlohmann::json input);
+	// by id, a destroyed session is removed on its shard later
+	static thread_local std::unordered_map<std::uint64_t, std::weak_ptr<Session>> sessions;
+	static thread_local std::uint64_t next_id;
+	static Recorder* recorder;
 };
@@ -0,0 +1,102 @@
+#include "shard.h"
+
+#include <thread>
+
+thread_local Shard* Shard::current_shard = nullptr;
+
+Shard::Shard(std::size_t index)
+:	index(index),
+	wheel(io_context, std::chrono::milliseconds(100)),
+	work_guard(boost::asio::make_work_guard(io_context)) {
+}
+
+boost::asio::io_context& Shard::context() {
+	return io_context;
+}
+
+TimingWheel& Shard::get_wheel() {
+	return wheel;
+}
+
+std::size_t Shard::get_index() const {
+	return index;
+}
+
+void Shard::enqueue(std::function<void()> task) {
+	inbox.push(std::move(task));
+
+	// only the first producer after a drain pays for waking up the io_context
+	if (!drain_scheduled.exchange(true, std::memory_order_acq_rel)) {
+		boost::asio::post(io_context, [this]() {
+			drain();
+		});
+	}
+}
+
+void Shard::drain() {
+	drain_scheduled.exchange(false, std::memory_order_acq_rel);
+
+	while (auto task = inbox.pop()) {
+		(*task)();
+	}
+}
+
+void Shard::run() {
+	current_shard = this;
+	io_context.run();
+	current_shard = nullptr;
+}
+
+void Shard::stop() {
+	work_guard.reset();
+	io_context.stop();
+}
+
+Shard* Shard::current() {
+	return current_shard;
+}
+
+ShardPool::ShardPool(std::size_t size) {
+	for (std::size_t i = 0; i < std::max<std::size_t>(size, 1); ++i) {
+		shards.push_back(std::make_unique<Shard>(i));
+	}
+}
+
+Shard& ShardPool::at(std::size_t index) {
+	return *shards[index];
+}
+
+Shard& ShardPool::owner_of(const std::string& group_name) {
+	return *shards[std::hash<std::string>{}(group_name) % shards.size()];
+}
+
+Shard& ShardPool::next() {
+	Shard& shard = *shards[next_shard];
+	next_shard = (next_shard + 1) % shards.size();
+	return shard;
+}
+
+std::size_t ShardPool::size() const {
+	return shards.size();
+}
+
+void ShardPool::run() {
+	std::vector<std::thread> threads;
+	for (std::size_t i = 1; i < shards.size(); ++i) {
+		threads.emplace_back([this, i]() {
+			shards[i]->run();
+		});
+	}
+
+	shards[0]->run();
+
+	for (auto& thread : threads) {
+		thread.join();
+	}
+}
+
+void ShardPool::stop() {
+	for (auto& shard : shards) {
+		shard->stop();
+	}
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include <functional>
+#include <boost/asio.hpp>
+
+#include "mpsc_queue.h"
+#include "stats.h"
+#include "timing_wheel.h"
+
+// A shard is one io_context driven by one thread. Groups are owned by the shard
+// their name hashes to, sessions by the shard that accepted them; work for
+// another shard is handed over through its inbox.
+class Shard {
+public:
+	Shard(std::size_t index);
+	Shard(const Shard&) = delete;
+	Shard& operator=(const Shard&) = delete;
+
+	boost::asio::io_context& context();
+	TimingWheel& get_wheel();
+	std::size_t get_index() const;
+	// runs the task right away on the shard's own thread, without wrapping it
+	template <typename Task>
+	void dispatch(Task&& task) {
+		if (current_shard == this) {
+			task();
+			return;
+		}
+		enqueue(std::forward<Task>(task));
+	}
+	void run();
+	void stop();
+
+	static Shard* current();
+
+	ShardStats stats;
+private:
+	std::size_t index;
+	boost::asio::io_context io_context;
+	TimingWheel wheel;
+	boost::asio::executor_work_guard<boost::asio::io_context::executor_type> work_guard;
+	MPSCQueue<std::function<void()>> inbox;
+	std::atomic<bool> drain_scheduled = false;
+
+	void enqueue(std::function<void()> task);
+	void drain();
+
+	static thread_local Shard* current_shard;
+};
+
+class ShardPool {
+public:
+	ShardPool(std::size_t size);
+
+	Shard& at(std::size_t index);
+	Shard& owner_of(const std::string& group_name);
+	Shard& next();
+	std::size_t size() const;
+	void run();
+	void stop();
+private:
+	std::vector<std::unique_ptr<Shard>> shards;
+	std::size_t next_shard = 0;
+};
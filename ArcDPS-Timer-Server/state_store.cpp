@@ -0,0 +1,156 @@
+#include "state_store.h"
+
+#include <chrono>
+#include <string>
+#include <stdexcept>
+#include <filesystem>
+
+#include "group.h"
+#include "logger.h"
+
+StateStore::StateStore(ShardPool& shards, const Config& config)
+:	shards(shards),
+	config(config) {
+	std::filesystem::create_directories(config.state_directory);
+	recover();
+
+	for (std::size_t i = 0; i < shards.size(); ++i) {
+		logs.push_back(std::make_unique<WriteAheadLog>(path_of("wal-", i), config.wal_size));
+		logs.back()->reset();
+
+		// 0 compacts only when a log fills up
+		if (config.snapshot_interval > 0) {
+			Shard& shard = shards.at(i);
+			shard.dispatch([this, &shard]() {
+				schedule_compaction(shard);
+			});
+		}
+	}
+}
+
+std::string StateStore::path_of(std::string_view prefix, std::size_t shard) const {
+	return (std::filesystem::path(config.state_directory) / (std::string(prefix) + std::to_string(shard))).string();
+}
+
+// Runs before the shards do. The recovered groups are written out as fresh snapshots for the
+// current number of shards before the old logs are cleared, a crash in between only repeats
+// events, which the restored groups drop by uuid.
+void StateStore::recover() {
+	const auto start = std::chrono::steady_clock::now();
+	RecoveredGroups recovered;
+	const std::size_t bytes = read_state(config.state_directory, recovered);
+
+	std::vector<std::string> snapshots(shards.size(), std::string(log_magic));
+	std::size_t events = 0;
+	for (const auto& [name, packed_events] : recovered) {
+		// only the tail since the last reset or map change is history
+		std::vector<std::pair<EventMessage, const std::string*>> messages;
+		for (const auto& packed : packed_events) {
+			auto message = EventMessage::unpack(packed);
+			if (!message) {
+				continue;
+			}
+			const std::string_view type = event_types[message->get_type()];
+			if (type == "reset" || type == "map_change") {
+				messages.clear();
+			}
+			messages.emplace_back(std::move(message.value()), &packed);
+		}
+		if (messages.size() > config.group_history) {
+			messages.erase(messages.begin(), messages.end() - config.group_history);
+		}
+		if (messages.empty()) {
+			continue;
+		}
+
+		Shard& owner = shards.owner_of(name);
+		std::vector<EventMessage> history;
+		for (auto& [message, packed] : messages) {
+			snapshots[owner.get_index()].append(make_record(RecordKind::event, name, *packed));
+			history.push_back(std::move(message));
+		}
+		events += history.size();
+
+		owner.dispatch([name, history = std::move(history), &config = config]() {
+			Group::restore(name, history, config);
+		});
+	}
+
+	for (std::size_t i = 0; i < shards.size(); ++i) {
+		if (!replace_file(path_of("snapshot-", i), snapshots[i])) {
+			throw std::runtime_error("Could not write snapshot to " + config.state_directory);
+		}
+	}
+
+	// clears the logs of this run's shards and removes files of shards a previous run had beyond them
+	std::vector<std::filesystem::path> stale;
+	std::error_code ec;
+	for (const auto& entry : std::filesystem::directory_iterator(config.state_directory, ec)) {
+		const std::string file = entry.path().filename().string();
+		bool current = false;
+		for (std::size_t i = 0; i < shards.size(); ++i) {
+			current = current || file == "snapshot-" + std::to_string(i) || file == "wal-" + std::to_string(i);
+		}
+		if (!current && (file.starts_with("snapshot-") || file.starts_with("wal-"))) {
+			stale.push_back(entry.path());
+		}
+	}
+	for (const auto& path : stale) {
+		std::filesystem::remove(path, ec);
+	}
+
+	const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+	log_info("Recovered " + std::to_string(events) + " event(s) of " + std::to_string(recovered.size()) + " group(s) from " + std::to_string(bytes) + " bytes in " + std::to_string(elapsed.count() / 1000.0) + " ms");
+}
+
+void StateStore::append_event(const std::string& group, const EventMessage& message) {
+	append(make_record(RecordKind::event, group, message.pack()));
+}
+
+void StateStore::append_drop(const std::string& group) {
+	append(make_record(RecordKind::drop, group));
+}
+
+void StateStore::detach() {
+	detached.store(true, std::memory_order_relaxed);
+}
+
+// A full log is compacted on the spot. Groups log a change once they made it, so the snapshot
+// already holds the state the record describes.
+void StateStore::append(std::string_view record) {
+	if (detached.load(std::memory_order_relaxed)) {
+		return;
+	}
+	Shard& shard = *Shard::current();
+	if (!logs[shard.get_index()]->append(record)) {
+		compact(shard);
+	}
+}
+
+void StateStore::compact(Shard& shard) {
+	if (detached.load(std::memory_order_relaxed)) {
+		return;
+	}
+
+	std::string snapshot(log_magic);
+	Group::for_each_group([&](const std::string& name, const std::shared_ptr<Group>& group) {
+		for (const auto& message : group->get_history()) {
+			snapshot.append(make_record(RecordKind::event, name, message.pack()));
+		}
+	});
+
+	// the log is only cleared once the snapshot is in place
+	if (!replace_file(path_of("snapshot-", shard.get_index()), snapshot)) {
+		log_error("Could not write snapshot of shard " + std::to_string(shard.get_index()));
+		return;
+	}
+	logs[shard.get_index()]->reset();
+	shard.stats.snapshots_written.increment();
+}
+
+void StateStore::schedule_compaction(Shard& shard) {
+	shard.get_wheel().schedule(std::chrono::seconds(config.snapshot_interval), [this, &shard]() {
+		compact(shard);
+		schedule_compaction(shard);
+	});
+}
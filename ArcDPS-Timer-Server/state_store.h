@@ -0,0 +1,40 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "protocol.h"
+#include "config.h"
+#include "shard.h"
+#include "wal.h"
+
+// Keeps group history across restarts. Every shard appends the events of its groups to its own
+// memory mapped log in the state directory, which is compacted into a snapshot of the shard's
+// groups periodically and whenever it fills up. On startup the previous state is read back and
+// the groups are restored on their shards, lingering until their members reconnect.
+class StateStore {
+public:
+	StateStore(ShardPool& shards, const Config& config);
+	StateStore(const StateStore&) = delete;
+	StateStore& operator=(const StateStore&) = delete;
+
+	// called on the group's shard
+	void append_event(const std::string& group, const EventMessage& message);
+	void append_drop(const std::string& group);
+	// stops writing, another process takes the state directory over
+	void detach();
+private:
+	ShardPool& shards;
+	const Config& config;
+	std::atomic<bool> detached = false;
+	// indexed by shard, only touched from that shard
+	std::vector<std::unique_ptr<WriteAheadLog>> logs;
+
+	std::string path_of(std::string_view prefix, std::size_t shard) const;
+	void recover();
+	void append(std::string_view record);
+	void compact(Shard& shard);
+	void schedule_compaction(Shard& shard);
+};
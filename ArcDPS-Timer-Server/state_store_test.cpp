@@ -0,0 +1,98 @@
+// Checks that a restart recovers every event of a group whose log filled up: events are sent
+// until one of them makes the write-ahead log compact, then one more, and the state directory
+// must read back all of them in order. Exits nonzero on a mismatch.
+
+#include <chrono>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <filesystem>
+
+#include "protocol.h"
+#include "config.h"
+#include "group.h"
+#include "shard.h"
+#include "state_store.h"
+#include "wal.h"
+
+static EventMessage make_event(std::uint64_t sequence) {
+	Event event{};
+	for (std::size_t i = 0; i < 8; ++i) {
+		event.uuid[i] = static_cast<std::uint8_t>(sequence >> (8 * i));
+	}
+	event.time = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+	event.type = 4; // segment, never clears the history
+	event.source = 1; // combat
+	return EventMessage::from_json(event_to_json(event));
+}
+
+int main() {
+	const std::filesystem::path directory = std::filesystem::temp_directory_path() / "arcdps-timer-state-test";
+	std::filesystem::remove_all(directory);
+
+	Config config;
+	config.state_directory = directory.string();
+	config.wal_size = 4096;
+	config.snapshot_interval = 0; // compacts only when the log fills up
+	config.group_history = 1000; // keeps everything this test sends
+
+	std::vector<std::string> sent;
+	bool compacted = false;
+	try {
+		ShardPool shards(1);
+		StateStore store(shards, config);
+		Group::set_state_store(&store);
+
+		shards.at(0).dispatch([&]() {
+			Shard& shard = *Shard::current();
+			auto group = Group::get_group("test", config);
+			const auto send = [&](std::uint64_t sequence) {
+				EventMessage message = make_event(sequence);
+				sent.push_back(message.get_key());
+				group->send_message(std::move(message), nullptr, std::chrono::steady_clock::time_point());
+			};
+
+			// the event that did not fit into the log, then one that goes to the fresh log
+			for (std::uint64_t sequence = 1; shard.stats.snapshots_written.get() == 0 && sequence < 10000; ++sequence) {
+				send(sequence);
+			}
+			compacted = shard.stats.snapshots_written.get() > 0;
+			send(10000);
+			shards.stop();
+		});
+		shards.run();
+		Group::set_state_store(nullptr);
+	}
+	catch (std::exception& e) {
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+
+	RecoveredGroups recovered;
+	read_state(directory.string(), recovered);
+	std::filesystem::remove_all(directory);
+
+	std::vector<std::string> keys;
+	for (const auto& packed : recovered["test"]) {
+		auto message = EventMessage::unpack(packed);
+		keys.push_back(message ? message->get_key() : std::string());
+	}
+
+	if (!compacted) {
+		std::cerr << "the log never filled up" << std::endl;
+		return 1;
+	}
+	if (keys != sent) {
+		std::cerr << "sent " << sent.size() << " event(s), recovered " << keys.size() << std::endl;
+		for (std::size_t i = 0; i < sent.size(); ++i) {
+			if (i >= keys.size() || keys[i] != sent[i]) {
+				std::cerr << "first missing event is number " << i + 1 << std::endl;
+				break;
+			}
+		}
+		return 1;
+	}
+
+	std::cout << "recovered all " << sent.size() << " event(s) across a compaction" << std::endl;
+	return 0;
+}
@@ -0,0 +1,97 @@
+#include "stats.h"
+
+#include <bit>
+#include <sstream>
+
+#include "logger.h"
+#include "shard.h"
+
+void Histogram::record(std::uint64_t value) {
+	buckets[bucket_of(value)].increment();
+	count.increment();
+	sum.increment(value);
+}
+
+std::uint64_t Histogram::get_bucket(std::size_t bucket) const {
+	return buckets[bucket].get();
+}
+
+std::uint64_t Histogram::get_count() const {
+	return count.get();
+}
+
+std::uint64_t Histogram::get_sum() const {
+	return sum.get();
+}
+
+std::size_t Histogram::bucket_of(std::uint64_t value) {
+	constexpr std::uint64_t sub_buckets = 1 << sub_bucket_bits;
+	if (value < sub_buckets) {
+		return static_cast<std::size_t>(value);
+	}
+
+	const std::size_t magnitude = std::bit_width(value) - 1;
+	const std::size_t sub_bucket = (value >> (magnitude - sub_bucket_bits)) & (sub_buckets - 1);
+	return std::min(((magnitude - sub_bucket_bits + 1) << sub_bucket_bits) + sub_bucket, bucket_count - 1);
+}
+
+std::uint64_t Histogram::upper_bound(std::size_t bucket) {
+	constexpr std::uint64_t sub_buckets = 1 << sub_bucket_bits;
+	if (bucket < sub_buckets) {
+		return bucket;
+	}
+
+	const std::size_t magnitude = (bucket >> sub_bucket_bits) + sub_bucket_bits - 1;
+	const std::uint64_t sub_bucket = bucket & (sub_buckets - 1);
+	return (std::uint64_t(1) << magnitude) + ((sub_bucket + 1) << (magnitude - sub_bucket_bits)) - 1;
+}
+
+std::size_t group_size_bucket(std::size_t size) {
+	return std::min<std::size_t>(std::bit_width(size) - 1, group_size_buckets - 1);
+}
+
+Delivery::Delivery(std::chrono::steady_clock::time_point received, std::size_t pending)
+:	received(received),
+	pending(pending) {
+}
+
+void Delivery::complete(Histogram& latency, std::size_t count) {
+	if (pending.fetch_sub(count, std::memory_order_acq_rel) == count) {
+		const auto elapsed = std::chrono::steady_clock::now() - received;
+		latency.record(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+	}
+}
+
+void print_statistics(ShardPool& shards) {
+	std::uint64_t messages_sent = 0;
+	std::uint64_t writes = 0;
+	std::uint64_t write_calls = 0;
+	std::uint64_t slow_consumer_disconnects = 0;
+	std::uint64_t messages_dropped = 0;
+	std::uint64_t messages_conflated = 0;
+	std::uint64_t idle_timeouts = 0;
+	std::uint64_t groups_swept = 0;
+
+	for (std::size_t i = 0; i < shards.size(); ++i) {
+		const ShardStats& stats = shards.at(i).stats;
+		messages_sent += stats.messages_sent.get();
+		writes += stats.writes.get();
+		write_calls += stats.write_calls.get();
+		slow_consumer_disconnects += stats.slow_consumer_disconnects.get();
+		messages_dropped += stats.messages_dropped.get();
+		messages_conflated += stats.messages_conflated.get();
+		idle_timeouts += stats.idle_timeouts.get();
+		groups_swept += stats.groups_swept.get();
+	}
+
+	const double calls_per_message = messages_sent > 0 ? static_cast<double>(write_calls) / messages_sent : 0.0;
+
+	std::ostringstream out;
+	out << "Statistics: " << messages_sent << " messages sent in "
+		<< writes << " writes, " << write_calls << " write syscalls, "
+		<< calls_per_message << " syscalls per message, slow consumers: "
+		<< slow_consumer_disconnects << " disconnected, " << messages_dropped << " messages dropped, "
+		<< messages_conflated << " conflated, " << idle_timeouts << " idle sessions closed, "
+		<< groups_swept << " empty groups swept";
+	log_info(out.str());
+}
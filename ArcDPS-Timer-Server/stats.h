@@ -0,0 +1,117 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string_view>
+
+#include "protocol.h"
+
+class ShardPool;
+
+// Counter written by exactly one thread (its shard) and read by any other.
+// Increments are a plain relaxed load/store pair, no locked read-modify-write.
+class Counter {
+public:
+	void increment(std::uint64_t amount = 1) {
+		value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+	}
+
+	std::uint64_t get() const {
+		return value.load(std::memory_order_relaxed);
+	}
+
+private:
+	std::atomic<std::uint64_t> value = 0;
+};
+
+// Single writer like Counter, but may go down.
+class Gauge {
+public:
+	void add(std::int64_t amount) {
+		value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+	}
+
+	std::int64_t get() const {
+		return value.load(std::memory_order_relaxed);
+	}
+
+private:
+	std::atomic<std::int64_t> value = 0;
+};
+
+// Log-linear histogram in the spirit of HDR histograms: every power of two is split into
+// four linear sub-buckets, which keeps the relative error below 25%. Single writer.
+class Histogram {
+public:
+	static constexpr std::size_t sub_bucket_bits = 2;
+	static constexpr std::size_t magnitudes = 32;
+	static constexpr std::size_t bucket_count = magnitudes << sub_bucket_bits;
+
+	void record(std::uint64_t value);
+	std::uint64_t get_bucket(std::size_t bucket) const;
+	std::uint64_t get_count() const;
+	std::uint64_t get_sum() const;
+
+	static std::size_t bucket_of(std::uint64_t value);
+	static std::uint64_t upper_bound(std::size_t bucket);
+private:
+	std::array<Counter, bucket_count> buckets;
+	Counter count;
+	Counter sum;
+};
+
+// group sizes are bucketed by power of two: 1, 2-3, 4-7, ...
+constexpr std::size_t group_size_buckets = 16;
+
+std::size_t group_size_bucket(std::size_t size);
+
+// Fan-out of one event, the last receiver to finish its write records the latency.
+struct Delivery {
+	Delivery(std::chrono::steady_clock::time_point received, std::size_t pending);
+
+	std::chrono::steady_clock::time_point received;
+	std::atomic<std::size_t> pending;
+
+	void complete(Histogram& latency, std::size_t count = 1);
+};
+
+struct ShardStats {
+	Counter messages_sent;
+	Counter writes;
+	Counter write_calls;
+	Counter slow_consumer_disconnects;
+	Counter messages_dropped;
+	Counter messages_conflated;
+	Counter messages_deduplicated;
+	Counter session_rate_limited;
+	Counter group_rate_limited;
+	Counter rate_limit_conflated;
+	Counter idle_timeouts;
+	Counter groups_swept;
+	Counter snapshots_written;
+	Counter allocations;
+	Counter bytes_received;
+	Counter bytes_sent;
+	Counter datagrams_sent;
+	Counter datagrams_received;
+	Counter datagrams_dropped;
+	Counter relay_sent;
+	Counter relay_received;
+	Counter relay_dropped;
+	Counter cluster_sent;
+	Counter cluster_received;
+	Counter cluster_dropped;
+	std::array<Counter, command_names.size()> commands;
+
+	Gauge sessions;
+	Gauge groups;
+	Gauge queued_messages;
+	Gauge queued_bytes;
+	std::array<Gauge, group_size_buckets> group_sizes;
+
+	Histogram fanout_latency; // microseconds from command receive to the last write completion
+};
+
+void print_statistics(ShardPool& shards);
@@ -0,0 +1,80 @@
+#include "timing_wheel.h"
+
+TimingWheel::TimingWheel(boost::asio::io_context& io_context, std::chrono::milliseconds tick)
+:	tick(tick),
+	start(Clock::now()),
+	timer(io_context) {
+	wait();
+}
+
+void TimingWheel::schedule(Clock::duration delay, std::function<void()> callback) {
+	// round up so an entry never fires early and never lands in the slot being processed
+	const std::uint64_t ticks = std::max<std::uint64_t>(1, (delay + tick - Clock::duration(1)) / tick);
+	insert(Entry{current_tick + ticks, std::move(callback)});
+	++entries;
+}
+
+TimingWheel::Clock::time_point TimingWheel::now() const {
+	return start + current_tick * tick;
+}
+
+std::size_t TimingWheel::size() const {
+	return entries;
+}
+
+void TimingWheel::insert(Entry entry) {
+	// lowest level on which the expiry shares all higher digits with the current tick
+	std::size_t level = 0;
+	while (level + 1 < levels && (entry.expiry >> (slot_bits * (level + 1))) != (current_tick >> (slot_bits * (level + 1)))) {
+		++level;
+	}
+
+	std::size_t slot = (entry.expiry >> (slot_bits * level)) & (slots - 1);
+	if (level + 1 == levels && (entry.expiry >> (slot_bits * levels)) != (current_tick >> (slot_bits * levels))) {
+		// beyond the top level: park it in slot 0, which is cascaded when the next rotation starts
+		slot = 0;
+	}
+
+	wheels[level][slot].push_back(std::move(entry));
+}
+
+void TimingWheel::advance() {
+	++current_tick;
+
+	// when a level wraps, the next slot of the level above is redistributed
+	for (std::size_t level = 1; level < levels; ++level) {
+		if ((current_tick & ((std::uint64_t(1) << (slot_bits * level)) - 1)) != 0) {
+			break;
+		}
+
+		const std::size_t slot = (current_tick >> (slot_bits * level)) & (slots - 1);
+		std::vector<Entry> cascaded;
+		cascaded.swap(wheels[level][slot]);
+		for (auto& entry : cascaded) {
+			insert(std::move(entry));
+		}
+	}
+
+	std::vector<Entry> due;
+	due.swap(wheels[0][current_tick & (slots - 1)]);
+	entries -= due.size();
+	for (auto& entry : due) {
+		entry.callback();
+	}
+}
+
+void TimingWheel::wait() {
+	timer.expires_at(now() + tick);
+	timer.async_wait([this](const boost::system::error_code& ec) {
+		if (ec) {
+			return;
+		}
+
+		// catch up if the loop was busy for longer than one tick
+		const auto target = static_cast<std::uint64_t>((Clock::now() - start) / tick);
+		while (current_tick < target) {
+			advance();
+		}
+		wait();
+	});
+}
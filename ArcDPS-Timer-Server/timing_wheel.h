@@ -0,0 +1,42 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <vector>
+#include <cstdint>
+#include <functional>
+#include <boost/asio.hpp>
+
+// Hierarchical timing wheel driven by a single asio timer. Four levels of 64 slots
+// cover 64^4 ticks; scheduling is O(1) and entries are only cascaded to a lower level
+// when their slot comes up. Not thread safe, use it from the owning shard only.
+class TimingWheel {
+public:
+	using Clock = std::chrono::steady_clock;
+
+	TimingWheel(boost::asio::io_context& io_context, std::chrono::milliseconds tick);
+
+	void schedule(Clock::duration delay, std::function<void()> callback);
+	Clock::time_point now() const;
+	std::size_t size() const;
+private:
+	static constexpr std::size_t levels = 4;
+	static constexpr std::size_t slot_bits = 6;
+	static constexpr std::size_t slots = 1 << slot_bits;
+
+	struct Entry {
+		std::uint64_t expiry;
+		std::function<void()> callback;
+	};
+
+	std::array<std::array<std::vector<Entry>, slots>, levels> wheels;
+	std::uint64_t current_tick = 0;
+	std::size_t entries = 0;
+	std::chrono::milliseconds tick;
+	Clock::time_point start;
+	boost::asio::steady_timer timer;
+
+	void insert(Entry entry);
+	void advance();
+	void wait();
+};
@@ -0,0 +1,118 @@
+#include "udp.h"
+
+#include <random>
+#include <string>
+
+#include "logger.h"
+#include "session.h"
+
+static std::uint64_t read_token(std::string_view datagram) {
+	std::uint64_t token = 0;
+	for (std::size_t i = 0; i < datagram_token_size; ++i) {
+		token |= static_cast<std::uint64_t>(static_cast<std::uint8_t>(datagram[1 + i])) << (8 * i);
+	}
+	return token;
+}
+
+UdpChannel::UdpChannel(ShardPool& shards, boost::asio::ip::udp::endpoint endpoint)
+:	shard(shards.at(0)),
+	socket(shard.context(), endpoint) {
+	// sends come from every shard and must never block one, a full socket buffer drops the datagram
+	socket.non_blocking(true);
+	log_info("Accepting datagrams on port " + std::to_string(endpoint.port()));
+	receive();
+}
+
+unsigned short UdpChannel::get_port() const {
+	return socket.local_endpoint().port();
+}
+
+std::uint64_t UdpChannel::register_session(std::weak_ptr<Session> session) {
+	thread_local std::mt19937_64 generator(std::random_device{}());
+	std::uint64_t token = 0;
+	while (token == 0) {
+		token = generator();
+	}
+
+	shard.dispatch([this, token, session]() {
+		sessions[token] = session;
+	});
+	return token;
+}
+
+void UdpChannel::unregister_session(std::uint64_t token) {
+	shard.dispatch([this, token]() {
+		sessions.erase(token);
+	});
+}
+
+void UdpChannel::send(const boost::asio::ip::udp::endpoint& endpoint, std::string_view datagram, ShardStats& stats) {
+	boost::system::error_code ec;
+	{
+		std::lock_guard<std::mutex> lock(send_mutex);
+		socket.send_to(boost::asio::buffer(datagram.data(), datagram.size()), endpoint, 0, ec);
+	}
+
+	if (ec) {
+		stats.datagrams_dropped.increment();
+	}
+	else {
+		stats.datagrams_sent.increment();
+	}
+}
+
+void UdpChannel::receive() {
+	socket.async_receive_from(boost::asio::buffer(receive_buffer), sender,
+		[this](boost::system::error_code ec, std::size_t length) {
+			if (ec == boost::asio::error::operation_aborted) {
+				return;
+			}
+			if (!ec) {
+				shard.stats.datagrams_received.increment();
+				handle_datagram(std::string_view(receive_buffer.data(), length));
+			}
+			receive();
+		}
+	);
+}
+
+void UdpChannel::handle_datagram(std::string_view datagram) {
+	if (datagram.size() < 1 + datagram_token_size) {
+		return;
+	}
+
+	auto entry = sessions.find(read_token(datagram));
+	if (entry == sessions.end()) {
+		return;
+	}
+	auto session = entry->second.lock();
+	if (!session) {
+		sessions.erase(entry);
+		return;
+	}
+
+	switch (static_cast<DatagramKind>(datagram[0])) {
+	case DatagramKind::hello:
+		session->bind_datagrams(sender);
+		send(sender, datagram.substr(0, 1 + datagram_token_size), shard.stats);
+		break;
+	case DatagramKind::events: {
+		const std::string_view events = datagram.substr(1 + datagram_token_size);
+		if (events.empty()) {
+			return;
+		}
+		const std::size_t count = static_cast<std::uint8_t>(events[0]);
+		if (count > max_datagram_events || events.size() != 1 + count * event_body_size) {
+			return;
+		}
+
+		std::vector<std::string> bodies;
+		bodies.reserve(count);
+		for (std::size_t i = 0; i < count; ++i) {
+			bodies.emplace_back(events.substr(1 + i * event_body_size, event_body_size));
+		}
+		session->receive_datagram(sender, std::move(bodies));
+		break;
+	}
+	}
+}
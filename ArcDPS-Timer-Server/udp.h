@@ -0,0 +1,53 @@
+#pragma once
+
+#include <map>
+#include <array>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <string_view>
+#include <boost/asio.hpp>
+
+#include "shard.h"
+
+class Session;
+
+// Datagram fast path for events, bound to a TCP session through the token the udp command hands out.
+// Every datagram starts with a uint8 kind:
+// hello (0): uint64 little endian token, binds the sender's endpoint and is echoed back as ack
+// events (1): client to server also carries the uint64 token, then uint8 count and count event bodies.
+// Server datagrams repeat the previous event next to the current one, a single loss is recovered by
+// the next datagram and anything else by TCP, which keeps carrying every event.
+enum class DatagramKind : std::uint8_t {
+	hello = 0,
+	events = 1
+};
+
+constexpr std::size_t datagram_token_size = 8;
+constexpr std::size_t max_datagram_events = 8;
+
+class UdpChannel {
+public:
+	UdpChannel(ShardPool& shards, boost::asio::ip::udp::endpoint endpoint);
+
+	unsigned short get_port() const;
+
+	// may be called from any shard
+	std::uint64_t register_session(std::weak_ptr<Session> session);
+	void unregister_session(std::uint64_t token);
+	void send(const boost::asio::ip::udp::endpoint& endpoint, std::string_view datagram, ShardStats& stats);
+private:
+	Shard& shard;
+	boost::asio::ip::udp::socket socket;
+	boost::asio::ip::udp::endpoint sender;
+	std::array<char, 512> receive_buffer;
+	std::mutex send_mutex;
+
+	// only touched on the channel's shard
+	std::map<std::uint64_t, std::weak_ptr<Session>> sessions;
+
+	void receive();
+	void handle_datagram(std::string_view datagram);
+};
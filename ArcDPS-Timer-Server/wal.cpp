@@ -0,0 +1,170 @@
+#include "wal.h"
+
+#include <cstring>
+#include <fstream>
+#include <algorithm>
+#include <filesystem>
+
+static std::uint32_t checksum(std::string_view data) {
+	std::uint32_t hash = 2166136261u;
+	for (const char c : data) {
+		hash ^= static_cast<std::uint8_t>(c);
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static std::uint32_t read_u32(const char* data) {
+	std::uint32_t value = 0;
+	for (std::size_t i = 0; i < 4; ++i) {
+		value |= static_cast<std::uint32_t>(static_cast<std::uint8_t>(data[i])) << (8 * i);
+	}
+	return value;
+}
+
+static void append_u32(std::string& out, std::uint32_t value) {
+	for (std::size_t i = 0; i < 4; ++i) {
+		out.push_back(static_cast<char>((value >> (8 * i)) & 0xFF));
+	}
+}
+
+std::string make_record(RecordKind kind, const std::string& group, std::string_view rest) {
+	std::string body;
+	body.reserve(3 + group.size() + rest.size());
+	body.push_back(static_cast<char>(kind));
+	body.push_back(static_cast<char>(group.size() & 0xFF));
+	body.push_back(static_cast<char>((group.size() >> 8) & 0xFF));
+	body.append(group);
+	body.append(rest);
+
+	std::string record;
+	record.reserve(8 + body.size());
+	append_u32(record, static_cast<std::uint32_t>(body.size()));
+	append_u32(record, checksum(body));
+	record.append(body);
+	return record;
+}
+
+// Walks the valid records, applying them if groups is given.
+static std::size_t scan(std::string_view contents, RecoveredGroups* groups) {
+	if (!contents.starts_with(log_magic)) {
+		return 0;
+	}
+
+	std::size_t offset = log_magic.size();
+	while (contents.size() - offset >= 8) {
+		const std::size_t length = read_u32(contents.data() + offset);
+		if (length < 3 || contents.size() - offset - 8 < length) {
+			break;
+		}
+		const std::string_view body = contents.substr(offset + 8, length);
+		if (read_u32(contents.data() + offset + 4) != checksum(body)) {
+			break;
+		}
+		const std::size_t name_length = static_cast<std::uint8_t>(body[1]) | (static_cast<std::uint8_t>(body[2]) << 8);
+		if (body.size() < 3 + name_length) {
+			break;
+		}
+
+		if (groups) {
+			std::string group(body.substr(3, name_length));
+			switch (static_cast<RecordKind>(body[0])) {
+			case RecordKind::event:
+				(*groups)[std::move(group)].emplace_back(body.substr(3 + name_length));
+				break;
+			case RecordKind::drop:
+				groups->erase(group);
+				break;
+			}
+		}
+		offset += 8 + length;
+	}
+	return offset;
+}
+
+std::size_t read_log(std::string_view contents, RecoveredGroups& groups) {
+	return scan(contents, &groups);
+}
+
+std::size_t read_state(const std::string& directory, RecoveredGroups& groups) {
+	// snapshots of a shard come before its log, the log holds what happened since
+	std::vector<std::pair<std::size_t, std::filesystem::path>> files;
+	std::error_code ec;
+	for (const auto& entry : std::filesystem::directory_iterator(directory, ec)) {
+		const std::string name = entry.path().filename().string();
+		for (const auto& [prefix, order] : {std::pair<std::string_view, std::size_t>{"snapshot-", 0}, {"wal-", 1}}) {
+			if (name.starts_with(prefix) && name.size() > prefix.size() && std::all_of(name.begin() + prefix.size(), name.end(), [](char c) { return c >= '0' && c <= '9'; })) {
+				files.emplace_back(std::stoul(name.substr(prefix.size())) * 2 + order, entry.path());
+			}
+		}
+	}
+	std::sort(files.begin(), files.end());
+
+	std::size_t bytes = 0;
+	for (const auto& [order, path] : files) {
+		if (std::filesystem::file_size(path, ec) < log_magic.size() || ec) {
+			continue;
+		}
+		boost::interprocess::file_mapping file(path.string().c_str(), boost::interprocess::read_only);
+		boost::interprocess::mapped_region region(file, boost::interprocess::read_only);
+		bytes += read_log(std::string_view(static_cast<const char*>(region.get_address()), region.get_size()), groups);
+	}
+	return bytes;
+}
+
+bool replace_file(const std::string& path, std::string_view contents) {
+	const std::string temporary = path + ".tmp";
+	{
+		std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+		out.write(contents.data(), static_cast<std::streamsize>(contents.size()));
+		if (!out.flush()) {
+			return false;
+		}
+	}
+
+	std::error_code ec;
+	std::filesystem::rename(temporary, path, ec);
+	return !ec;
+}
+
+static boost::interprocess::file_mapping open_mapping(const std::string& path, std::size_t capacity) {
+	if (!std::filesystem::exists(path)) {
+		std::ofstream(path, std::ios::binary);
+	}
+	if (std::filesystem::file_size(path) != capacity) {
+		std::filesystem::resize_file(path, capacity);
+	}
+	return boost::interprocess::file_mapping(path.c_str(), boost::interprocess::read_write);
+}
+
+WriteAheadLog::WriteAheadLog(const std::string& path, std::size_t capacity)
+:	file(open_mapping(path, std::max(capacity, log_magic.size()))),
+	region(file, boost::interprocess::read_write) {
+	offset = scan(std::string_view(static_cast<const char*>(region.get_address()), region.get_size()), nullptr);
+	if (offset == 0) {
+		reset();
+	}
+}
+
+bool WriteAheadLog::append(std::string_view record) {
+	if (region.get_size() - offset < record.size()) {
+		return false;
+	}
+
+	// a record cut short by a crash fails its checksum, nothing after it is read
+	std::memcpy(static_cast<char*>(region.get_address()) + offset, record.data(), record.size());
+	offset += record.size();
+	return true;
+}
+
+// Only the used part needs clearing, the rest is still zero from the last reset.
+void WriteAheadLog::reset() {
+	char* data = static_cast<char*>(region.get_address());
+	std::memset(data, 0, offset == 0 ? region.get_size() : offset);
+	std::memcpy(data, log_magic.data(), log_magic.size());
+	offset = log_magic.size();
+}
+
+std::size_t WriteAheadLog::size() const {
+	return offset;
+}
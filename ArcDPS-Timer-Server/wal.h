@@ -0,0 +1,52 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <string_view>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+// Group state on disk. Logs and snapshots start with a magic header followed by records: uint32
+// little endian length of the rest, uint32 little endian FNV-1a checksum of the rest, uint8 kind,
+// uint16 little endian group name length, group name, kind specific rest. Reading stops at the
+// first zero length or bad checksum, which is where a crash interrupted writing.
+enum class RecordKind : std::uint8_t {
+	event = 0, // rest is a packed EventMessage, appended to the group's history
+	drop = 1   // the group was removed, its history is forgotten
+};
+
+constexpr std::string_view log_magic = "ATLOG001";
+
+// packed events of every group in the order they arrived
+using RecoveredGroups = std::map<std::string, std::vector<std::string>>;
+
+std::string make_record(RecordKind kind, const std::string& group, std::string_view rest = {});
+
+// Applies the records of a log or snapshot, returns the number of bytes that held valid records.
+std::size_t read_log(std::string_view contents, RecoveredGroups& groups);
+
+// Reads snapshot-<n> and then wal-<n> of every n found in the directory, returns the bytes read.
+std::size_t read_state(const std::string& directory, RecoveredGroups& groups);
+
+// Writes to a temporary file and renames it over the old one, readers see either version whole.
+bool replace_file(const std::string& path, std::string_view contents);
+
+// Fixed size memory mapped log. Appends are copies into the mapping, the kernel writes them back,
+// so a crashed process loses nothing that was appended.
+class WriteAheadLog {
+public:
+	WriteAheadLog(const std::string& path, std::size_t capacity);
+	WriteAheadLog(const WriteAheadLog&) = delete;
+	WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+
+	// returns false if the record does not fit anymore
+	bool append(std::string_view record);
+	void reset();
+	std::size_t size() const;
+private:
+	boost::interprocess::file_mapping file;
+	boost::interprocess::mapped_region region;
+	std::size_t offset = 0;
+};
@@ -0,0 +1,142 @@
+// Recovery benchmark for the server's state directory. Fills a write-ahead log of each given size
+// with events spread over groups, then times what a restarting server does with it: reading the
+// log back and unpacking every event. Prints one JSON object per size.
+
+#include <map>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <stdexcept>
+#include <filesystem>
+#include <functional>
+#include <nlohmann/json.hpp>
+
+#include "protocol.h"
+#include "options.h"
+#include "wal.h"
+
+using json = nlohmann::json;
+using Clock = std::chrono::steady_clock;
+
+struct BenchConfig {
+	std::vector<std::size_t> sizes = {1, 4, 16, 64}; // MiB
+	std::size_t groups = 1000;
+	Encoding encoding = Encoding::binary;
+	std::string directory = (std::filesystem::temp_directory_path() / "arcdps-timer-walbench").string();
+};
+
+static BenchConfig parse_bench_config(int argc, char* argv[]) {
+	BenchConfig config;
+
+	const std::map<std::string, std::function<void(const std::string&, const std::string&)>> options = {
+		{"--sizes", [&](const std::string& name, const std::string& value) {
+			config.sizes.clear();
+			std::size_t start = 0;
+			while (start <= value.size()) {
+				const std::size_t end = std::min(value.find(',', start), value.size());
+				config.sizes.push_back(parse_number<std::size_t>(name, value.substr(start, end - start)));
+				start = end + 1;
+			}
+		}},
+		{"--groups", [&](const std::string& name, const std::string& value) {
+			config.groups = std::max<std::size_t>(1, parse_number<std::size_t>(name, value));
+		}},
+		{"--protocol", [&](const std::string& name, const std::string& value) {
+			if (value == "json") {
+				config.encoding = Encoding::json;
+			}
+			else if (value == "binary") {
+				config.encoding = Encoding::binary;
+			}
+			else {
+				throw std::invalid_argument("Invalid value for " + name + ": " + value);
+			}
+		}},
+		{"--dir", [&](const std::string&, const std::string& value) {
+			config.directory = value;
+		}}
+	};
+
+	for (int i = 1; i < argc; i += 2) {
+		const std::string name = argv[i];
+		auto option = options.find(name);
+		if (option == options.end()) {
+			throw std::invalid_argument("Unknown option " + name);
+		}
+		if (i + 1 >= argc) {
+			throw std::invalid_argument("Missing value for " + name);
+		}
+		option->second(name, argv[i + 1]);
+	}
+
+	return config;
+}
+
+static std::string make_packed_event(std::uint64_t sequence, Encoding encoding) {
+	Event event{};
+	for (std::size_t i = 0; i < 8; ++i) {
+		event.uuid[i] = static_cast<std::uint8_t>(sequence >> (8 * i));
+	}
+	event.time = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+	event.type = 4; // segment, never clears the history
+	event.source = 1; // combat
+
+	if (encoding == Encoding::binary) {
+		return EventMessage::from_binary(encode_event(event))->pack();
+	}
+	return EventMessage::from_json(event_to_json(event)).pack();
+}
+
+int main(int argc, char* argv[]) {
+	try {
+		const BenchConfig config = parse_bench_config(argc, argv);
+
+		for (const std::size_t size : config.sizes) {
+			std::filesystem::remove_all(config.directory);
+			std::filesystem::create_directories(config.directory);
+
+			std::size_t written = 0;
+			{
+				WriteAheadLog log((std::filesystem::path(config.directory) / "wal-0").string(), size * 1024 * 1024);
+				log.reset();
+				while (log.append(make_record(RecordKind::event, "group-" + std::to_string(written % config.groups), make_packed_event(written, config.encoding)))) {
+					++written;
+				}
+			}
+
+			const auto start = Clock::now();
+			RecoveredGroups groups;
+			const std::size_t bytes = read_state(config.directory, groups);
+			const auto read = Clock::now();
+
+			std::size_t unpacked = 0;
+			for (const auto& [name, events] : groups) {
+				for (const auto& packed : events) {
+					unpacked += EventMessage::unpack(packed) ? 1 : 0;
+				}
+			}
+			const auto done = Clock::now();
+
+			const auto milliseconds = [](Clock::duration duration) {
+				return std::chrono::duration<double, std::milli>(duration).count();
+			};
+			std::cout << json{
+				{"wal_bytes", bytes},
+				{"events", written},
+				{"recovered", unpacked},
+				{"groups", groups.size()},
+				{"read_ms", milliseconds(read - start)},
+				{"unpack_ms", milliseconds(done - read)},
+				{"recovery_ms", milliseconds(done - start)}
+			}.dump() << std::endl;
+		}
+
+		std::filesystem::remove_all(config.directory);
+	}
+	catch (std::exception& e) {
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
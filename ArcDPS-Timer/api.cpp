@@ -1,11 +1,75 @@
   #include "api.h"
 
+#include <cmath>
 #include <thread>
+#include <sstream>
+#include <algorithm>
 
 #include "arcdps.h"
+#include "eventstore.h"
 
 using json = nlohmann::json;
 
+// Binary protocol frames: uint16 little endian length (of kind and body), uint8 kind, body
+constexpr std::size_t frame_header_size = 3;
+constexpr uint8_t frame_command = 0;
+constexpr uint8_t frame_event = 1;
+constexpr std::size_t event_body_size = 16 + 8 + 1 + 1;
+
+// Datagrams: uint8 kind, uint64 little endian token (client to server only), for events uint8 count and the bodies
+constexpr uint8_t datagram_hello = 0;
+constexpr uint8_t datagram_events = 1;
+
+// time commands sent per sync and the samples the offset is chosen from
+constexpr std::size_t time_requests_per_sync = 4;
+constexpr std::size_t time_sample_window = 8;
+// offsets beyond this many seconds are taken for a broken server clock and ignored
+constexpr double max_clock_offset = 10;
+
+static std::string encode_frame(uint8_t kind, const std::string& body) {
+	std::string frame;
+	const std::size_t length = body.size() + 1;
+	frame.push_back(static_cast<char>(length & 0xFF));
+	frame.push_back(static_cast<char>((length >> 8) & 0xFF));
+	frame.push_back(static_cast<char>(kind));
+	frame.append(body);
+	return frame;
+}
+
+static std::string encode_event(const json& payload) {
+	std::chrono::sys_time<std::chrono::milliseconds> time;
+	std::istringstream time_stream(payload["time"].get<std::string>());
+	time_stream >> std::chrono::parse("%FT%T", time);
+
+	const boost::uuids::uuid uuid = payload["uuid"].get<boost::uuids::uuid>();
+	const int64_t milliseconds = time.time_since_epoch().count();
+
+	std::string body(uuid.begin(), uuid.end());
+	for (int i = 0; i < 8; ++i) {
+		body.push_back(static_cast<char>((static_cast<uint64_t>(milliseconds) >> (8 * i)) & 0xFF));
+	}
+	body.push_back(static_cast<char>(payload["type"].get<EventType>()));
+	body.push_back(static_cast<char>(payload["source"].get<EventSource>()));
+	return body;
+}
+
+static json decode_event(const std::string& body) {
+	boost::uuids::uuid uuid;
+	std::copy(body.begin(), body.begin() + 16, uuid.begin());
+
+	uint64_t milliseconds = 0;
+	for (int i = 0; i < 8; ++i) {
+		milliseconds |= static_cast<uint64_t>(static_cast<uint8_t>(body[16 + i])) << (8 * i);
+	}
+
+	return {
+		{"time", static_cast<int64_t>(milliseconds)},
+		{"type", static_cast<EventType>(body[24])},
+		{"source", static_cast<EventSource>(body[25])},
+		{"uuid", uuid}
+	};
+}
+
 API::API(const Settings& settings, GW2MumbleLink& mumble_link, MapTracker& map_tracker, GroupTracker& group_tracker, std::string server_url)
 :   server_url(server_url),
 	settings(settings),
@@ -21,16 +85,31 @@ void API::post_serverapi(std::string method, nlohmann::json payload) {
 	}
 
 	std::thread thread([&, method, payload]() {
-		boost::asio::streambuf request_buffer;
-		std::ostream request_stream(&request_buffer);
+		std::lock_guard lock(send_mutex);
+		if (datagrams_bound) {
+			// the current event goes out together with the previous one, a single lost datagram loses nothing
+			const std::string body = encode_event(payload);
+			std::string datagram = make_datagram(datagram_events);
+			datagram.push_back(static_cast<char>(previous_datagram_event.empty() ? 1 : 2));
+			datagram.append(body);
+			datagram.append(previous_datagram_event);
+			previous_datagram_event = body;
+
+			boost::system::error_code ec;
+			datagram_socket->send(boost::asio::buffer(datagram), 0, ec);
+		}
+
+		if (binary_protocol) {
+			const std::string frame = encode_frame(frame_event, encode_event(payload));
+			boost::asio::write(*socket, boost::asio::buffer(frame));
+			return;
+		}
 
 		json request = {
 			{"command", "state"},
 			{"data", payload}
 		};
-
-		request_stream << request.dump() << '\n';
-		boost::asio::write(*socket, request_buffer);
+		write_command(request);
 	});
 	thread.detach();
 }
@@ -48,7 +127,10 @@ void API::start_sync(std::function<void(const nlohmann::json&)> data_function) {
 		boost::asio::streambuf request_buffer;
 		std::ostream request_stream(&request_buffer);
 		json request = {
-			{"command", "version"}
+			{"command", "version"},
+			{"protocol", "binary"},
+			{"heartbeat", true},
+			{"echo", false} // our own events are already in the local store
 		};
 		request_stream << request.dump() << '\n';
 		boost::asio::write(*socket, request_buffer);
@@ -65,6 +147,12 @@ void API::start_sync(std::function<void(const nlohmann::json&)> data_function) {
 			}
 			else {
 				server_status = ServerStatus::online;
+				binary_protocol = response.value("protocol", "json") == "binary";
+				time_supported = response.value("time", false);
+
+				// the server answers with a port and token if it has a datagram channel
+				send_command({{"command", "udp"}});
+				sync_time();
 			}
 		}
 		catch ([[maybe_unused]] json::parse_error& e) {
@@ -104,14 +192,11 @@ void API::mod_imgui() {
 		if (id != new_id) {
 			id = new_id;
 
-			boost::asio::streambuf request_buffer;
-			std::ostream request_stream(&request_buffer);
 			json request = {
 				{"command", "join"},
 				{"group", id}
 			};
-			request_stream << request.dump() << '\n';
-			boost::asio::write(*socket, request_buffer);
+			send_command(request);
 		}
 	}
 	catch ([[maybe_unused]] boost::system::system_error& e) {
@@ -120,6 +205,26 @@ void API::mod_imgui() {
 	}
 }
 
+void API::sync_time() {
+	if (server_status != ServerStatus::online || socket.get() == nullptr || !time_supported) {
+		return;
+	}
+
+	try {
+		for (std::size_t i = 0; i < time_requests_per_sync; ++i) {
+			{
+				std::lock_guard lock(time_mutex);
+				time_requests.push_back(std::chrono::system_clock::now());
+			}
+			send_command({{"command", "time"}});
+		}
+	}
+	catch ([[maybe_unused]] boost::system::system_error& e) {
+		server_status = ServerStatus::offline;
+		log("Timer: failed to sync time");
+	}
+}
+
 API::~API() {
 	boost::asio::post(io_context, [this]() { 
 		socket->close(); 
@@ -131,6 +236,11 @@ void API::sync(std::function<void(const nlohmann::json&)> data_function) {
 		return;
 	}
 
+	if (binary_protocol) {
+		sync_binary(data_function);
+		return;
+	}
+
 	boost::asio::async_read_until(*socket, receive_buffer, '\n',
 		[this, data_function](boost::system::error_code ec, std::size_t length) {
 			if (ec) {
@@ -142,13 +252,7 @@ void API::sync(std::function<void(const nlohmann::json&)> data_function) {
 			std::string response_string;
 			std::getline(response_stream, response_string);
 			try {
-				json response = json::parse(response_string);
-				if (response["status"] == "state") {
-					data_function(response["data"]);
-				}
-				else if (response["status"] == "error") {
-					server_status = ServerStatus::offline;
-				}
+				handle_response(json::parse(response_string), data_function);
 			} catch ([[maybe_unused]] json::parse_error& e) {
 				server_status = ServerStatus::offline;
 				log("Timer: error reading server response");
@@ -157,3 +261,219 @@ void API::sync(std::function<void(const nlohmann::json&)> data_function) {
 		}
 	);
 }
+
+void API::sync_binary(std::function<void(const nlohmann::json&)> data_function) {
+	if (server_status != ServerStatus::online || socket.get() == nullptr) {
+		return;
+	}
+
+	// the version response may already have pulled the first frames into the buffer
+	std::size_t needed = frame_header_size;
+	if (receive_buffer.size() >= 2) {
+		const uint8_t* header = static_cast<const uint8_t*>(receive_buffer.data().data());
+		needed = 2 + (header[0] | (header[1] << 8));
+	}
+
+	if (receive_buffer.size() < needed) {
+		boost::asio::async_read(*socket, receive_buffer, boost::asio::transfer_at_least(needed - receive_buffer.size()),
+			[this, data_function](boost::system::error_code ec, std::size_t length) {
+				if (ec) {
+					server_status = ServerStatus::offline;
+					return;
+				}
+				sync_binary(data_function);
+			}
+		);
+		return;
+	}
+
+	const char* frame = static_cast<const char*>(receive_buffer.data().data());
+	const uint8_t kind = static_cast<uint8_t>(frame[2]);
+	const std::string body(frame + frame_header_size, frame + needed);
+	receive_buffer.consume(needed);
+
+	try {
+		if (kind == frame_event && body.size() == event_body_size) {
+			deliver_event(decode_event(body), data_function);
+		}
+		else if (kind == frame_command) {
+			handle_response(json::parse(body), data_function);
+		}
+	} catch ([[maybe_unused]] json::parse_error& e) {
+		server_status = ServerStatus::offline;
+		log("Timer: error reading server response");
+	}
+
+	boost::asio::post(io_context, [this, data_function]() {
+		sync_binary(data_function);
+	});
+}
+
+void API::handle_response(const nlohmann::json& response, std::function<void(const nlohmann::json&)> data_function) {
+	if (response["status"] == "state") {
+		deliver_event(response["data"], data_function);
+	}
+	else if (response["status"] == "ok" && response.contains("udp_port") && !datagram_socket) {
+		try {
+			start_datagrams(response["udp_port"].get<unsigned short>(), response["token"].get<std::string>());
+			receive_datagram(data_function);
+		}
+		catch ([[maybe_unused]] boost::system::system_error& e) {
+			datagram_socket.reset();
+			log("Timer: datagram channel unavailable, using TCP only");
+		}
+	}
+	else if (response["status"] == "time") {
+		handle_time(response);
+	}
+	else if (response["status"] == "error") {
+		server_status = ServerStatus::offline;
+	}
+	else if (response["status"] == "ping") {
+		try {
+			send_command({{"command", "pong"}});
+		}
+		catch ([[maybe_unused]] boost::system::system_error& e) {
+			server_status = ServerStatus::offline;
+		}
+	}
+}
+
+void API::send_command(const nlohmann::json& request) {
+	std::lock_guard lock(send_mutex);
+	write_command(request);
+}
+
+void API::write_command(const nlohmann::json& request) {
+	if (binary_protocol) {
+		const std::string frame = encode_frame(frame_command, request.dump());
+		boost::asio::write(*socket, boost::asio::buffer(frame));
+		return;
+	}
+
+	boost::asio::streambuf request_buffer;
+	std::ostream request_stream(&request_buffer);
+	request_stream << request.dump() << '\n';
+	boost::asio::write(*socket, request_buffer);
+}
+
+void API::start_datagrams(unsigned short port, const std::string& token) {
+	datagram_token = std::stoull(token, nullptr, 16);
+
+	const boost::asio::ip::udp::endpoint endpoint(socket->remote_endpoint().address(), port);
+	datagram_socket = std::make_unique<boost::asio::ip::udp::socket>(io_context);
+	datagram_socket->open(endpoint.protocol());
+	datagram_socket->connect(endpoint);
+
+	hello_timer = std::make_unique<boost::asio::steady_timer>(io_context);
+	send_hello();
+}
+
+// the hello binds our address to the session, it is repeated until the server echoes it
+void API::send_hello() {
+	if (datagrams_bound || hello_attempts++ >= 10) {
+		return;
+	}
+
+	{
+		std::lock_guard lock(send_mutex);
+		boost::system::error_code ec;
+		datagram_socket->send(boost::asio::buffer(make_datagram(datagram_hello)), 0, ec);
+	}
+
+	hello_timer->expires_after(std::chrono::milliseconds(500));
+	hello_timer->async_wait([this](boost::system::error_code ec) {
+		if (!ec) {
+			send_hello();
+		}
+	});
+}
+
+void API::receive_datagram(std::function<void(const nlohmann::json&)> data_function) {
+	datagram_socket->async_receive(boost::asio::buffer(datagram_buffer),
+		[this, data_function](boost::system::error_code ec, std::size_t length) {
+			if (ec == boost::asio::error::operation_aborted) {
+				return;
+			}
+
+			if (!ec && length > 0) {
+				const uint8_t kind = static_cast<uint8_t>(datagram_buffer[0]);
+				if (kind == datagram_hello) {
+					datagrams_bound = true;
+					log_debug("Timer: datagram channel bound");
+				}
+				else if (kind == datagram_events && length >= 2) {
+					const std::size_t count = static_cast<uint8_t>(datagram_buffer[1]);
+					for (std::size_t i = 0; i < count && 2 + (i + 1) * event_body_size <= length; ++i) {
+						const char* body = datagram_buffer.data() + 2 + i * event_body_size;
+						deliver_event(decode_event(std::string(body, body + event_body_size)), data_function);
+					}
+				}
+			}
+
+			receive_datagram(data_function);
+		}
+	);
+}
+
+std::string API::make_datagram(uint8_t kind) const {
+	std::string datagram(1, static_cast<char>(kind));
+	for (int i = 0; i < 8; ++i) {
+		datagram.push_back(static_cast<char>((datagram_token >> (8 * i)) & 0xFF));
+	}
+	return datagram;
+}
+
+// NTP style: with our send time t0, the server's receive and transmit times t1 and t2 and our
+// receive time t3, the offset is ((t1 - t0) + (t2 - t3)) / 2 and the round trip delay
+// (t3 - t0) - (t2 - t1). The sample with the least delay of the recent ones is the least
+// skewed by queueing, its offset is taken.
+void API::handle_time(const nlohmann::json& response) {
+	const auto t3 = std::chrono::system_clock::now();
+
+	std::lock_guard lock(time_mutex);
+	if (time_requests.empty()) {
+		return;
+	}
+	const auto t0 = time_requests.front();
+	time_requests.pop_front();
+
+	const auto seconds = [](std::chrono::system_clock::time_point time) {
+		return std::chrono::duration<double>(time.time_since_epoch()).count();
+	};
+	const double t1 = response["receive"].get<int64_t>() / 1e6;
+	const double t2 = response["transmit"].get<int64_t>() / 1e6;
+
+	const TimeSample sample{
+		.offset = ((t1 - seconds(t0)) + (t2 - seconds(t3))) / 2,
+		.delay = (seconds(t3) - seconds(t0)) - (t2 - t1)
+	};
+	if (std::abs(sample.offset) > max_clock_offset) {
+		log_debug("timer: time sync failed, offset too large to be plausible: " + std::to_string(sample.offset));
+		return;
+	}
+	time_samples.push_back(sample);
+	if (time_samples.size() > time_sample_window) {
+		time_samples.pop_front();
+	}
+
+	const auto best = std::min_element(time_samples.begin(), time_samples.end(), [](const TimeSample& a, const TimeSample& b) {
+		return a.delay < b.delay;
+	});
+	clock_offset = best->offset;
+	log_debug("timer: clock offset: " + std::to_string(best->offset) + ", delay: " + std::to_string(best->delay));
+}
+
+// events may arrive over both channels and twice per datagram, only the first copy is passed on
+void API::deliver_event(const nlohmann::json& data, std::function<void(const nlohmann::json&)> data_function) {
+	const boost::uuids::uuid uuid = data["uuid"].get<boost::uuids::uuid>();
+	if (std::find(recent_uuids.begin(), recent_uuids.end(), uuid) != recent_uuids.end()) {
+		return;
+	}
+
+	recent_uuids.push_back(uuid);
+	if (recent_uuids.size() > 64) {
+		recent_uuids.pop_front();
+	}
+	data_function(data);
+}
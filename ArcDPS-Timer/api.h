@@ -7,9 +7,16 @@
 #include "maptracker.h"
 #include "grouptracker.h"
 
+#include <array>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <vector>
 #include <string>
 #include <nlohmann/json.hpp>
 #include <functional>
+#include <boost/uuid/uuid.hpp>
 
 enum class ServerStatus { online, offline, outofdate, initializing };
 
@@ -20,11 +27,20 @@ public:
 	void start_sync(std::function<void(const nlohmann::json&)> data_function);
 	std::string get_id() const;
 	void mod_imgui();
+	// sends a round of time commands, their responses update clock_offset
+	void sync_time();
 	~API();
 
 	ServerStatus server_status = ServerStatus::initializing;
 	int server_version = 10;
+	std::atomic<double> clock_offset = 0; // seconds the server's clock is ahead of ours
 private:
+	// one exchange of the time command, in seconds
+	struct TimeSample {
+		double offset;
+		double delay;
+	};
+
 	const Settings& settings;
 	GW2MumbleLink& mumble_link;
 	MapTracker& map_tracker;
@@ -36,6 +52,36 @@ private:
 	boost::asio::io_context io_context;
 	boost::asio::streambuf receive_buffer;
 	std::unique_ptr<boost::asio::ip::tcp::socket> socket;
+	bool binary_protocol = false;
+	// posts, the render thread and the io thread all write to the server, one at a time keeps
+	// frames whole and pairs each datagram with the event sent before it
+	std::mutex send_mutex;
+
+	// datagram fast path for events, TCP keeps carrying them as fallback
+	std::unique_ptr<boost::asio::ip::udp::socket> datagram_socket;
+	std::unique_ptr<boost::asio::steady_timer> hello_timer;
+	std::array<char, 512> datagram_buffer;
+	uint64_t datagram_token = 0;
+	std::atomic<bool> datagrams_bound = false;
+	int hello_attempts = 0;
+	std::string previous_datagram_event;
+	std::deque<boost::uuids::uuid> recent_uuids;
+
+	bool time_supported = false;
+	std::mutex time_mutex;
+	// send times of time commands awaiting their response, which come back in order
+	std::deque<std::chrono::system_clock::time_point> time_requests;
+	std::deque<TimeSample> time_samples;
 
 	void sync(std::function<void(const nlohmann::json&)> data_function);
+	void sync_binary(std::function<void(const nlohmann::json&)> data_function);
+	void handle_response(const nlohmann::json& response, std::function<void(const nlohmann::json&)> data_function);
+	void send_command(const nlohmann::json& request);
+	void write_command(const nlohmann::json& request); // with send_mutex held
+	void start_datagrams(unsigned short port, const std::string& token);
+	void send_hello();
+	void receive_datagram(std::function<void(const nlohmann::json&)> data_function);
+	std::string make_datagram(uint8_t kind) const;
+	void handle_time(const nlohmann::json& response);
+	void deliver_event(const nlohmann::json& data, std::function<void(const nlohmann::json&)> data_function);
 };
\ No newline at end of file
@@ -15,7 +15,6 @@
 #include "arcdps-extension/KeyBindHandler.h"
 #include "arcdps-extension/Singleton.h"
 
-#include "ntp.h"
 #include "mumble_link.h"
 #include "settings.h"
 #include "timer.h"
@@ -29,7 +28,6 @@
 Translation translation;
 KeyBindHandler keybind_handler;
 GW2MumbleLink mumble_link;
-NTPClient ntp("pool.ntp.org");
 GroupTracker group_tracker;
 MapTracker map_tracker(mumble_link);
 Settings settings("addons/arcdps/timer.json", translation, keybind_handler, map_tracker, mumble_link);
@@ -40,7 +38,7 @@ EventStore store(api, settings);
 Timer timer(store, settings, mumble_link, translation, map_tracker);
 BossKillRecognition bosskill(mumble_link, settings);
 
-std::chrono::system_clock::time_point last_ntp_sync;
+std::chrono::system_clock::time_point last_time_sync;
 
 boost::signals2::signal<void(void)> mod_windows_signal;
 boost::signals2::signal<void(void)> mod_options_signal;
@@ -59,16 +57,6 @@ arcdps_exports* mod_init() {
 	arc_exports.wnd_nofilter = mod_wnd;
 
 	timer.clock_offset = 0;
-	defer([&]() {
-		try {
-			timer.clock_offset = ntp.get_time_delta();
-			log_debug("timer: clock offset: " + std::to_string(timer.clock_offset));
-		}
-		catch (NTPException& ex) {
-			log("timer: ntp sync failed");
-			log(std::string(ex.what()));
-		}
-	});
 
 	map_tracker.map_change_signal.connect(std::bind(&Timer::map_change, std::ref(timer), std::placeholders::_1));
 	map_tracker.map_change_signal.connect(std::bind(&TriggerWatcher::map_change, std::ref(trigger_watcher), std::placeholders::_1));
@@ -173,20 +161,15 @@ uintptr_t mod_windows(const char* windowname) {
 uintptr_t mod_imgui(uint32_t not_charsel_or_loading) {
 	if (!not_charsel_or_loading) return 0;
 
-	if (std::chrono::duration_cast<std::chrono::duration<float>>(std::chrono::system_clock::now() - last_ntp_sync).count() > 128) {
-		last_ntp_sync = std::chrono::system_clock::now();
-		defer([&]() {
-			last_ntp_sync = std::chrono::system_clock::now();
-			try {
-				store.clock_offset = ntp.get_time_delta();
-				log_debug("timer: clock offset: " + std::to_string(timer.clock_offset));
-			}
-			catch (NTPException& ex) {
-				log("timer: ntp sync failed");
-				log(std::string(ex.what()));
-			}
-		});
+	// the first round goes out on connecting, the server is everyone's reference clock
+	if (std::chrono::duration_cast<std::chrono::duration<float>>(std::chrono::system_clock::now() - last_time_sync).count() > 128) {
+		if (last_time_sync != std::chrono::system_clock::time_point()) {
+			api.sync_time();
+		}
+		last_time_sync = std::chrono::system_clock::now();
 	}
+	store.clock_offset = api.clock_offset;
+	timer.clock_offset = api.clock_offset;
 
 	map_tracker.watch();
 	trigger_watcher.watch();
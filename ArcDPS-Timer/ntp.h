@@ -1,54 +0,0 @@
-#pragma once
-
-#include <cstdint>
-#include <string>
-#include <stdexcept>
-
-struct NTPPacket {
-    uint8_t li_vn_mode; // Eight bits. li, vn, and mode.
-                        // li.   Two bits.   Leap indicator.
-                        // vn.   Three bits. Version number of the protocol.
-                        // mode. Three bits. Client will pick mode 3 for client.
-
-    uint8_t stratum; // Eight bits. Stratum level of the local clock.
-    uint8_t poll;    // Eight bits. Maximum interval between successive messages.
-    uint8_t precision; // Eight bits. Precision of the local clock.
-
-    uint32_t rootDelay; // 32 bits. Total round trip delay time.
-    uint32_t rootDispersion; // 32 bits. Max error aloud from primary clock source.
-    uint32_t refId;     // 32 bits. Reference clock identifier.
-
-    uint32_t refTm_s; // 32 bits. Reference time-stamp seconds.
-    uint32_t refTm_f; // 32 bits. Reference time-stamp fraction of a second.
-
-    uint32_t origTm_s; // 32 bits. Originate time-stamp seconds.
-    uint32_t origTm_f; // 32 bits. Originate time-stamp fraction of a second.
-
-    uint32_t rxTm_s; // 32 bits. Received time-stamp seconds.
-    uint32_t rxTm_f; // 32 bits. Received time-stamp fraction of a second.
-
-    uint32_t txTm_s; // 32 bits and the most important field the client cares
-                     // about. Transmit time-stamp seconds.
-    uint32_t txTm_f; // 32 bits. Transmit time-stamp fraction of a second.
-};
-
-class NTPException : public std::runtime_error {
-public:
-    explicit NTPException(const std::string& message);
-};
-
-struct NTPInfo {
-    double offset = 0;
-    double bias = 0;
-};
-
-class NTPClient {
-public:
-    NTPClient(std::string host);
-    double get_time_delta();
-
-private:
-    NTPInfo request_time_delta(int retries);
-
-    const std::string host;
-};